@@ -1,5 +1,6 @@
 #include "handle.h"
 #include <stdio.h>
+#include <unistd.h>
 #include "tprintf.h"
 
 handle_mgr mgr;
@@ -14,11 +15,21 @@ handle::safebind()
 {
   if (!h)
     return NULL;
+
+  // established, take the next bound connection
+  int n = h->nbound;
+  if (n > 0) {
+    __sync_synchronize();
+    if (h->del)
+      return NULL;
+    return h->cl[__sync_fetch_and_add(&h->next, 1) % n];
+  }
+
   ScopedLock ml(&h->cl_mutex);
   if (h->del)
     return NULL;
-  if (h->cl)
-    return h->cl;
+  if (h->nbound > 0)
+    return h->cl[0];
   sockaddr_in dstsock;
   make_sockaddr(h->m.c_str(), &dstsock);
   rpcc *cl = new rpcc(dstsock);
@@ -36,11 +47,15 @@ handle::safebind()
     tprintf("handle_mgr::get_handle bind failure! %s %d\n", h->m.c_str(), ret);
     delete cl;
     h->del = true;
-  } else {
-    tprintf("handle_mgr::get_handle bind succeeded %s\n", h->m.c_str());
-    h->cl = cl;
+    return NULL;
   }
-  return h->cl;
+  tprintf("handle_mgr::get_handle bind succeeded %s\n", h->m.c_str());
+  h->cl[0] = cl;
+  __sync_synchronize();
+  h->nbound = 1;
+  // the rest are bound in the background
+  mgr.grow(h);
+  return cl;
 }
 
 handle::~handle() 
@@ -50,46 +65,81 @@ handle::~handle()
 
 handle_mgr::handle_mgr()
 {
-  VERIFY (pthread_mutex_init(&handle_mutex, NULL) == 0);
+  VERIFY (pthread_rwlock_init(&handle_lock, NULL) == 0);
+  VERIFY (pthread_mutex_init(&bind_mutex, NULL) == 0);
+  VERIFY (pthread_cond_init(&bind_cond, NULL) == 0);
+  binder_started = false;
 }
 
 struct hinfo *
 handle_mgr::get_handle(std::string m)
 {
-  ScopedLock ml(&handle_mutex);
   struct hinfo *h = 0;
-  if (hmap.find(m) == hmap.end()) {
+  std::map<std::string, struct hinfo *>::iterator it;
+
+  VERIFY (pthread_rwlock_rdlock(&handle_lock) == 0);
+  it = hmap.find(m);
+  if (it != hmap.end()) {
+    if (!it->second->del) {
+      h = it->second;
+      __sync_fetch_and_add(&h->refcnt, 1);
+    }
+    VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+    return h;
+  }
+  VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+
+  VERIFY (pthread_rwlock_wrlock(&handle_lock) == 0);
+  it = hmap.find(m);
+  if (it == hmap.end()) {
     h = new hinfo;
-    h->cl = NULL;
+    h->nbound = 0;
+    h->next = 0;
     h->del = false;
+    h->queued = false;
+    h->failures = 0;
     h->refcnt = 1;
     h->m = m;
     pthread_mutex_init(&h->cl_mutex, NULL);
     hmap[m] = h;
-  } else if (!hmap[m]->del) {
-    h = hmap[m];
-    h->refcnt ++;
+  } else if (!it->second->del) {
+    h = it->second;
+    __sync_fetch_and_add(&h->refcnt, 1);
   }
+  VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
   return h;
 }
 
 void 
 handle_mgr::done_handle(struct hinfo *h)
 {
-  ScopedLock ml(&handle_mutex);
-  h->refcnt--;
-  if (h->refcnt == 0 && h->del)
-    delete_handle_wo(h->m);
+  std::string m;
+
+  VERIFY (pthread_rwlock_rdlock(&handle_lock) == 0);
+  bool last = __sync_sub_and_fetch(&h->refcnt, 1) == 0 && h->del;
+  if (last)
+    m = h->m;
+  VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+
+  if (last) {
+    // h may be gone by now, look it up again
+    VERIFY (pthread_rwlock_wrlock(&handle_lock) == 0);
+    std::map<std::string, struct hinfo *>::iterator it = hmap.find(m);
+    if (it != hmap.end() && it->second == h && h->refcnt == 0)
+      delete_handle_wo(m);
+    VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+  }
 }
 
 void
 handle_mgr::delete_handle(std::string m)
 {
-  ScopedLock ml(&handle_mutex);
+  VERIFY (pthread_rwlock_wrlock(&handle_lock) == 0);
   delete_handle_wo(m);
+  VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
 }
 
-// Must be called with handle_mutex locked.
+// Must be called with handle_lock write-locked.
 void
 handle_mgr::delete_handle_wo(std::string m)
 {
@@ -100,9 +150,9 @@ handle_mgr::delete_handle_wo(std::string m)
 	   hmap[m]->refcnt);
     struct hinfo *h = hmap[m];
     if (h->refcnt == 0) {
-      if (h->cl) {
-        h->cl->cancel();
-        delete h->cl;
+      for (int i = 0; i < h->nbound; i++) {
+        h->cl[i]->cancel();
+        delete h->cl[i];
       }
       pthread_mutex_destroy(&h->cl_mutex);
       hmap.erase(m);
@@ -112,3 +162,87 @@ handle_mgr::delete_handle_wo(std::string m)
     }
   }
 }
+
+// queue h for the binder, which keeps a reference until it is done
+void
+handle_mgr::grow(struct hinfo *h)
+{
+  ScopedLock ml(&bind_mutex);
+  if (h->queued)
+    return;
+  h->queued = true;
+  __sync_fetch_and_add(&h->refcnt, 1);
+  to_bind.push_back(h);
+  if (!binder_started) {
+    pthread_t th;
+    VERIFY (pthread_create(&th, NULL, &handle_mgr::binder_thread, this) == 0);
+    pthread_detach(th);
+    binder_started = true;
+  }
+  VERIFY (pthread_cond_signal(&bind_cond) == 0);
+}
+
+void *
+handle_mgr::binder_thread(void *x)
+{
+  ((handle_mgr *) x)->binder();
+  return 0;
+}
+
+// bind one more connection per turn for each queued handle, so a slow
+// or dead host holds up the others for at most one bind timeout.
+void
+handle_mgr::binder()
+{
+  VERIFY (pthread_mutex_lock(&bind_mutex) == 0);
+  while (true) {
+    while (to_bind.empty())
+      VERIFY (pthread_cond_wait(&bind_cond, &bind_mutex) == 0);
+    struct hinfo *h = to_bind.front();
+    to_bind.pop_front();
+    VERIFY (pthread_mutex_unlock(&bind_mutex) == 0);
+
+    rpcc *cl = NULL;
+    if (!h->del) {
+      sockaddr_in dstsock;
+      make_sockaddr(h->m.c_str(), &dstsock);
+      cl = new rpcc(dstsock);
+      if (cl->bind(rpcc::to(1000)) < 0) {
+        tprintf("handle_mgr::binder bind failure %s\n", h->m.c_str());
+        delete cl;
+        cl = NULL;
+      }
+    }
+
+    bool more, backoff;
+    {
+      ScopedLock ml(&h->cl_mutex);
+      if (cl && !h->del && h->nbound < HANDLE_CONNS) {
+        h->cl[h->nbound] = cl;
+        __sync_synchronize();
+        h->nbound++;
+        h->failures = 0;
+        cl = NULL;
+      } else if (!cl) {
+        h->failures++;
+      }
+      more = !h->del && h->nbound < HANDLE_CONNS && h->failures < HANDLE_RETRIES;
+      backoff = more && h->failures > 0;
+    }
+    if (cl)
+      delete cl;
+    // give a host that refused us a moment before trying it again
+    if (backoff)
+      sleep(1);
+
+    VERIFY (pthread_mutex_lock(&bind_mutex) == 0);
+    if (more) {
+      to_bind.push_back(h);
+    } else {
+      h->queued = false;
+      VERIFY (pthread_mutex_unlock(&bind_mutex) == 0);
+      done_handle(h);
+      VERIFY (pthread_mutex_lock(&bind_mutex) == 0);
+    }
+  }
+}
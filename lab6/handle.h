@@ -19,18 +19,40 @@
 // safebind() just returns the previously
 // created rpcc*. best not to hold any
 // mutexes while calling safebind().
+//
+// a destination gets up to HANDLE_CONNS
+// connections. the first is bound by the
+// first safebind(); the others are bound,
+// and rebound after a failure, by a
+// background thread. safebind() hands the
+// bound ones out in turn, so that threads
+// talking to the same host do not all
+// queue behind one socket.
 
 #ifndef handle_h
 #define handle_h
 
 #include <string>
 #include <vector>
+#include <list>
+#include <map>
 #include "rpc.h"
 
+#define HANDLE_CONNS 4
+// failed background binds in a row before giving up on more connections
+#define HANDLE_RETRIES 3
+
 struct hinfo {
-  rpcc *cl;
+  // cl[0..nbound-1] are bound. a connection is only added, never
+  // removed, until the handle is deleted, so callers pick one without
+  // taking cl_mutex.
+  rpcc *cl[HANDLE_CONNS];
+  volatile int nbound;
+  unsigned next;
   int refcnt;
-  bool del;
+  volatile bool del;
+  bool queued;  // waiting for the binder
+  int failures; // failed background binds in a row
   std::string m;
   pthread_mutex_t cl_mutex;
 };
@@ -47,7 +69,8 @@ class handle {
    *
    * return: 
    *   if the first safebind succeeded, all later calls would return
-   *   a rpcc object; otherwise, all later calls would return NULL.
+   *   a rpcc object, not always the same one; otherwise, all later
+   *   calls would return NULL.
    *
    * Example:
    *   handle h(dst);
@@ -64,14 +87,25 @@ class handle {
 
 class handle_mgr {
  private:
-  pthread_mutex_t handle_mutex;
+  // lookups of existing handles share the lock, only adding and
+  // deleting a handle takes it exclusively.
+  pthread_rwlock_t handle_lock;
   std::map<std::string, struct hinfo *> hmap;
+
+  // handles that want more connections, each holds a reference
+  pthread_mutex_t bind_mutex;
+  pthread_cond_t bind_cond;
+  std::list<struct hinfo *> to_bind;
+  bool binder_started;
+  void binder();
+  static void *binder_thread(void *x);
  public:
   handle_mgr();
   struct hinfo *get_handle(std::string m);
   void done_handle(struct hinfo *h);
   void delete_handle(std::string m);
   void delete_handle_wo(std::string m);
+  void grow(struct hinfo *h);
 };
 
 extern class handle_mgr mgr;
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <algorithm>
+#include "bench.h"
+
+static volatile bool stop;
+
+double bench_now() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+bool bench_result::add(double start, bool ok, double nbytes) {
+    latencies.push_back(bench_now() - start);
+    ops++;
+    bytes += nbytes;
+    failed = failed || !ok;
+    return ok;
+}
+
+struct bench_thread {
+    pthread_t th;
+    void *ctx;
+    bench_op op;
+    bench_result r;
+};
+
+static void *run(void *x) {
+    bench_thread *t = (bench_thread *) x;
+    for (long i = 0; !stop && !t->r.failed; i++) {
+        double start = bench_now();
+        t->r.add(start, t->op(t->ctx, i));
+    }
+    return NULL;
+}
+
+void bench_measure(const std::vector<void *> &ctxs, bench_op op, int seconds, bench_result &r) {
+    std::vector<bench_thread> ts(ctxs.size());
+    stop = false;
+
+    double start = bench_now();
+    for (size_t i = 0; i < ts.size(); i++) {
+        ts[i].ctx = ctxs[i];
+        ts[i].op = op;
+        pthread_create(&ts[i].th, NULL, run, &ts[i]);
+    }
+    sleep(seconds);
+    stop = true;
+
+    for (size_t i = 0; i < ts.size(); i++) {
+        pthread_join(ts[i].th, NULL);
+        r.ops += ts[i].r.ops;
+        r.failed = r.failed || ts[i].r.failed;
+        r.latencies.insert(r.latencies.end(), ts[i].r.latencies.begin(), ts[i].r.latencies.end());
+    }
+    r.seconds = bench_now() - start;
+}
+
+static double percentile(std::vector<double> &v, double q) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t) (q * (v.size() - 1))] * 1000000;
+}
+
+void bench_report(const char *test, int threads, bench_result &r) {
+    if (r.failed) {
+        printf("test=%s threads=%d failed=1\n", test, threads);
+    } else {
+        double s = r.seconds > 0 ? r.seconds : 1e-9;
+        printf("test=%s threads=%d ops=%ld seconds=%.3f ops_per_sec=%.1f mb_per_sec=%.2f p50_us=%.0f p99_us=%.0f\n",
+               test, threads, r.ops, r.seconds, r.ops / s, r.bytes / s / (1024 * 1024),
+               percentile(r.latencies, 0.5), percentile(r.latencies, 0.99));
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,38 @@
+// timing, threads and reports shared by fs_bench and rpc_bench.
+//
+// a test runs an operation on one thread per context for some seconds,
+// merges what the threads did into a bench_result, and prints it as one
+// line of key=value pairs, for scripts to compare runs: operations,
+// seconds, operations and MB per second, and the median and 99th
+// percentile latency of an operation in microseconds.
+
+#ifndef bench_h
+#define bench_h
+
+#include <vector>
+
+double bench_now();
+
+struct bench_result {
+    long ops;
+    double bytes;
+    double seconds;
+    std::vector<double> latencies;  // of every operation, in seconds
+    bool failed;
+
+    bench_result() : ops(0), bytes(0), seconds(0), failed(false) {}
+
+    // time one operation started at start, false if it failed
+    bool add(double start, bool ok, double nbytes = 0);
+};
+
+// operation number round of the thread given ctx, false if it failed
+typedef bool (*bench_op)(void *ctx, long round);
+
+// runs op over and over on a thread per context until seconds are up or
+// one of them fails
+void bench_measure(const std::vector<void *> &ctxs, bench_op op, int seconds, bench_result &r);
+
+void bench_report(const char *test, int threads, bench_result &r);
+
+#endif
@@ -0,0 +1,149 @@
+/* directory benchmark.
+ * Create files in one directory, in the hashed format and in the former flat
+ * format (one "name\0inum" blob rewritten as a whole), and report the mean
+ * latency of every window of creates as the directory grows.
+ * Both run against extent_server in process: the hashed format through its
+ * dir_lookup/dir_add calls, the flat one through get/put as yfs_client used
+ * to. Entries point to made-up inums, since the inode table holds only
+ * INODE_NUM inodes.
+ *
+ * usage: dir_bench [files]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "extent_server.h"
+
+#define WINDOW 500
+#define FLAT_MAX 2000  // the flat format logs two whole images per create
+
+static double now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static std::string name_of(int i) {
+    char name[16];
+    sprintf(name, "file%05d", i);
+    return name;
+}
+
+static int hashed_create(extent_server *es, extent_protocol::extentid_t dir, int i) {
+    extent_protocol::extentid_t inum;
+    int r;
+
+    if (es->dir_lookup(dir, name_of(i), inum) != extent_protocol::NOENT)
+        return 0;
+    return es->dir_add(dir, name_of(i), i + 2, r) == extent_protocol::OK;
+}
+
+static void flat_read(extent_server *es, extent_protocol::extentid_t dir, std::list<std::pair<std::string, uint32_t> > &entries) {
+    std::string content;
+    es->get(dir, content);
+
+    std::istringstream ist(content);
+    std::pair<std::string, uint32_t> entry;
+    entries.clear();
+    while (std::getline(ist, entry.first, '\0')) {
+        ist >> entry.second;
+        entries.push_back(entry);
+    }
+}
+
+// the former client path: parse all to check for a duplicate, then parse
+// again, append and write everything back
+static int flat_create(extent_server *es, extent_protocol::extentid_t dir, int i) {
+    std::list<std::pair<std::string, uint32_t> > entries;
+    std::string name = name_of(i);
+    int r;
+
+    flat_read(es, dir, entries);
+    for (std::list<std::pair<std::string, uint32_t> >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (it->first == name)
+            return 0;
+    }
+
+    flat_read(es, dir, entries);
+    entries.push_back(std::make_pair(name, (uint32_t)(i + 2)));
+
+    std::ostringstream ost;
+    for (std::list<std::pair<std::string, uint32_t> >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        ost << it->first;
+        ost.put('\0');
+        ost << it->second;
+    }
+
+    std::string content = ost.str();
+    if ((unsigned)content.size() > MAXFILESIZE)
+        return 0;
+    es->put(dir, content, r);
+    return 1;
+}
+
+// mean microseconds per create of each window, until files or a failure
+static std::vector<double> run(int (*create)(extent_server *, extent_protocol::extentid_t, int), int files, int &created) {
+    unlink("disk.log");
+    extent_server *es = new extent_server();
+    extent_protocol::extentid_t dir;
+    es->create(extent_protocol::T_DIR, dir);
+    std::vector<double> windows;
+
+    created = 0;
+    for (int i = 0; i + WINDOW <= files; i += WINDOW) {
+        double start = now_us();
+        for (int j = i; j < i + WINDOW; j++, created++) {
+            if (!create(es, dir, j))
+                return windows;
+        }
+        windows.push_back((now_us() - start) / WINDOW);
+    }
+    return windows;
+}
+
+int main(int argc, char *argv[]) {
+    int files = argc > 1 ? atoi(argv[1]) : 10000;
+
+    char dir[] = "/tmp/dir_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror("dir_bench: temp dir");
+        return 1;
+    }
+
+    // keep the inode layer quiet, results go to stderr
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        perror("dir_bench: /dev/null");
+        return 1;
+    }
+
+    int hashed_files, flat_files;
+    std::vector<double> hashed = run(hashed_create, files, hashed_files);
+    std::vector<double> flat = run(flat_create, files < FLAT_MAX ? files : FLAT_MAX, flat_files);
+
+    fprintf(stderr, "%8s %12s %12s\n", "files", "hashed_us", "flat_us");
+    for (size_t i = 0; i < hashed.size() || i < flat.size(); i++) {
+        fprintf(stderr, "%8lu", (i + 1) * WINDOW);
+        if (i < hashed.size())
+            fprintf(stderr, " %12.1f", hashed[i]);
+        else
+            fprintf(stderr, " %12s", "-");
+        if (i < flat.size())
+            fprintf(stderr, " %12.1f", flat[i]);
+        else
+            fprintf(stderr, " %12s", "-");
+        fprintf(stderr, "\n");
+    }
+    if (hashed_files < files)
+        fprintf(stderr, "hashed directory full after %d files\n", hashed_files);
+
+    unlink("disk.log");
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,391 @@
+/* directory tester.
+ * Checks the hashed directory format against a model: random adds, removes
+ * and lookups that split buckets, a directory filled up to
+ * HASHDIR_MAX_DEPTH, and scans resumed page by page while entries come and
+ * go. Then checks the directory calls of extent_server in process: link
+ * and unlink with the link counts they leave, and renames within and
+ * between directories, over other files and under themselves. A last
+ * process checks that what they left survives a restart.
+ *
+ * usage: dir_tester [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <iterator>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "extent_server.h"
+#include "hashdir.h"
+
+#define NAMES      1500  // short names the random workload picks from
+#define OPS        4000
+#define LONG_NAME  100   // four to a bucket
+#define SCAN_PAGE  7
+
+typedef std::map<std::string, uint32_t> model_t;  // name -> inum
+
+static int failures;
+
+static void expect(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "[TEST_ERROR]: %s\n", what);
+        failures++;
+    }
+}
+
+static std::string name_of(unsigned int n, size_t len) {
+    char name[16];
+    snprintf(name, sizeof(name), "e%u.", n);
+    std::string s = name;
+    s.resize(len > s.size() ? len : s.size(), 'x');
+    return s;
+}
+
+static int buckets_of(const std::string &content) {
+    return content.empty() ? 0 : content.size() / BLOCK_SIZE - 1;
+}
+
+// true if the directory holds exactly the entries of the model
+static bool matches(hashdir::storage &s, const model_t &names) {
+    std::list<hashdir::entry> entries;
+    int n;
+    if (hashdir::list(s, entries) != hashdir::OK || hashdir::count(s, n) != hashdir::OK)
+        return false;
+    if (n != (int) names.size() || entries.size() != names.size())
+        return false;
+
+    for (std::list<hashdir::entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        model_t::const_iterator m = names.find(it->name);
+        uint32_t inum;
+        if (m == names.end() || m->second != it->inum ||
+            hashdir::lookup(s, it->name, inum) != hashdir::OK || inum != it->inum)
+            return false;
+    }
+    return true;
+}
+
+static void check_empty() {
+    std::string content;
+    hashdir::memory s(content);
+    std::list<hashdir::entry> entries;
+    uint32_t inum;
+    int n = -1;
+
+    expect(hashdir::lookup(s, "a", inum) == hashdir::NOENT, "lookup in an empty directory");
+    expect(hashdir::remove(s, "a", inum) == hashdir::NOENT, "remove from an empty directory");
+    expect(hashdir::count(s, n) == hashdir::OK && n == 0, "count of an empty directory");
+    expect(hashdir::scan(s, 0, SCAN_PAGE, entries) == hashdir::OK && entries.empty(),
+           "scan of an empty directory");
+}
+
+// random adds, removes and lookups, enough to split buckets many times
+static void check_random(unsigned int seed) {
+    std::string content;
+    hashdir::memory s(content);
+    model_t names;
+
+    for (int i = 0; i < OPS; i++) {
+        int op = rand_r(&seed) % 10;
+        std::string name = name_of(rand_r(&seed) % NAMES, 8);
+        model_t::iterator it = names.find(name);
+        uint32_t inum = 0;
+
+        if (op < 5) {
+            int r = hashdir::add(s, name, i + 2);
+            if (it != names.end()) {
+                expect(r == hashdir::EXIST, "add of a present name");
+            } else {
+                expect(r == hashdir::OK, "add of a new name");
+                names[name] = i + 2;
+            }
+        } else if (op < 7) {
+            int r = hashdir::remove(s, name, inum);
+            if (it != names.end()) {
+                expect(r == hashdir::OK && inum == it->second, "remove of a present name");
+                names.erase(it);
+            } else {
+                expect(r == hashdir::NOENT, "remove of a missing name");
+            }
+        } else {
+            int r = hashdir::lookup(s, name, inum);
+            if (it != names.end())
+                expect(r == hashdir::OK && inum == it->second, "lookup of a present name");
+            else
+                expect(r == hashdir::NOENT, "lookup of a missing name");
+        }
+    }
+
+    expect(buckets_of(content) > 1, "no bucket was split");
+    expect(matches(s, names), "directory differs from the model");
+}
+
+// long names until NOSPC, with the table at HASHDIR_MAX_DEPTH
+static void check_full() {
+    std::string content;
+    hashdir::memory s(content);
+    model_t names;
+
+    std::string refused;
+    for (unsigned int i = 0; i < 100 * (1 << HASHDIR_MAX_DEPTH); i++) {
+        std::string name = name_of(i, LONG_NAME);
+        int r = hashdir::add(s, name, i + 2);
+        if (r == hashdir::NOSPC) {
+            refused = name;
+            break;
+        }
+        expect(r == hashdir::OK, "add to a filling directory");
+        names[name] = i + 2;
+    }
+
+    uint32_t inum;
+    expect(!refused.empty(), "directory never filled up");
+    expect(buckets_of(content) <= 1 << HASHDIR_MAX_DEPTH, "more buckets than the table holds");
+    expect(hashdir::lookup(s, refused, inum) == hashdir::NOENT, "refused name was added");
+    expect(matches(s, names), "full directory differs from the model");
+
+    expect(hashdir::add(s, "", 1) == hashdir::NOSPC, "add of an empty name");
+    expect(hashdir::add(s, std::string(HASHDIR_MAX_NAME + 1, 'n'), 1) == hashdir::NOSPC,
+           "add of a name over HASHDIR_MAX_NAME");
+
+    // buckets stay, but their room is free again
+    for (model_t::iterator it = names.begin(); it != names.end(); ++it)
+        expect(hashdir::remove(s, it->first, inum) == hashdir::OK, "remove from a full directory");
+    names.clear();
+    expect(matches(s, names), "emptied directory still has entries");
+
+    expect(hashdir::add(s, refused, 1) == hashdir::OK, "refused name does not fit after removes");
+    expect(hashdir::add(s, std::string(HASHDIR_MAX_NAME, 'n'), 2) == hashdir::OK,
+           "add of a name of HASHDIR_MAX_NAME");
+}
+
+// a page at a time, adding and removing entries between pages. what was
+// there all along is listed exactly once, what is listed was there when
+// its page was read, and positions only grow.
+static void check_scan(unsigned int seed) {
+    std::string content;
+    hashdir::memory s(content);
+    model_t names;
+    unsigned int next = 0;
+
+    for (; next < NAMES / 2; next++) {
+        names[name_of(next, 8)] = next + 2;
+        hashdir::add(s, name_of(next, 8), next + 2);
+    }
+    model_t initial = names;
+    std::set<std::string> removed, listed;
+
+    uint64_t pos = 0;
+    bool more = true;
+    while (more) {
+        std::list<hashdir::entry> entries;
+        expect(hashdir::scan(s, pos, SCAN_PAGE, entries) == hashdir::OK, "scan failed");
+        more = entries.size() == SCAN_PAGE;
+
+        for (std::list<hashdir::entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+            expect(it->next > pos, "scan went backwards");
+            expect(names.count(it->name) == 1, "scan listed a name not in the directory");
+            expect(listed.insert(it->name).second, "scan listed a name twice");
+            pos = it->next;
+        }
+
+        // a split of the bucket of pos must not lose or repeat a thing
+        for (int i = rand_r(&seed) % 4; i > 0; i--, next++) {
+            names[name_of(next, 8)] = next + 2;
+            expect(hashdir::add(s, name_of(next, 8), next + 2) == hashdir::OK, "add during scan");
+        }
+        for (int i = rand_r(&seed) % 3; i > 0 && !names.empty(); i--) {
+            model_t::iterator it = names.begin();
+            std::advance(it, rand_r(&seed) % names.size());
+            uint32_t inum;
+            expect(hashdir::remove(s, it->first, inum) == hashdir::OK, "remove during scan");
+            removed.insert(it->first);
+            names.erase(it);
+        }
+    }
+
+    for (model_t::iterator it = initial.begin(); it != initial.end(); ++it) {
+        if (!removed.count(it->first) && !listed.count(it->first)) {
+            expect(false, "scan missed a name that was there all along");
+            break;
+        }
+    }
+    expect(buckets_of(content) > 1, "no bucket was split during the scan");
+}
+
+static void report(const char *test, int before) {
+    printf("%s: %s\n", test, failures == before ? "ok" : "FAILED");
+}
+
+// extent_server directory calls
+
+static extent_protocol::extentid_t lookup(extent_server *es, extent_protocol::extentid_t dir, const char *name) {
+    extent_protocol::extentid_t id = 0;
+    return es->dir_lookup(dir, name, id) == extent_protocol::OK ? id : 0;
+}
+
+static extent_protocol::attr attr_of(extent_server *es, extent_protocol::extentid_t id) {
+    extent_protocol::attr a;
+    es->getattr(id, a);
+    return a;
+}
+
+// a/b, a/m2 and a/b/m3 are left, the last two one file
+static void server_stage() {
+    extent_server *es = new extent_server();
+    extent_protocol::dirent a, b, f, x, y, m;
+    extent_protocol::extentid_t id, replaced;
+    int r;
+
+    expect(es->dir_create(1, "a", extent_protocol::T_DIR, a) == extent_protocol::OK &&
+           es->dir_create(a.inum, "b", extent_protocol::T_DIR, b) == extent_protocol::OK &&
+           es->dir_create(1, "f", extent_protocol::T_FILE, f) == extent_protocol::OK &&
+           es->dir_create(1, "x", extent_protocol::T_FILE, x) == extent_protocol::OK &&
+           es->dir_create(1, "y", extent_protocol::T_FILE, y) == extent_protocol::OK,
+           "dir_create failed");
+    expect(attr_of(es, f.inum).nlink == 1, "new file has nlink other than 1");
+
+    // link and unlink
+    expect(es->dir_link(a.inum, "g", f.inum, r) == extent_protocol::OK, "dir_link failed");
+    expect(attr_of(es, f.inum).nlink == 2, "link left nlink other than 2");
+    expect(es->dir_link(a.inum, "g", f.inum, r) == extent_protocol::EXIST, "dir_link over a name");
+    expect(attr_of(es, f.inum).nlink == 2, "failed link changed nlink");
+
+    expect(es->dir_unlink(1, "f", 0, id) == extent_protocol::OK && id == f.inum, "dir_unlink failed");
+    expect(attr_of(es, f.inum).nlink == 1 && attr_of(es, f.inum).type != 0,
+           "unlink of one of two links");
+    expect(lookup(es, a.inum, "g") == f.inum, "other link lost in unlink");
+    expect(es->dir_unlink(1, "f", 0, id) == extent_protocol::NOENT, "dir_unlink of a missing name");
+
+    // rename between directories, and over other files
+    expect(es->dir_rename(a.inum, "g", b.inum, "h", 0, replaced) == extent_protocol::OK &&
+           replaced == 0, "dir_rename between directories");
+    expect(lookup(es, b.inum, "h") == f.inum && lookup(es, a.inum, "g") == 0,
+           "rename between directories left wrong entries");
+    expect(attr_of(es, f.inum).nlink == 1, "rename changed nlink");
+
+    expect(es->dir_rename(b.inum, "h", 1, "x", 0, replaced) == extent_protocol::OK &&
+           replaced == x.inum, "dir_rename over a closed file");
+    expect(attr_of(es, x.inum).type == 0, "file renamed over, and closed, not freed");
+    expect(lookup(es, 1, "x") == f.inum && lookup(es, b.inum, "h") == 0,
+           "rename over a file left wrong entries");
+
+    expect(es->dir_rename(1, "x", 1, "y", 1, replaced) == extent_protocol::OK &&
+           replaced == y.inum, "dir_rename over an open file");
+    expect(attr_of(es, y.inum).type != 0 && attr_of(es, y.inum).nlink == 0,
+           "file renamed over, but open, freed or still linked");
+    es->remove(y.inum, r);  // as the last close does
+
+    // onto another name of the same file changes nothing
+    expect(es->dir_link(1, "z", f.inum, r) == extent_protocol::OK, "dir_link failed");
+    expect(es->dir_rename(1, "y", 1, "z", 0, replaced) == extent_protocol::OK && replaced == 0,
+           "dir_rename onto a link of the same file");
+    expect(lookup(es, 1, "y") == f.inum && lookup(es, 1, "z") == f.inum &&
+           attr_of(es, f.inum).nlink == 2, "rename onto a link of the same file changed it");
+    expect(es->dir_rename(1, "nope", a.inum, "n", 0, replaced) == extent_protocol::NOENT,
+           "dir_rename of a missing name");
+
+    // a directory does not move under itself
+    expect(es->dir_rename(1, "a", b.inum, "a", 0, replaced) == extent_protocol::INVAL,
+           "directory renamed under its child");
+    expect(es->dir_rename(1, "a", a.inum, "a", 0, replaced) == extent_protocol::INVAL,
+           "directory renamed into itself");
+    expect(lookup(es, 1, "a") == a.inum && lookup(es, a.inum, "b") == b.inum,
+           "refused rename changed the tree");
+
+    int below = -1;
+    expect(es->dir_below(b.inum, a.inum, below) == extent_protocol::OK && below == 1, "b is below a");
+    expect(es->dir_below(a.inum, b.inum, below) == extent_protocol::OK && below == 0, "a is not below b");
+    expect(es->dir_below(a.inum, a.inum, below) == extent_protocol::OK && below == 1, "a is below itself");
+
+    // the last unlink frees the file
+    expect(es->dir_unlink(1, "z", 0, id) == extent_protocol::OK && attr_of(es, f.inum).nlink == 1,
+           "unlink of one of two links");
+    expect(es->dir_unlink(1, "y", 0, id) == extent_protocol::OK && attr_of(es, f.inum).type == 0,
+           "last unlink did not free the file");
+
+    // for the restart
+    expect(es->dir_create(1, "m", extent_protocol::T_FILE, m) == extent_protocol::OK &&
+           es->dir_link(a.inum, "m2", m.inum, r) == extent_protocol::OK &&
+           es->dir_rename(1, "m", b.inum, "m3", 0, replaced) == extent_protocol::OK,
+           "setup for the restart");
+    exit(failures ? 1 : 0);
+}
+
+static void restart_stage() {
+    extent_server *es = new extent_server();
+    extent_protocol::extentid_t a = lookup(es, 1, "a");
+    extent_protocol::extentid_t b = lookup(es, a, "b");
+    extent_protocol::extentid_t m = lookup(es, b, "m3");
+
+    expect(a && b && m, "entries lost in restart");
+    expect(lookup(es, a, "m2") == m && attr_of(es, m).nlink == 2, "link lost in restart");
+    expect(!lookup(es, 1, "m") && !lookup(es, 1, "x") && !lookup(es, 1, "y") && !lookup(es, 1, "z"),
+           "removed entries back after restart");
+    exit(failures ? 1 : 0);
+}
+
+// each stage runs in a process of its own, like a server that is
+// restarted, and leaves its output out of the way
+static bool run_stage(void (*stage)()) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        stage();
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void clean_log() {
+    unlink("disk.log");
+    unlink("disk.log.tags");
+    unlink("disk.log.version");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int seed = argc > 1 ? atoi(argv[1]) : getpid();
+
+    char dir[] = "/tmp/dir_tester.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror("dir_tester: temp dir");
+        return 1;
+    }
+    printf("seed %u\n", seed);
+
+    int before = failures;
+    check_empty();
+    report("empty directory", before);
+
+    before = failures;
+    check_random(seed);
+    report("random adds, removes and lookups", before);
+
+    before = failures;
+    check_full();
+    report("full directory", before);
+
+    before = failures;
+    check_scan(seed);
+    report("scan while entries change", before);
+
+    clean_log();
+    bool server_ok = run_stage(server_stage);
+    printf("link, unlink and rename: %s\n", server_ok ? "ok" : "FAILED");
+    bool restart_ok = server_ok && run_stage(restart_stage);
+    printf("links and renames across restarts: %s\n", restart_ok ? "ok" : "FAILED");
+
+    clean_log();
+    rmdir(dir);
+    return failures == 0 && server_ok && restart_ok ? 0 : 1;
+}
@@ -1,53 +1,186 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include "logger.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
 
+static void *callerthread(void *x) {
+    extent_client *ec = (extent_client *) x;
+    ec->caller();
+    return 0;
+}
+
+extent_call::extent_call() {
+    done = false;
+    ret = extent_protocol::OK;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+extent_call::~extent_call() {
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
 extent_client::extent_client(std::string dst) {
     sockaddr_in dstsock;
 
-    make_sockaddr(dst.c_str(), &dstsock);
-    cl = new rpcc(dstsock);
+    pthread_mutex_init(&calls_mutex, NULL);
+    pthread_cond_init(&calls_cond, NULL);
+    callers_started = false;
 
-    if (cl->bind() != 0) {
-        printf("extent_client: bind failed\n");
+    make_sockaddr(dst.c_str(), &dstsock);
+    next = 0;
+    for (int i = 0; i < EXTENT_CONNS; i++) {
+        cls[i] = new rpcc(dstsock);
+        if (cls[i]->bind() != 0) {
+            LOG(ERROR, "extent_client: bind failed\n");
+        }
     }
 }
 
 // a demo to show how to use RPC
 extent_protocol::status extent_client::getattr(extent_protocol::extentid_t eid, extent_protocol::attr & attr) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::getattr, eid, attr);
+    ret = conn()->call(extent_protocol::getattr, eid, attr);
     return ret;
 }
 
 extent_protocol::status extent_client::create(uint32_t type, extent_protocol::extentid_t& id) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::create, type, id);
+    ret = conn()->call(extent_protocol::create, type, id);
     return ret;
 }
 
 extent_protocol::status extent_client::get(extent_protocol::extentid_t eid, std::string& buf) {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::get, eid, buf);
+    ret = conn()->call(extent_protocol::get, eid, buf);
     return ret;
 }
 
-extent_protocol::status extent_client::put(extent_protocol::extentid_t eid, std::string buf) {
+extent_protocol::status extent_client::put(extent_protocol::extentid_t eid, const std::string &buf) {
     extent_protocol::status ret = extent_protocol::OK;
     int i; // placeholder
-    ret = cl->call(extent_protocol::put, eid, buf, i);
+    ret = conn()->call(extent_protocol::put, eid, buf, i);
     return ret;
 }
 
 extent_protocol::status extent_client::remove(extent_protocol::extentid_t eid) {
     extent_protocol::status ret = extent_protocol::OK;
     int i; // placeholder
-    ret = cl->call(extent_protocol::remove, eid, i);
+    ret = conn()->call(extent_protocol::remove, eid, i);
+    return ret;
+}
+
+extent_protocol::status extent_client::get_block(extent_protocol::extentid_t eid, int index, std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::get_block, eid, index, buf);
+    return ret;
+}
+
+extent_protocol::status extent_client::put_block(extent_protocol::extentid_t eid, int index, const std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int r;
+    ret = conn()->call(extent_protocol::put_block, eid, index, buf, r);
+    return ret;
+}
+
+extent_protocol::status extent_client::get_range(extent_protocol::extentid_t eid, unsigned int off, unsigned int size, std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::get_range, eid, off, size, buf);
+    return ret;
+}
+
+extent_protocol::status extent_client::multi_get(const std::vector<extent_protocol::extentid_t> &eids, std::vector<std::string> &bufs) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::multi_get, eids, bufs);
+    return ret;
+}
+
+extent_protocol::status extent_client::multi_getattr(const std::vector<extent_protocol::extentid_t> &eids, std::vector<extent_protocol::attr> &attrs) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::multi_getattr, eids, attrs);
+    return ret;
+}
+
+extent_protocol::status extent_client::multi_put(const std::vector<extent_protocol::extentid_t> &eids, const std::vector<std::string> &bufs) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int r;
+    ret = conn()->call(extent_protocol::multi_put, eids, bufs, r);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_lookup(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &eid) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::dir_lookup, dir, name, eid);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_add(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t eid) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int i; // placeholder
+    ret = conn()->call(extent_protocol::dir_add, dir, name, eid, i);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_remove(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &eid) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::dir_remove, dir, name, eid);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_read(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &entries) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::dir_read, dir, pos, max, entries);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_readplus(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &entries) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::dir_readplus, dir, pos, max, entries);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_lookupplus(extent_protocol::extentid_t dir, std::string name, extent_protocol::dirent &entry) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::dir_lookupplus, dir, name, entry);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_create(extent_protocol::extentid_t dir, std::string name, uint32_t type, extent_protocol::dirent &entry) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::dir_create, dir, name, type, entry);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_rename(extent_protocol::extentid_t src, std::string src_name, extent_protocol::extentid_t dst, std::string dst_name, bool open, extent_protocol::extentid_t &replaced) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::dir_rename, src, src_name, dst, dst_name, (int) open, replaced);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_link(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t eid) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int r;
+    ret = conn()->call(extent_protocol::dir_link, dir, name, eid, r);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_unlink(extent_protocol::extentid_t dir, std::string name, bool open, extent_protocol::extentid_t &eid) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::dir_unlink, dir, name, (int) open, eid);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_below(extent_protocol::extentid_t dir, extent_protocol::extentid_t top, bool &below) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int r = 0;
+    ret = conn()->call(extent_protocol::dir_below, dir, top, r);
+    below = r != 0;
     return ret;
 }
 
@@ -55,7 +188,7 @@ extent_protocol::status extent_client::commit() {
     extent_protocol::status ret = extent_protocol::OK;
     int i; // placeholder
     extent_protocol::extentid_t j = -1;  // placeholder
-    ret = cl->call(extent_protocol::commit, j, i);
+    ret = conn()->call(extent_protocol::commit, j, i);
     return ret;
 }
 
@@ -63,7 +196,7 @@ extent_protocol::status extent_client::rollback() {
     extent_protocol::status ret = extent_protocol::OK;
     int i; // placeholder
     extent_protocol::extentid_t j = -1;  // placeholder
-    ret = cl->call(extent_protocol::rollback, j, i);
+    ret = conn()->call(extent_protocol::rollback, j, i);
     return ret;
 }
 
@@ -71,6 +204,108 @@ extent_protocol::status extent_client::forward() {
     extent_protocol::status ret = extent_protocol::OK;
     int i; // placeholder
     extent_protocol::extentid_t j = -1;  // placeholder
-    ret = cl->call(extent_protocol::forward, j, i);
+    ret = conn()->call(extent_protocol::forward, j, i);
+    return ret;
+}
+
+extent_protocol::status extent_client::checkout(int version) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int i; // placeholder
+    ret = conn()->call(extent_protocol::checkout, version, i);
+    return ret;
+}
+
+extent_protocol::status extent_client::tag(std::string name) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int i; // placeholder
+    ret = conn()->call(extent_protocol::tag, name, i);
+    return ret;
+}
+
+extent_protocol::status extent_client::checkout_tag(std::string name) {
+    extent_protocol::status ret = extent_protocol::OK;
+    int i; // placeholder
+    ret = conn()->call(extent_protocol::checkout_tag, name, i);
+    return ret;
+}
+
+extent_protocol::status extent_client::snapshot_count(int &count) {
+    extent_protocol::status ret = extent_protocol::OK;
+    extent_protocol::extentid_t j = -1;  // placeholder
+    ret = conn()->call(extent_protocol::snapshot_count, j, count);
+    return ret;
+}
+
+extent_protocol::status extent_client::snapshot_get(int version, extent_protocol::extentid_t eid, std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::snapshot_get, version, eid, buf);
     return ret;
 }
+
+extent_protocol::status extent_client::snapshot_getattr(int version, extent_protocol::extentid_t eid, extent_protocol::attr &a) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = conn()->call(extent_protocol::snapshot_getattr, version, eid, a);
+    return ret;
+}
+
+// hand a call to the callers, the first call starts them
+extent_call *extent_client::start(extent_call *c) {
+    pthread_mutex_lock(&calls_mutex);
+    if (!callers_started) {
+        for (int i = 0; i < EXTENT_CALLERS; i++) {
+            pthread_t th;
+            VERIFY(pthread_create(&th, NULL, &callerthread, (void *) this) == 0);
+        }
+        callers_started = true;
+    }
+    calls.push_back(c);
+    pthread_cond_signal(&calls_cond);
+    pthread_mutex_unlock(&calls_mutex);
+    return c;
+}
+
+// each caller has one call in flight, rpcc matches the replies to them
+void extent_client::caller() {
+    pthread_mutex_lock(&calls_mutex);
+    while (true) {
+        while (calls.empty())
+            pthread_cond_wait(&calls_cond, &calls_mutex);
+
+        extent_call *c = calls.front();
+        calls.pop_front();
+        pthread_mutex_unlock(&calls_mutex);
+
+        extent_protocol::status ret = c->run(conn());
+        pthread_mutex_lock(&c->mutex);
+        c->ret = ret;
+        c->done = true;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+
+        pthread_mutex_lock(&calls_mutex);
+    }
+}
+
+extent_protocol::status extent_client::wait(extent_call *c) {
+    pthread_mutex_lock(&c->mutex);
+    while (!c->done)
+        pthread_cond_wait(&c->cond, &c->mutex);
+    pthread_mutex_unlock(&c->mutex);
+
+    c->finish();
+    extent_protocol::status ret = c->ret;
+    delete c;
+    return ret;
+}
+
+extent_call *extent_client::async_getattr(extent_protocol::extentid_t eid, extent_protocol::attr &a) {
+    return start(new extent_call1<extent_protocol::extentid_t, extent_protocol::attr>(extent_protocol::getattr, eid, &a));
+}
+
+extent_call *extent_client::async_get_block(extent_protocol::extentid_t eid, int index, std::string &buf) {
+    return start(new extent_call2<extent_protocol::extentid_t, int, std::string>(extent_protocol::get_block, eid, index, &buf));
+}
+
+extent_call *extent_client::async_snapshot_getattr(int version, extent_protocol::extentid_t eid, extent_protocol::attr &a) {
+    return start(new extent_call2<int, extent_protocol::extentid_t, extent_protocol::attr>(extent_protocol::snapshot_getattr, version, eid, &a));
+}
@@ -4,12 +4,82 @@
 #define extent_client_h
 
 #include <string>
+#include <list>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// calls one client keeps in flight at once, the rest wait for a caller
+#define EXTENT_CALLERS 8
+// connections to the server, calls take them in turn
+#define EXTENT_CONNS 4
+
+// A call started by one of the async methods of extent_client. It goes out
+// on a caller thread of the client, so calls started one after another
+// travel together on the connections. extent_client::wait hands over the
+// results and frees the call.
+class extent_call {
+    friend class extent_client;
+
+private:
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    extent_protocol::status ret;
+
+    virtual extent_protocol::status run(rpcc *cl) = 0;
+    virtual void finish() {}  // copy the results out, in the waiting thread
+
+public:
+    extent_call();
+    virtual ~extent_call();
+};
+
+// the calls by number of arguments. a result is kept in the call until
+// wait() copies it to out, when there is one.
+template<class A1, class R>
+class extent_call1 : public extent_call {
+private:
+    unsigned int proc;
+    A1 a1;
+    R r, *out;
+
+    extent_protocol::status run(rpcc *cl) { return cl->call(proc, a1, r); }
+    void finish() { if (out) *out = r; }
+
+public:
+    extent_call1(unsigned int proc, const A1 &a1, R *out) : proc(proc), a1(a1), out(out) {}
+};
+
+template<class A1, class A2, class R>
+class extent_call2 : public extent_call {
+private:
+    unsigned int proc;
+    A1 a1;
+    A2 a2;
+    R r, *out;
+
+    extent_protocol::status run(rpcc *cl) { return cl->call(proc, a1, a2, r); }
+    void finish() { if (out) *out = r; }
+
+public:
+    extent_call2(unsigned int proc, const A1 &a1, const A2 &a2, R *out) : proc(proc), a1(a1), a2(a2), out(out) {}
+};
+
 class extent_client {
 private:
-    rpcc *cl;
+    rpcc *cls[EXTENT_CONNS];
+    unsigned next;
+
+    rpcc *conn() { return cls[__sync_fetch_and_add(&next, 1) % EXTENT_CONNS]; }
+
+    // calls waiting for a caller thread, started with the first of them
+    std::list<extent_call *> calls;
+    pthread_mutex_t calls_mutex;
+    pthread_cond_t calls_cond;
+    bool callers_started;
+
+    extent_call *start(extent_call *c);
 
 public:
     extent_client(std::string dst);
@@ -17,11 +87,51 @@ public:
     extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
     extent_protocol::status get(extent_protocol::extentid_t eid, std::string &buf);
     extent_protocol::status getattr(extent_protocol::extentid_t eid, extent_protocol::attr &a);
-    extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+    extent_protocol::status put(extent_protocol::extentid_t eid, const std::string &buf);
     extent_protocol::status remove(extent_protocol::extentid_t eid);
+    extent_protocol::status get_block(extent_protocol::extentid_t eid, int index, std::string &buf);
+    extent_protocol::status put_block(extent_protocol::extentid_t eid, int index, const std::string &buf);
+    extent_protocol::status get_range(extent_protocol::extentid_t eid, unsigned int off, unsigned int size, std::string &buf);
+
+    // many extents in one message, at most MULTI_MAX
+    extent_protocol::status multi_get(const std::vector<extent_protocol::extentid_t> &eids, std::vector<std::string> &bufs);
+    extent_protocol::status multi_getattr(const std::vector<extent_protocol::extentid_t> &eids, std::vector<extent_protocol::attr> &attrs);
+    extent_protocol::status multi_put(const std::vector<extent_protocol::extentid_t> &eids, const std::vector<std::string> &bufs);
+
+    // directory entries, changed in place on the server
+    extent_protocol::status dir_lookup(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &eid);
+    extent_protocol::status dir_add(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t eid);
+    extent_protocol::status dir_remove(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &eid);
+    extent_protocol::status dir_read(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &entries);
+    extent_protocol::status dir_readplus(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &entries);
+    extent_protocol::status dir_lookupplus(extent_protocol::extentid_t dir, std::string name, extent_protocol::dirent &entry);
+    extent_protocol::status dir_create(extent_protocol::extentid_t dir, std::string name, uint32_t type, extent_protocol::dirent &entry);
+    extent_protocol::status dir_rename(extent_protocol::extentid_t src, std::string src_name, extent_protocol::extentid_t dst, std::string dst_name, bool open, extent_protocol::extentid_t &replaced);
+    extent_protocol::status dir_link(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t eid);
+    extent_protocol::status dir_unlink(extent_protocol::extentid_t dir, std::string name, bool open, extent_protocol::extentid_t &eid);
+    // whether dir is top or lies under it
+    extent_protocol::status dir_below(extent_protocol::extentid_t dir, extent_protocol::extentid_t top, bool &below);
     extent_protocol::status commit();
     extent_protocol::status rollback();
     extent_protocol::status forward();
+    extent_protocol::status checkout(int version);
+    extent_protocol::status tag(std::string name);
+    extent_protocol::status checkout_tag(std::string name);
+
+    // read-only access to committed versions
+    extent_protocol::status snapshot_count(int &count);
+    extent_protocol::status snapshot_get(int version, extent_protocol::extentid_t eid, std::string &buf);
+    extent_protocol::status snapshot_getattr(int version, extent_protocol::extentid_t eid, extent_protocol::attr &a);
+
+    // the same without waiting for the reply. results land in the
+    // arguments passed by reference, which must outlive the call, once
+    // wait() returns the status of the call.
+    extent_call *async_getattr(extent_protocol::extentid_t eid, extent_protocol::attr &a);
+    extent_call *async_get_block(extent_protocol::extentid_t eid, int index, std::string &buf);
+    extent_call *async_snapshot_getattr(int version, extent_protocol::extentid_t eid, extent_protocol::attr &a);
+    extent_protocol::status wait(extent_call *c);
+
+    void caller();
 };
 
 #endif
@@ -5,11 +5,14 @@
 
 #include "rpc.h"
 
+#define DIR_READ_MAX 1024  // entries in one dir_read reply
+#define MULTI_MAX    1024  // extents in one multi_* call
+
 class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, INVAL };
   enum rpc_numbers {
     put = 0x6001,
     get,
@@ -18,7 +21,31 @@ class extent_protocol {
     create,
     commit,
     rollback,
-    forward
+    forward,
+    snapshot_count,
+    snapshot_get,
+    snapshot_getattr,
+    checkout,
+    tag,
+    checkout_tag,
+    get_block,
+    put_block,
+    dir_lookup,
+    dir_add,
+    dir_remove,
+    dir_read,
+    dir_readplus,
+    get_range,
+    dir_lookupplus,
+    dir_create,
+    dir_rename,
+    dir_link,
+    dir_unlink,
+    multi_get,
+    multi_getattr,
+    multi_put,
+    server_stats,
+    dir_below
   };
 
   enum types {
@@ -33,6 +60,16 @@ class extent_protocol {
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    unsigned int nlink;  // directory entries naming the inode
+  };
+
+  // a directory entry returned by dir_read, up to DIR_READ_MAX at once, or
+  // by dir_lookupplus and dir_create for a single name
+  struct dirent {
+    std::string name;
+    extentid_t inum;
+    unsigned long long next;  // where to resume after this entry
+    attr a;                   // filled by dir_readplus only
   };
 };
 
@@ -44,6 +81,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.nlink;
   return u;
 }
 
@@ -55,6 +93,27 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.nlink;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::dirent &e)
+{
+  u >> e.name;
+  u >> e.inum;
+  u >> e.next;
+  u >> e.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::dirent e)
+{
+  m << e.name;
+  m << e.inum;
+  m << e.next;
+  m << e.a;
   return m;
 }
 
@@ -1,7 +1,9 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "hashdir.h"
 #include <sstream>
+#include <set>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,72 +11,750 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-extent_server::extent_server()  {
+// count the request in stats while the handler runs
+#define STAT(proc) rpc_stats::call counted(stats, extent_protocol::proc, #proc)
+
+inode_locks::inode_locks() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // readers come and go all the time, a commit must still get its turn
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&version, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    for (int i = 0; i <= INODE_NUM; i++) {
+        pthread_rwlock_init(&inodes[i], NULL);
+    }
+}
+
+void inode_locks::lock_version(bool all) {
+    if (all)
+        pthread_rwlock_wrlock(&version);
+    else
+        pthread_rwlock_rdlock(&version);
+}
+
+void inode_locks::unlock_version() {
+    pthread_rwlock_unlock(&version);
+}
+
+// inums out of range are left out, inode_manager turns them down anyway
+void inode_locks::lock(const set &inums) {
+    for (set::const_iterator it = inums.begin(); it != inums.end(); ++it) {
+        if (it->first < 1 || it->first > INODE_NUM)
+            continue;
+        if (it->second)
+            pthread_rwlock_wrlock(&inodes[it->first]);
+        else
+            pthread_rwlock_rdlock(&inodes[it->first]);
+    }
+}
+
+void inode_locks::unlock(const set &inums) {
+    for (set::const_iterator it = inums.begin(); it != inums.end(); ++it) {
+        if (it->first >= 1 && it->first <= INODE_NUM)
+            pthread_rwlock_unlock(&inodes[it->first]);
+    }
+}
+
+locked::locked(inode_locks &locks, const inode_locks::set &inodes) : locks(locks), held(inodes) {
+    locks.lock_version(false);
+    locks.lock(held);
+}
+
+locked::~locked() {
+    locks.unlock(held);
+    locks.unlock_version();
+}
+
+void locked::relock(const inode_locks::set &inodes) {
+    locks.unlock(held);
+    held = inodes;
+    locks.lock(held);
+}
+
+// What a request changes while one of these lives is logged as one group,
+// recovery replays it whole or not at all. Declared after the locked of the
+// request, so the group goes out before the inodes are given back.
+class logged_group {
+private:
+    inode_manager *im;
+
+public:
+    logged_group(inode_manager *im) : im(im) { im->begin_group(); }
+    ~logged_group() { im->end_group(); }
+};
+
+static inode_locks::set reading(uint32_t inum) {
+    inode_locks::set inums;
+    inums[inum] = false;
+    return inums;
+}
+
+static inode_locks::set writing(uint32_t inum) {
+    inode_locks::set inums;
+    inums[inum] = true;
+    return inums;
+}
+
+extent_server::extent_server() : stats("extent_server", extent_protocol::put) {
     im = new inode_manager();
+    pthread_mutex_init(&rename_mutex, NULL);
 }
 
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id) {
-    id = im->alloc_inode(type);
+    STAT(create);
+    locked l(locks);
+    uint32_t inum = im->reserve_inode();
+
+    l.relock(writing(inum));
+    id = inum ? im->create_inode(inum, type) : 0;
 
     return extent_protocol::OK;
 }
 
 int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &) {
+    STAT(put);
     id &= 0x7fffffff;
+    locked l(locks, writing(id));
 
     const char * cbuf = buf.c_str();
     int size = buf.size();
     im->write_file(id, cbuf, size);
+    counted.in(size);
 
     return extent_protocol::OK;
 }
 
+// a writer, reading the whole file updates its atime
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf) {
+    STAT(get);
     id &= 0x7fffffff;
+    locked l(locks, writing(id));
 
-    int size = 0;
-    char *cbuf = NULL;
-
-    im->read_file(id, &cbuf, &size);
-    if (size == 0)
-    buf = "";
-    else {
-    buf.assign(cbuf, size);
-    free(cbuf);
-    }
+    int r = _get(id, buf);
+    counted.out(buf.size());
+    return r;
+}
 
+int extent_server::_get(extent_protocol::extentid_t id, std::string &buf) {
+    im->read_file(id, buf);
     return extent_protocol::OK;
 }
 
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a) {
+    STAT(getattr);
     id &= 0x7fffffff;
+    locked l(locks, reading(id));
+
+    return _getattr(id, a);
+}
 
+int extent_server::_getattr(extent_protocol::extentid_t id, extent_protocol::attr &a) {
     extent_protocol::attr attr;
     memset(&attr, 0, sizeof(attr));
-    im->getattr(id, attr);
+    im->getattr(id & 0x7fffffff, attr);
     a = attr;
 
     return extent_protocol::OK;
 }
 
 int extent_server::remove(extent_protocol::extentid_t id, int &) {
+    STAT(remove);
     id &= 0x7fffffff;
+    locked l(locks, writing(id));
     im->remove_file(id);
 
     return extent_protocol::OK;
 }
 
+int extent_server::get_block(extent_protocol::extentid_t id, int index, std::string &buf) {
+    STAT(get_block);
+    id &= 0x7fffffff;
+    locked l(locks, reading(id));
+
+    char block[BLOCK_SIZE];
+    if (!im->read_file_block(id, index, block))
+        return extent_protocol::NOENT;
+
+    buf.assign(block, BLOCK_SIZE);
+    counted.out(BLOCK_SIZE);
+    return extent_protocol::OK;
+}
+
+int extent_server::put_block(extent_protocol::extentid_t id, int index, std::string buf, int &) {
+    STAT(put_block);
+    id &= 0x7fffffff;
+    locked l(locks, writing(id));
+
+    if (buf.size() != BLOCK_SIZE || !im->write_file_block(id, index, buf.data()))
+        return extent_protocol::IOERR;
+
+    counted.in(BLOCK_SIZE);
+    return extent_protocol::OK;
+}
+
+// bytes off to off + size of a file, fewer at its end. only the blocks in
+// that range are read.
+int extent_server::get_range(extent_protocol::extentid_t id, unsigned int off, unsigned int size, std::string &buf) {
+    STAT(get_range);
+    id &= 0x7fffffff;
+    locked l(locks, reading(id));
+
+    if (!im->read_range(id, off, size, buf))
+        return extent_protocol::NOENT;
+    counted.out(buf.size());
+    return extent_protocol::OK;
+}
+
+// the inodes of a batch, all for reading or all for writing
+static inode_locks::set batch(std::vector<extent_protocol::extentid_t> &ids, bool write) {
+    inode_locks::set inums;
+    for (size_t i = 0; i < ids.size(); i++) {
+        ids[i] &= 0x7fffffff;
+        inums[ids[i]] = write;
+    }
+    return inums;
+}
+
+// Batches of get, getattr and put, for up to MULTI_MAX inodes. All of them
+// are locked at once, in inum order as always, and served in one pass.
+// Free inodes read as empty, with type 0.
+int extent_server::multi_get(std::vector<extent_protocol::extentid_t> ids, std::vector<std::string> &bufs) {
+    STAT(multi_get);
+    if (ids.size() > MULTI_MAX)
+        return extent_protocol::IOERR;
+    locked l(locks, batch(ids, true));
+
+    bufs.resize(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        _get(ids[i], bufs[i]);
+        counted.out(bufs[i].size());
+    }
+    return extent_protocol::OK;
+}
+
+int extent_server::multi_getattr(std::vector<extent_protocol::extentid_t> ids, std::vector<extent_protocol::attr> &attrs) {
+    STAT(multi_getattr);
+    if (ids.size() > MULTI_MAX)
+        return extent_protocol::IOERR;
+    locked l(locks, batch(ids, false));
+
+    attrs.resize(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        _getattr(ids[i], attrs[i]);
+    }
+    return extent_protocol::OK;
+}
+
+// bufs[i] becomes the content of ids[i], the last one wins for an inode
+// given twice
+int extent_server::multi_put(std::vector<extent_protocol::extentid_t> ids, std::vector<std::string> bufs, int &) {
+    STAT(multi_put);
+    if (ids.size() > MULTI_MAX || bufs.size() != ids.size())
+        return extent_protocol::IOERR;
+    locked l(locks, batch(ids, true));
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        im->write_file(ids[i], bufs[i].data(), bufs[i].size());
+        counted.in(bufs[i].size());
+    }
+    return extent_protocol::OK;
+}
+
+// Blocks of a directory file for hashdir, only those touched are read or
+// written, and each write is logged as a single block.
+class dir_blocks : public hashdir::storage {
+private:
+    inode_manager *im;
+    uint32_t dir;
+
+public:
+    dir_blocks(inode_manager *im, uint32_t dir) : im(im), dir(dir) {}
+
+    int read(int index, std::string &block) {
+        char buf[BLOCK_SIZE];
+        if (!im->read_file_block(dir, index, buf))
+            return hashdir::NOENT;
+        block.assign(buf, BLOCK_SIZE);
+        return hashdir::OK;
+    }
+
+    int write(int index, const std::string &block) {
+        return im->write_file_block(dir, index, block.data()) ? hashdir::OK : hashdir::IOERR;
+    }
+};
+
+static int dir_status(int r) {
+    switch (r) {
+        case hashdir::OK:    return extent_protocol::OK;
+        case hashdir::NOENT: return extent_protocol::NOENT;
+        case hashdir::EXIST: return extent_protocol::EXIST;
+        default:             return extent_protocol::IOERR;
+    }
+}
+
+// Hold the inodes of base, dir among them, and the inode name names in dir.
+// That one is known only once dir is locked, so the entry is looked up
+// again with all of them held, until it stays the same. id is 0 if there
+// is no such entry.
+int extent_server::lock_entry(locked &l, const inode_locks::set &base, extent_protocol::extentid_t dir, const std::string &name, bool write, extent_protocol::extentid_t &id) {
+    l.relock(base);
+    id = 0;
+
+    while (true) {
+        extent_protocol::extentid_t found = 0;
+        int r = _dir_lookup(dir, name, found);
+        if (r != extent_protocol::OK && r != extent_protocol::NOENT)
+            return r;
+        if (found == id)
+            return extent_protocol::OK;
+
+        id = found;
+        inode_locks::set inums = base;
+        if (id)
+            inums[id] = inums[id] || write;
+        l.relock(inums);
+    }
+}
+
+int extent_server::dir_lookup(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &id) {
+    STAT(dir_lookup);
+    dir &= 0x7fffffff;
+    locked l(locks, reading(dir));
+
+    return _dir_lookup(dir, name, id);
+}
+
+int extent_server::_dir_lookup(extent_protocol::extentid_t dir, const std::string &name, extent_protocol::extentid_t &id) {
+    dir_blocks blocks(im, dir & 0x7fffffff);
+    uint32_t inum;
+    int r = hashdir::lookup(blocks, name, inum);
+
+    if (r == hashdir::OK)
+        id = inum;
+    return dir_status(r);
+}
+
+int extent_server::dir_add(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t id, int &) {
+    STAT(dir_add);
+    dir &= 0x7fffffff;
+    locked l(locks, writing(dir));
+
+    return _dir_add(dir, name, id);
+}
+
+int extent_server::_dir_add(extent_protocol::extentid_t dir, const std::string &name, extent_protocol::extentid_t id) {
+    dir_blocks blocks(im, dir & 0x7fffffff);
+    return dir_status(hashdir::add(blocks, name, id & 0x7fffffff));
+}
+
+int extent_server::dir_remove(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &id) {
+    STAT(dir_remove);
+    dir &= 0x7fffffff;
+    locked l(locks, writing(dir));
+
+    return _dir_remove(dir, name, id);
+}
+
+int extent_server::_dir_remove(extent_protocol::extentid_t dir, const std::string &name, extent_protocol::extentid_t &id) {
+    dir_blocks blocks(im, dir & 0x7fffffff);
+    uint32_t inum;
+    int r = hashdir::remove(blocks, name, inum);
+
+    if (r == hashdir::OK)
+        id = inum;
+    return dir_status(r);
+}
+
+// a chunk of a listing, reading only the header and the buckets it covers
+int extent_server::dir_read(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &entries) {
+    STAT(dir_read);
+    return scan_dir(dir, pos, max, entries);
+}
+
+int extent_server::scan_dir(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &entries) {
+    dir &= 0x7fffffff;
+    locked l(locks, reading(dir));
+
+    dir_blocks blocks(im, dir);
+    std::list<hashdir::entry> found;
+    int r = hashdir::scan(blocks, pos, max < DIR_READ_MAX ? max : DIR_READ_MAX, found);
+
+    entries.clear();
+    for (std::list<hashdir::entry>::iterator it = found.begin(); it != found.end(); ++it) {
+        extent_protocol::dirent e;
+        e.name = it->name;
+        e.inum = it->inum;
+        e.next = it->next;
+        memset(&e.a, 0, sizeof(e.a));
+        entries.push_back(e);
+    }
+    return dir_status(r);
+}
+
+// the same with the attributes of every entry, saving a getattr for each.
+// they are taken in one batch once dir is released, they are hints.
+int extent_server::dir_readplus(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &entries) {
+    STAT(dir_readplus);
+    int r = scan_dir(dir, pos, max, entries);
+
+    std::vector<extent_protocol::extentid_t> ids;
+    for (size_t i = 0; i < entries.size(); i++) {
+        ids.push_back(entries[i].inum);
+    }
+    locked l(locks, batch(ids, false));
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        _getattr(ids[i], entries[i].a);
+    }
+    return r;
+}
+
+// dir_lookup and the getattr that follows it in one round trip
+int extent_server::dir_lookupplus(extent_protocol::extentid_t dir, std::string name, extent_protocol::dirent &entry) {
+    STAT(dir_lookupplus);
+    dir &= 0x7fffffff;
+    locked l(locks);
+
+    int r = lock_entry(l, reading(dir), dir, name, false, entry.inum);
+    if (r != extent_protocol::OK)
+        return r;
+    if (entry.inum == 0)
+        return extent_protocol::NOENT;
+
+    entry.name = name;
+    entry.next = 0;
+    return _getattr(entry.inum, entry.a);
+}
+
+// a new inode of type under name in dir, with its attributes. EXIST if
+// the name is taken, and then nothing is allocated.
+int extent_server::dir_create(extent_protocol::extentid_t dir, std::string name, uint32_t type, extent_protocol::dirent &entry) {
+    STAT(dir_create);
+    dir &= 0x7fffffff;
+    locked l(locks);
+
+    // the new inode is locked along with dir, no request knows it yet
+    uint32_t inum = im->reserve_inode();
+    inode_locks::set inums;
+    inums[dir] = true;
+    inums[inum] = true;
+    l.relock(inums);
+
+    logged_group g(im);
+    extent_protocol::extentid_t id;
+    int r = _dir_lookup(dir, name, id);
+    if (r != extent_protocol::NOENT) {
+        if (inum)
+            im->unreserve_inode(inum);
+        return r == extent_protocol::OK ? extent_protocol::EXIST : r;
+    }
+
+    entry.inum = inum ? im->create_inode(inum, type) : 0;
+    if (entry.inum == 0)
+        return extent_protocol::IOERR;
+
+    if ((r = _dir_add(dir, name, entry.inum)) != extent_protocol::OK) {
+        im->remove_file(entry.inum);
+        return r;
+    }
+
+    entry.name = name;
+    entry.next = 0;
+    return _getattr(entry.inum, entry.a);
+}
+
+// drop a link to id, and the inode with the last one unless it is still open
+void extent_server::unlink_inode(extent_protocol::extentid_t id, int open) {
+    id &= 0x7fffffff;
+
+    if (im->unlink_inode(id) == 0 && !open)
+        im->remove_file(id);
+}
+
+// Whether dir is top or lies in the tree under it. Directories keep no
+// entry for their parent, so the tree under top is searched, one inode
+// locked at a time; l gives back what it held and holds none after. Only
+// moves between directories change what lies under what, the caller holds
+// rename_mutex.
+bool extent_server::below(extent_protocol::extentid_t dir, extent_protocol::extentid_t top, locked &l) {
+    std::vector<uint32_t> pending(1, top);
+    std::set<uint32_t> seen;
+    bool found = false;
+
+    while (!pending.empty() && !found) {
+        uint32_t d = pending.back();
+        pending.pop_back();
+        if (d == dir) {
+            found = true;
+        } else if (seen.insert(d).second) {
+            l.relock(reading(d));
+            extent_protocol::attr a;
+            _getattr(d, a);
+
+            std::list<hashdir::entry> entries;
+            dir_blocks blocks(im, d);
+            if (a.type == extent_protocol::T_DIR && hashdir::list(blocks, entries) == hashdir::OK) {
+                for (std::list<hashdir::entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+                    pending.push_back(it->inum);
+            }
+        }
+    }
+    l.relock(inode_locks::set());
+    return found;
+}
+
+// Moves the entry src_name of src to dst_name in dst, in one call so that
+// no other request sees the name in both places or in neither, and logged
+// as one group so that recovery does not either. The inode dst_name named
+// loses that link and is returned in replaced, 0 if there was none; the
+// caller has checked that it may go, and whether it is open. A directory
+// does not move under itself, that is INVAL. Nothing changes on error.
+int extent_server::dir_rename(extent_protocol::extentid_t src, std::string src_name, extent_protocol::extentid_t dst, std::string dst_name, int open, extent_protocol::extentid_t &replaced) {
+    STAT(dir_rename);
+    src &= 0x7fffffff;
+    dst &= 0x7fffffff;
+    locked l(locks);
+
+    // moves in one directory change no one's place in the tree
+    if (src == dst)
+        return _dir_rename(l, src, src_name, dst, dst_name, open, replaced);
+
+    pthread_mutex_lock(&rename_mutex);
+    int r = _dir_rename(l, src, src_name, dst, dst_name, open, replaced);
+    pthread_mutex_unlock(&rename_mutex);
+    return r;
+}
+
+int extent_server::_dir_rename(locked &l, extent_protocol::extentid_t src, const std::string &src_name, extent_protocol::extentid_t dst, const std::string &dst_name, int open, extent_protocol::extentid_t &replaced) {
+    // the moved inode itself does not change
+    inode_locks::set dirs;
+    dirs[src] = true;
+    dirs[dst] = true;
+
+    // the tree under the moved inode is searched with the directories
+    // given back, until the same inode is found again after it
+    extent_protocol::extentid_t id = 0, old;
+    int r;
+    while (true) {
+        extent_protocol::extentid_t found;
+        if ((r = lock_entry(l, dirs, dst, dst_name, true, old)) != extent_protocol::OK)
+            return r;
+        if ((r = _dir_lookup(src, src_name, found)) != extent_protocol::OK)
+            return r;
+
+        bool same = found == id;
+        id = found;
+        if (src == dst || same)
+            break;
+        if (below(dst, id, l))
+            return extent_protocol::INVAL;
+    }
+
+    logged_group g(im);
+
+    replaced = 0;
+    if (old == id)  // the same file already
+        return extent_protocol::OK;
+
+    // the new entry takes the place of the old one, which frees just as
+    // much room, so only adding a new name can run out of it
+    if (old) {
+        if ((r = _dir_remove(dst, dst_name, old)) != extent_protocol::OK)
+            return r;
+        replaced = old;
+    }
+    if ((r = _dir_add(dst, dst_name, id)) != extent_protocol::OK) {
+        if (replaced)
+            _dir_add(dst, dst_name, replaced);
+        replaced = 0;
+        return r;
+    }
+
+    if ((r = _dir_remove(src, src_name, id)) != extent_protocol::OK) {
+        _dir_remove(dst, dst_name, id);
+        if (replaced)
+            _dir_add(dst, dst_name, replaced);
+        replaced = 0;
+        return r;
+    }
+
+    if (replaced)
+        unlink_inode(replaced, open);
+    return extent_protocol::OK;
+}
+
+// whether dir is top or lies under it, for a client to lock the upper
+// of two directories first
+int extent_server::dir_below(extent_protocol::extentid_t dir, extent_protocol::extentid_t top, int &r) {
+    STAT(dir_below);
+    locked l(locks);
+
+    pthread_mutex_lock(&rename_mutex);
+    r = below(dir & 0x7fffffff, top & 0x7fffffff, l);
+    pthread_mutex_unlock(&rename_mutex);
+    return extent_protocol::OK;
+}
+
+// one more name for the inode id
+int extent_server::dir_link(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t id, int &) {
+    STAT(dir_link);
+    dir &= 0x7fffffff;
+    id &= 0x7fffffff;
+
+    inode_locks::set inums;
+    inums[dir] = true;
+    inums[id] = true;
+    locked l(locks, inums);
+    logged_group g(im);
+
+    int r = _dir_add(dir, name, id);
+    if (r != extent_protocol::OK)
+        return r;
+
+    if (im->link_inode(id) < 0) {
+        extent_protocol::extentid_t removed;
+        _dir_remove(dir, name, removed);
+        return extent_protocol::NOENT;
+    }
+    return extent_protocol::OK;
+}
+
+// remove the entry name and the link it was, see unlink_inode
+int extent_server::dir_unlink(extent_protocol::extentid_t dir, std::string name, int open, extent_protocol::extentid_t &id) {
+    STAT(dir_unlink);
+    dir &= 0x7fffffff;
+    locked l(locks);
+
+    int r = lock_entry(l, writing(dir), dir, name, true, id);
+    if (r != extent_protocol::OK)
+        return r;
+    if (id == 0)
+        return extent_protocol::NOENT;
+
+    logged_group g(im);
+    if ((r = _dir_remove(dir, name, id)) != extent_protocol::OK)
+        return r;
+
+    unlink_inode(id, open);
+    return extent_protocol::OK;
+}
+
+// commit and the version switches below run alone
+
 int extent_server::commit(extent_protocol::extentid_t id, int &) {
+    STAT(commit);
+    locks.lock_version(true);
     im->commit();
+    locks.unlock_version();
     return extent_protocol::OK;
 }
 
 int extent_server::rollback(extent_protocol::extentid_t id, int &) {
+    STAT(rollback);
+    locks.lock_version(true);
     im->rollback();
+    locks.unlock_version();
     return extent_protocol::OK;
 }
 
 int extent_server::forward(extent_protocol::extentid_t id, int &) {
+    STAT(forward);
+    locks.lock_version(true);
     im->forward();
+    locks.unlock_version();
+    return extent_protocol::OK;
+}
+
+int extent_server::checkout(int version, int &) {
+    STAT(checkout);
+    locks.lock_version(true);
+    int ok = im->checkout_version(version);
+    locks.unlock_version();
+
+    if (!ok)
+        return extent_protocol::NOENT;
+    return extent_protocol::OK;
+}
+
+int extent_server::tag(std::string name, int &) {
+    STAT(tag);
+    locks.lock_version(true);
+    int ok = im->tag(name);
+    locks.unlock_version();
+
+    if (!ok)
+        return extent_protocol::IOERR;
+    return extent_protocol::OK;
+}
+
+int extent_server::checkout_tag(std::string name, int &) {
+    STAT(checkout_tag);
+    locks.lock_version(true);
+    int ok = im->checkout_tag(name);
+    locks.unlock_version();
+
+    if (!ok)
+        return extent_protocol::NOENT;
+    return extent_protocol::OK;
+}
+
+int extent_server::snapshot_count(extent_protocol::extentid_t id, int &count) {
+    STAT(snapshot_count);
+    locked l(locks);  // no commit meanwhile
+    count = im->snapshot_count();
+    return extent_protocol::OK;
+}
+
+int extent_server::snapshot_get(int version, extent_protocol::extentid_t id, std::string &buf) {
+    STAT(snapshot_get);
+    id &= 0x7fffffff;
+    locked l(locks);
+
+    if (version < 0 || version >= im->snapshot_count())
+        return extent_protocol::NOENT;
+
+    im->read_snapshot(version, id, buf);
+    counted.out(buf.size());
+    return extent_protocol::OK;
+}
+
+int extent_server::snapshot_getattr(int version, extent_protocol::extentid_t id, extent_protocol::attr &a) {
+    STAT(snapshot_getattr);
+    id &= 0x7fffffff;
+    locked l(locks);
+
+    if (version < 0 || version >= im->snapshot_count())
+        return extent_protocol::NOENT;
+
+    extent_protocol::attr attr;
+    memset(&attr, 0, sizeof(attr));
+    im->getattr_snapshot(version, id, attr);
+    a = attr;
+
+    return extent_protocol::OK;
+}
+
+// check and repair the coded blocks in the background, rate blocks a second
+void extent_server::start_scrubber(int rate) {
+    im->start_scrubber(rate);
+}
+
+// the counters of the requests and of the block layer, as text
+int extent_server::server_stats(int, std::string &out) {
+    out.clear();
+    stats.dump(out);
+
+    struct block_stats b = im->block_counters();
+    char line[256];
+    snprintf(line, sizeof(line), "blocks: %llu reads, %llu writes, %llu corrected, %llu allocs, %llu frees\n",
+             b.reads, b.writes, b.corrected, b.allocs, b.frees);
+    out += line;
+    snprintf(line, sizeof(line), "scrub: %llu passes, %llu checked, %llu corrected, %llu bad bytes\n",
+             b.scrub_passes, b.scrubbed, b.scrub_corrected, b.bad_bytes);
+    out += line;
     return extent_protocol::OK;
 }
@@ -5,8 +5,45 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "inode_manager.h"
+#include "rpc_stats.h"
+
+// Reader/writer locks of every inode, so that requests on distinct inodes
+// run in parallel on the rpcs thread pool. A request takes all the inodes
+// it needs at once, in inum order, so no two requests wait on each other
+// in a cycle. Every request also holds the version lock shared; commit and
+// the version switches change any inode and hold it alone.
+class inode_locks {
+private:
+    pthread_rwlock_t version;
+    pthread_rwlock_t inodes[INODE_NUM + 1];
+
+public:
+    typedef std::map<uint32_t, bool> set;  // inum -> true to write
+
+    inode_locks();
+    void lock_version(bool all);
+    void unlock_version();
+    void lock(const set &);
+    void unlock(const set &);
+};
+
+// The locks one request holds, the version lock shared from construction
+// to destruction and a set of inodes.
+class locked {
+private:
+    inode_locks &locks;
+    inode_locks::set held;
+
+public:
+    locked(inode_locks &locks, const inode_locks::set &inodes = inode_locks::set());
+    ~locked();
+    // give back the inodes held, then take these
+    void relock(const inode_locks::set &inodes);
+};
 
 class extent_server {
 protected:
@@ -18,18 +55,67 @@ protected:
     std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
     inode_manager *im;
+    inode_locks locks;
+    rpc_stats stats;
+    pthread_mutex_t rename_mutex;  // one move between directories at a time
+
+    void unlink_inode(extent_protocol::extentid_t id, int open);
+    bool below(extent_protocol::extentid_t dir, extent_protocol::extentid_t top, locked &);
+    int lock_entry(locked &, const inode_locks::set &, extent_protocol::extentid_t dir, const std::string &name, bool write, extent_protocol::extentid_t &id);
+
+    // the same as the requests, with the locks already held
+    int _get(extent_protocol::extentid_t id, std::string &);
+    int _getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
+    int _dir_lookup(extent_protocol::extentid_t dir, const std::string &name, extent_protocol::extentid_t &id);
+    int _dir_add(extent_protocol::extentid_t dir, const std::string &name, extent_protocol::extentid_t id);
+    int _dir_remove(extent_protocol::extentid_t dir, const std::string &name, extent_protocol::extentid_t &id);
+    int _dir_rename(locked &, extent_protocol::extentid_t src, const std::string &src_name, extent_protocol::extentid_t dst, const std::string &dst_name, int open, extent_protocol::extentid_t &replaced);
+    // dir_read, taking its own lock
+    int scan_dir(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &);
 
 public:
     extent_server();
+    // rewrite damaged blocks in the background, see block_manager
+    void start_scrubber(int rate);
 
     int create(uint32_t type, extent_protocol::extentid_t &id);
     int put(extent_protocol::extentid_t id, std::string, int &);
     int get(extent_protocol::extentid_t id, std::string &);
     int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
     int remove(extent_protocol::extentid_t id, int &);
+    int get_block(extent_protocol::extentid_t id, int index, std::string &);
+    int put_block(extent_protocol::extentid_t id, int index, std::string, int &);
+    int get_range(extent_protocol::extentid_t id, unsigned int off, unsigned int size, std::string &);
+    int multi_get(std::vector<extent_protocol::extentid_t> ids, std::vector<std::string> &);
+    int multi_getattr(std::vector<extent_protocol::extentid_t> ids, std::vector<extent_protocol::attr> &);
+    int multi_put(std::vector<extent_protocol::extentid_t> ids, std::vector<std::string> bufs, int &);
+
+    // directory entries, changed in place on the server
+    int dir_lookup(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &id);
+    int dir_add(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t id, int &);
+    int dir_remove(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &id);
+    int dir_read(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &);
+    int dir_readplus(extent_protocol::extentid_t dir, unsigned long long pos, int max, std::vector<extent_protocol::dirent> &);
+    int dir_lookupplus(extent_protocol::extentid_t dir, std::string name, extent_protocol::dirent &);
+    int dir_create(extent_protocol::extentid_t dir, std::string name, uint32_t type, extent_protocol::dirent &);
+    int dir_rename(extent_protocol::extentid_t src, std::string src_name, extent_protocol::extentid_t dst, std::string dst_name, int open, extent_protocol::extentid_t &replaced);
+    int dir_link(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t id, int &);
+    int dir_unlink(extent_protocol::extentid_t dir, std::string name, int open, extent_protocol::extentid_t &id);
+    int dir_below(extent_protocol::extentid_t dir, extent_protocol::extentid_t top, int &below);
     int commit(extent_protocol::extentid_t id, int &);
     int rollback(extent_protocol::extentid_t id, int &);
     int forward(extent_protocol::extentid_t id, int &);
+    int checkout(int version, int &);
+    int tag(std::string name, int &);
+    int checkout_tag(std::string name, int &);
+
+    // read-only access to committed versions
+    int snapshot_count(extent_protocol::extentid_t id, int &);
+    int snapshot_get(int version, extent_protocol::extentid_t id, std::string &);
+    int snapshot_getattr(int version, extent_protocol::extentid_t id, extent_protocol::attr &);
+
+    // request counters and latencies, see rpc_stats.h
+    int server_stats(int, std::string &);
 };
 
 #endif
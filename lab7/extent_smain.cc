@@ -6,6 +6,22 @@
 #include <unistd.h>
 // Main loop of extent server
 
+static int stats_interval;
+
+// print the counters every stats_interval seconds
+static void *
+dump_stats(void *x)
+{
+  extent_server *es = (extent_server *) x;
+  while(1){
+    sleep(stats_interval);
+    std::string out;
+    es->server_stats(0, out);
+    printf("%s", out.c_str());
+  }
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -30,10 +46,49 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::get_block, &ls, &extent_server::get_block);
+  server.reg(extent_protocol::put_block, &ls, &extent_server::put_block);
+  server.reg(extent_protocol::get_range, &ls, &extent_server::get_range);
+  server.reg(extent_protocol::dir_lookup, &ls, &extent_server::dir_lookup);
+  server.reg(extent_protocol::dir_add, &ls, &extent_server::dir_add);
+  server.reg(extent_protocol::dir_remove, &ls, &extent_server::dir_remove);
+  server.reg(extent_protocol::dir_read, &ls, &extent_server::dir_read);
+  server.reg(extent_protocol::dir_readplus, &ls, &extent_server::dir_readplus);
+  server.reg(extent_protocol::dir_lookupplus, &ls, &extent_server::dir_lookupplus);
+  server.reg(extent_protocol::dir_create, &ls, &extent_server::dir_create);
+  server.reg(extent_protocol::dir_rename, &ls, &extent_server::dir_rename);
+  server.reg(extent_protocol::dir_link, &ls, &extent_server::dir_link);
+  server.reg(extent_protocol::dir_below, &ls, &extent_server::dir_below);
+  server.reg(extent_protocol::dir_unlink, &ls, &extent_server::dir_unlink);
+  server.reg(extent_protocol::multi_get, &ls, &extent_server::multi_get);
+  server.reg(extent_protocol::multi_getattr, &ls, &extent_server::multi_getattr);
+  server.reg(extent_protocol::multi_put, &ls, &extent_server::multi_put);
   server.reg(extent_protocol::create, &ls, &extent_server::create);
   server.reg(extent_protocol::commit, &ls, &extent_server::commit);
   server.reg(extent_protocol::rollback, &ls, &extent_server::rollback);
   server.reg(extent_protocol::forward, &ls, &extent_server::forward);
+  server.reg(extent_protocol::checkout, &ls, &extent_server::checkout);
+  server.reg(extent_protocol::tag, &ls, &extent_server::tag);
+  server.reg(extent_protocol::checkout_tag, &ls, &extent_server::checkout_tag);
+  server.reg(extent_protocol::snapshot_count, &ls, &extent_server::snapshot_count);
+  server.reg(extent_protocol::snapshot_get, &ls, &extent_server::snapshot_get);
+  server.reg(extent_protocol::snapshot_getattr, &ls, &extent_server::snapshot_getattr);
+  server.reg(extent_protocol::server_stats, &ls, &extent_server::server_stats);
+
+  // blocks checked a second, 0 to leave damaged blocks to the reads
+  int scrub_rate = SCRUB_RATE;
+  char *scrub_env = getenv("SCRUB_RATE");
+  if(scrub_env != NULL){
+    scrub_rate = atoi(scrub_env);
+  }
+  ls.start_scrubber(scrub_rate);
+
+  char *interval_env = getenv("STATS_INTERVAL");
+  if(interval_env != NULL && atoi(interval_env) > 0){
+    stats_interval = atoi(interval_env);
+    pthread_t th;
+    pthread_create(&th, NULL, dump_stats, &ls);
+  }
 
   while(1)
     sleep(1000);
@@ -0,0 +1,309 @@
+/* file system benchmark suite.
+ * Drives mounted yfs clients through system calls: create, stat, readdir
+ * and unlink storms in one directory, sequential reads and writes dd style
+ * in requests of 512 bytes to 64K (small ones are what write-behind in
+ * fuse.cc is for), random reads and writes, threads doing round trips on
+ * files of their own (create, write, read back, stat, unlink) for 1, 2,
+ * 4... threads, to see whether independent files are served in parallel
+ * (see YFS_THREADS in fuse.cc), and threads contending on a shared
+ * directory. With several mounts of one file system, given comma
+ * separated, the contending threads are spread over them, one yfs_client
+ * each.
+ *
+ * Every test prints one line of key=value pairs, see bench.h.
+ *
+ * usage: fs_bench <dir>[,<dir>...] [threads] [files] [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "bench.h"
+
+#define FILE_SIZE  (64 * 1024)  // files are limited to MAXFILESIZE
+#define SMALL_IO   4096
+#define TRIP_SIZE  4096
+#define SEQ_PASSES 10
+#define RANDOM_OPS 1000
+#define READDIRS   20
+
+static std::vector<std::string> mounts;
+static std::string base;  // this run's directory, under the first mount
+
+static std::string file_of(const std::string &dir, int i) {
+    char name[64];
+    snprintf(name, sizeof(name), "/f%d", i);
+    return dir + name;
+}
+
+// create, stat, list and unlink files of one directory
+
+static void create_storm(const std::string &dir, int files, bench_result &r) {
+    double start = bench_now();
+    for (int i = 0; i < files && !r.failed; i++) {
+        double t = bench_now();
+        int fd = open(file_of(dir, i).c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+        r.add(t, fd >= 0 && close(fd) == 0);
+    }
+    r.seconds = bench_now() - start;
+}
+
+static void stat_storm(const std::string &dir, int files, bench_result &r) {
+    double start = bench_now();
+    for (int i = 0; i < files && !r.failed; i++) {
+        struct stat st;
+        double t = bench_now();
+        r.add(t, stat(file_of(dir, i).c_str(), &st) == 0);
+    }
+    r.seconds = bench_now() - start;
+}
+
+// one operation is a whole listing
+static void readdir_storm(const std::string &dir, int files, bench_result &r) {
+    double start = bench_now();
+    for (int i = 0; i < READDIRS && !r.failed; i++) {
+        double t = bench_now();
+        DIR *d = opendir(dir.c_str());
+        int n = 0;
+        if (d) {
+            while (readdir(d))
+                n++;
+            closedir(d);
+        }
+        r.add(t, n >= files);  // . and .. may be listed too
+    }
+    r.seconds = bench_now() - start;
+}
+
+static void unlink_storm(const std::string &dir, int files, bench_result &r) {
+    double start = bench_now();
+    for (int i = 0; i < files && !r.failed; i++) {
+        double t = bench_now();
+        r.add(t, unlink(file_of(dir, i).c_str()) == 0);
+    }
+    r.seconds = bench_now() - start;
+}
+
+// whole file in requests of bs bytes, SEQ_PASSES times over, like dd
+
+static void seq_write(const std::string &path, const std::vector<char> &data, size_t bs, bench_result &r) {
+    double start = bench_now();
+    for (int pass = 0; pass < SEQ_PASSES && !r.failed; pass++) {
+        int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        for (size_t off = 0; fd >= 0 && off < data.size() && !r.failed; off += bs) {
+            double t = bench_now();
+            r.add(t, write(fd, &data[off], bs) == (ssize_t) bs, bs);
+        }
+        r.failed = r.failed || fd < 0 || close(fd) != 0;
+    }
+    r.seconds = bench_now() - start;
+}
+
+// checking what comes back
+static void seq_read(const std::string &path, const std::vector<char> &data, size_t bs, bench_result &r) {
+    std::vector<char> buf(bs);
+    double start = bench_now();
+    for (int pass = 0; pass < SEQ_PASSES && !r.failed; pass++) {
+        int fd = open(path.c_str(), O_RDONLY);
+        for (size_t off = 0; fd >= 0 && off < data.size() && !r.failed; off += bs) {
+            double t = bench_now();
+            bool ok = read(fd, &buf[0], bs) == (ssize_t) bs;
+            r.add(t, ok && memcmp(&buf[0], &data[off], bs) == 0, bs);
+        }
+        r.failed = r.failed || fd < 0 || close(fd) != 0;
+    }
+    r.seconds = bench_now() - start;
+}
+
+// SMALL_IO requests at random aligned offsets of a FILE_SIZE file
+static void random_io(const std::string &path, bool writing, bench_result &r) {
+    std::vector<char> buf(SMALL_IO, 'r');
+    srand(getpid());
+    double start = bench_now();
+    int fd = open(path.c_str(), writing ? O_WRONLY : O_RDONLY);
+    for (int i = 0; fd >= 0 && i < RANDOM_OPS && !r.failed; i++) {
+        off_t off = (off_t) (rand() % (FILE_SIZE / SMALL_IO)) * SMALL_IO;
+        double t = bench_now();
+        ssize_t n = writing ? pwrite(fd, &buf[0], SMALL_IO, off) : pread(fd, &buf[0], SMALL_IO, off);
+        r.add(t, n == SMALL_IO, SMALL_IO);
+    }
+    r.failed = r.failed || fd < 0 || close(fd) != 0;
+    r.seconds = bench_now() - start;
+}
+
+// threads creating, writing, reading back, stating and unlinking files in
+// directories of their own. one operation is a round.
+
+struct tripper {
+    std::string dir;
+    char data[TRIP_SIZE], buf[TRIP_SIZE];
+};
+
+static bool round_trip(void *x, long i) {
+    tripper *t = (tripper *) x;
+    std::string path = file_of(t->dir, i);
+    int fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    bool ok = write(fd, t->data, TRIP_SIZE) == TRIP_SIZE &&
+              lseek(fd, 0, SEEK_SET) == 0 &&
+              read(fd, t->buf, TRIP_SIZE) == TRIP_SIZE &&
+              memcmp(t->data, t->buf, TRIP_SIZE) == 0;
+    close(fd);
+
+    struct stat st;
+    ok = ok && stat(path.c_str(), &st) == 0 && st.st_size == TRIP_SIZE;
+    return unlink(path.c_str()) == 0 && ok;
+}
+
+// false if it failed
+static bool round_trips(int threads, int seconds) {
+    bench_result r;
+    std::vector<tripper> ts(threads);
+    std::vector<void *> ctxs;
+    for (int i = 0; i < threads; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "/trip%d", i);
+        ts[i].dir = base + name;
+        memset(ts[i].data, 'a' + i % 26, TRIP_SIZE);
+        if (mkdir(ts[i].dir.c_str(), 0755) != 0)
+            r.failed = true;
+        ctxs.push_back(&ts[i]);
+    }
+
+    if (!r.failed)
+        bench_measure(ctxs, round_trip, seconds, r);
+    for (int i = 0; i < threads; i++)
+        rmdir(ts[i].dir.c_str());
+    bench_report("round_trip", threads, r);
+    return !r.failed;
+}
+
+// threads creating, stating and unlinking files of their own in one shared
+// directory, so that they contend for its lock. one operation is a round.
+
+struct contender {
+    int id;
+    std::string dir;  // the shared directory, seen through one mount
+};
+
+static bool contend(void *x, long i) {
+    contender *c = (contender *) x;
+    char name[64];
+    snprintf(name, sizeof(name), "/c%d.%ld", c->id, i);
+    std::string path = c->dir + name;
+    struct stat st;
+
+    int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    return fd >= 0 && close(fd) == 0 &&
+           stat(path.c_str(), &st) == 0 &&
+           unlink(path.c_str()) == 0;
+}
+
+static void contention(int threads, int seconds, bench_result &r) {
+    std::string shared = base + "/shared";
+    if (mkdir(shared.c_str(), 0755) != 0) {
+        r.failed = true;
+        return;
+    }
+
+    std::vector<contender> cs(threads);
+    std::vector<void *> ctxs;
+    for (int i = 0; i < threads; i++) {
+        cs[i].id = i;
+        cs[i].dir = mounts[i % mounts.size()] + shared.substr(mounts[0].size());
+        ctxs.push_back(&cs[i]);
+    }
+    bench_measure(ctxs, contend, seconds, r);
+    rmdir(shared.c_str());
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <dir>[,<dir>...] [threads] [files] [seconds]\n", argv[0]);
+        return 1;
+    }
+    std::string list = argv[1];
+    for (size_t pos = 0; pos <= list.size(); ) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos)
+            comma = list.size();
+        mounts.push_back(list.substr(pos, comma - pos));
+        pos = comma + 1;
+    }
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    int files = argc > 3 ? atoi(argv[3]) : 500;  // the disk holds INODE_NUM inodes
+    int seconds = argc > 4 ? atoi(argv[4]) : 5;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/fs_bench.%d", getpid());
+    base = mounts[0] + name;
+    if (mkdir(base.c_str(), 0755) != 0) {
+        perror(base.c_str());
+        return 1;
+    }
+
+    bool failed = false;
+    std::string storm = base + "/storm";
+    mkdir(storm.c_str(), 0755);
+    {
+        bench_result c, s, d, u;
+        create_storm(storm, files, c);
+        bench_report("create", 1, c);
+        stat_storm(storm, files, s);
+        bench_report("stat", 1, s);
+        readdir_storm(storm, files, d);
+        bench_report("readdir", 1, d);
+        unlink_storm(storm, files, u);
+        bench_report("unlink", 1, u);
+        failed = c.failed || s.failed || d.failed || u.failed;
+    }
+    rmdir(storm.c_str());
+
+    std::string file = base + "/data";
+    std::vector<char> data(FILE_SIZE);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = 'a' + i % 26;
+    size_t sizes[] = { 512, 4096, 16384, 65536 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_result w, r;
+        char test[64];
+        seq_write(file, data, sizes[i], w);
+        snprintf(test, sizeof(test), "seq_write_%lu", (unsigned long) sizes[i]);
+        bench_report(test, 1, w);
+        seq_read(file, data, sizes[i], r);
+        snprintf(test, sizeof(test), "seq_read_%lu", (unsigned long) sizes[i]);
+        bench_report(test, 1, r);
+        failed = failed || w.failed || r.failed;
+    }
+    {
+        bench_result rw, rr;
+        random_io(file, true, rw);
+        bench_report("random_write", 1, rw);
+        random_io(file, false, rr);
+        bench_report("random_read", 1, rr);
+        failed = failed || rw.failed || rr.failed;
+    }
+    unlink(file.c_str());
+
+    for (int n = 1; !failed && n < threads; n *= 2)
+        failed = !round_trips(n, seconds);
+    failed = failed || !round_trips(threads, seconds);
+
+    {
+        bench_result r;
+        contention(threads, seconds, r);
+        bench_report("contention", threads, r);
+        failed = failed || r.failed;
+    }
+
+    rmdir(base.c_str());
+    return failed ? 1 : 0;
+}
@@ -16,8 +16,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <vector>
+#include <set>
 #include "lang/verify.h"
 #include "yfs_client.h"
+#include "logger.h"
 
 int myid;
 yfs_client *yfs;
@@ -26,6 +30,233 @@ int id() {
     return myid;
 }
 
+//
+// The kernel keeps attributes and entries for a timeout given with them,
+// and FUSE cannot tell it when they change. Only inodes whose lock the
+// client holds, and whose attributes and entries it caches itself, get a
+// non-zero timeout, so a change by another client is seen within
+// CACHE_TIMEOUT seconds. An entry depends on the lock of its directory.
+//
+#define CACHE_TIMEOUT 1.0
+
+static double
+cache_timeout(yfs_client::inum inum)
+{
+    return yfs->cached(inum) ? CACHE_TIMEOUT : 0.0;
+}
+
+//
+// Every open file, found through fi->fh, holds back contiguous writes and
+// sends them as one yfs_client::write when they stop being contiguous or
+// grow past WRITE_BEHIND_MAX. The rest goes out on flush, fsync, release,
+// before anything reads the file or its attributes, when its lock is
+// revoked and before a commit or a switch of versions (yfs_client takes it
+// then). An error in a held back write is reported by the next flush, so
+// close() sees it.
+//
+#define WRITE_BEHIND_MAX (128 * 1024)
+#define FUSE_MAX_IO      (128 * 1024)  // max_read and max_write
+
+struct open_file {
+    yfs_client::inum inum;
+    off_t off;           // where data goes
+    std::string data;    // written by the application, not yet by yfs
+    int error;           // of a held back write
+    yfs_client::readahead ra;
+};
+
+// A file unlinked while open is an orphan: the server keeps it without a
+// name until its last close here, see yfs_client::remove_orphan.
+class open_files : public write_behind {
+ private:
+    std::set<open_file *> files;
+    std::set<yfs_client::inum> orphans;
+    pthread_mutex_t mutex;
+
+    bool opened(yfs_client::inum inum) {
+        for (std::set<open_file *>::iterator it = files.begin(); it != files.end(); ++it) {
+            if ((*it)->inum == inum)
+                return true;
+        }
+        return false;
+    }
+
+ public:
+    open_files() { pthread_mutex_init(&mutex, NULL); }
+
+    open_file *open(yfs_client::inum inum) {
+        open_file *f = new open_file();
+        f->inum = inum;
+        f->off = 0;
+        f->error = 0;
+        pthread_mutex_lock(&mutex);
+        files.insert(f);
+        pthread_mutex_unlock(&mutex);
+        return f;
+    }
+
+    // true if that was the last open of an orphan
+    bool close(open_file *f) {
+        pthread_mutex_lock(&mutex);
+        files.erase(f);
+        bool last = orphans.count(f->inum) && !opened(f->inum);
+        if (last)
+            orphans.erase(f->inum);
+        pthread_mutex_unlock(&mutex);
+        delete f;
+        return last;
+    }
+
+    // a link to inum is about to go, true if it is open and must stay
+    bool unlinking(yfs_client::inum inum) {
+        pthread_mutex_lock(&mutex);
+        bool open = opened(inum);
+        if (open)
+            orphans.insert(inum);
+        pthread_mutex_unlock(&mutex);
+        return open;
+    }
+
+    // hold back a write, or hand over what must go out first
+    bool add(open_file *f, const char *buf, size_t size, off_t off,
+             off_t &out_off, std::string &out) {
+        pthread_mutex_lock(&mutex);
+        bool flush = !f->data.empty() &&
+            (off != f->off + (off_t) f->data.size() || f->data.size() + size > WRITE_BEHIND_MAX);
+        if (flush) {
+            out_off = f->off;
+            out.swap(f->data);
+        }
+        if (f->data.empty())
+            f->off = off;
+        f->data.append(buf, size);
+        pthread_mutex_unlock(&mutex);
+        return flush;
+    }
+
+    bool take(open_file *f, off_t &off, std::string &data) {
+        pthread_mutex_lock(&mutex);
+        bool found = !f->data.empty();
+        if (found) {
+            off = f->off;
+            data.clear();
+            data.swap(f->data);
+        }
+        pthread_mutex_unlock(&mutex);
+        return found;
+    }
+
+    bool take(unsigned long long inum, off_t &off, std::string &data) {
+        pthread_mutex_lock(&mutex);
+        bool found = false;
+        for (std::set<open_file *>::iterator it = files.begin(); it != files.end() && !found; ++it) {
+            if ((*it)->inum == inum && !(*it)->data.empty()) {
+                found = true;
+                off = (*it)->off;
+                data.clear();
+                data.swap((*it)->data);
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+        return found;
+    }
+
+    // a write another open file of f's inode held back over [from, to)
+    bool take_other(open_file *f, off_t from, off_t to, off_t &off, std::string &data) {
+        pthread_mutex_lock(&mutex);
+        bool found = false;
+        for (std::set<open_file *>::iterator it = files.begin(); it != files.end() && !found; ++it) {
+            open_file *o = *it;
+            if (o != f && o->inum == f->inum && !o->data.empty() &&
+                o->off < to && o->off + (off_t) o->data.size() > from) {
+                found = true;
+                off = o->off;
+                data.clear();
+                data.swap(o->data);
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+        return found;
+    }
+
+    bool take_any(unsigned long long &inum, off_t &off, std::string &data) {
+        pthread_mutex_lock(&mutex);
+        bool found = false;
+        for (std::set<open_file *>::iterator it = files.begin(); it != files.end() && !found; ++it) {
+            if (!(*it)->data.empty()) {
+                found = true;
+                inum = (*it)->inum;
+                off = (*it)->off;
+                data.clear();
+                data.swap((*it)->data);
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+        return found;
+    }
+
+    void failed(open_file *f, int error) {
+        pthread_mutex_lock(&mutex);
+        f->error = error;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    int error(open_file *f) {
+        pthread_mutex_lock(&mutex);
+        int error = f->error;
+        f->error = 0;
+        pthread_mutex_unlock(&mutex);
+        return error;
+    }
+};
+
+open_files files;
+
+static int
+write_error(int r)
+{
+    if (r == yfs_client::NOPEM)
+        return EACCES;
+    if (r == yfs_client::RDONLY)
+        return EROFS;
+    return EIO;
+}
+
+// send what an open file held back, return an errno
+static int
+flush_file(open_file *f)
+{
+    off_t off;
+    std::string data;
+    size_t written;
+
+    if (f == NULL)
+        return 0;
+    while (files.take(f, off, data)) {
+        int r = yfs->write(f->inum, data.size(), off, data.data(), written);
+        if (r != yfs_client::OK)
+            files.failed(f, write_error(r));
+    }
+    return files.error(f);
+}
+
+// send what any open file held back for inum, true if there was some
+static bool
+flush_inode(yfs_client::inum inum)
+{
+    off_t off;
+    std::string data;
+    size_t written;
+    bool flushed = false;
+
+    while (files.take(inum, off, data)) {
+        if (yfs->write(inum, data.size(), off, data.data(), written) != yfs_client::OK)
+            LOG(ERROR, "   flush: fail to write %lu bytes of %llu\n", data.size(), inum);
+        flushed = true;
+    }
+    return flushed;
+}
+
 //
 // A file/directory's attributes are a set of information
 // including owner, permissions, size, &c. The information is
@@ -44,6 +275,7 @@ getattr(yfs_client::inum inum, struct stat &st)
     yfs_client::status ret;
 
     bzero(&st, sizeof(st));
+    flush_inode(inum);
 
     st.st_ino = inum;
     if(yfs->isfile(inum)){
@@ -52,7 +284,7 @@ getattr(yfs_client::inum inum, struct stat &st)
         if(ret != yfs_client::OK)
             return ret;
         st.st_mode = S_IFREG | (info.mode & 0777);
-        st.st_nlink = 1;
+        st.st_nlink = info.nlink;
         st.st_atime = info.atime;
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
@@ -60,7 +292,7 @@ getattr(yfs_client::inum inum, struct stat &st)
         // NOTE: might be troublesome
         // st.st_uid = info.uid;
 		// st.st_gid = info.gid;
-        printf("   getattr -> %llu\n", info.size);
+        LOG(DEBUG, "   getattr -> %llu\n", info.size);
     } else if (yfs->isdir(inum)) {
         yfs_client::dirinfo info;
         ret = yfs->getdir(inum, info);
@@ -73,7 +305,7 @@ getattr(yfs_client::inum inum, struct stat &st)
         st.st_ctime = info.ctime;
         // st.st_uid = info.uid;
 		// st.st_gid = info.gid;
-        printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
+        LOG(DEBUG, "   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
     } else {
         yfs_client::slinkinfo info;
         ret = yfs->getslink(inum, info);
@@ -92,6 +324,35 @@ getattr(yfs_client::inum inum, struct stat &st)
     return yfs_client::OK;
 }
 
+// the attributes that came along with a lookup or create, type 0 if none
+// did. they are out of date if a write held back for inum goes out first.
+yfs_client::status
+entry_stat(yfs_client::inum inum, const extent_protocol::attr &a, struct stat &st)
+{
+    if (flush_inode(inum) || a.type == 0)
+        return getattr(inum, st);
+
+    bzero(&st, sizeof(st));
+    st.st_ino = inum;
+    st.st_atime = a.atime;
+    st.st_mtime = a.mtime;
+    st.st_ctime = a.ctime;
+
+    if (a.type == extent_protocol::T_FILE) {
+        st.st_mode = S_IFREG | 0666;
+        st.st_nlink = a.nlink;
+        st.st_size = a.size;
+    } else if (a.type == extent_protocol::T_DIR) {
+        st.st_mode = S_IFDIR | 0777;
+        st.st_nlink = 2;
+    } else {
+        st.st_mode = S_IFLNK | 0777;
+        st.st_nlink = 1;
+        st.st_size = a.size;
+    }
+    return yfs_client::OK;
+}
+
 //
 // This is a typical fuse operation handler; you'll be writing
 // a bunch of handlers like it.
@@ -124,7 +385,7 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
 		}
 		return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, cache_timeout(inum));
 }
 
 //
@@ -147,13 +408,14 @@ void
 fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         int to_set, struct fuse_file_info *fi)
 {
-    printf("fuseserver_setattr 0x%x\n", to_set);
-	printf("attr->mode %o\n", attr->st_mode);
-	printf("attr->u_id %d\n", attr->st_uid);
-	printf("attr->g_id %d\n", attr->st_gid);
+    LOG(DEBUG, "fuseserver_setattr 0x%x\n", to_set);
+	LOG(DEBUG, "attr->mode %o\n", attr->st_mode);
+	LOG(DEBUG, "attr->u_id %d\n", attr->st_uid);
+	LOG(DEBUG, "attr->g_id %d\n", attr->st_gid);
 
 	yfs_client::status ret;
 
+	flush_inode(ino);
 	if (LAB6_ATTR_MASK & to_set) {
         struct stat st;
 		yfs_client::filestat fst;
@@ -169,13 +431,15 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 		if (ret != yfs_client::OK) {
 			if (ret == yfs_client::NOPEM) {
 				fuse_reply_err(req, EACCES);
+			} else if (ret == yfs_client::RDONLY) {
+				fuse_reply_err(req, EROFS);
 			} else {
         		fuse_reply_err(req, ENOENT);
 			}
 			return ;
 		}
         getattr(ino, st);
-        fuse_reply_attr(req, &st, 0);
+        fuse_reply_attr(req, &st, cache_timeout(ino));
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -193,7 +457,7 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 // end of the file, read just that many bytes. If @off is greater
 // than or equal to the size of the file, read zero bytes.
 //
-// Ignore @fi.
+// @fi->fh is the open file, its reads so far drive read-ahead.
 // @req identifies this request, and is used only to send a
 // response back to fuse with fuse_reply_buf or fuse_reply_err.
 //
@@ -205,7 +469,9 @@ fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     std::string buf;
     // Change the above "#if 0" to "#if 1", and your code goes here
     int r;
-    if ((r = yfs->read(ino, size, off, buf)) == yfs_client::OK) {
+    flush_inode(ino);
+    open_file *f = (open_file *) fi->fh;
+    if ((r = yfs->read(ino, size, off, buf, f ? &f->ra : NULL)) == yfs_client::OK) {
         fuse_reply_buf(req, buf.data(), buf.size());
     } else {
 		if (r == yfs_client::NOPEM) {
@@ -231,7 +497,7 @@ fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 //
 // Set the file's mtime to the current time.
 //
-// Ignore @fi.
+// The write is held back in the open file @fi->fh, see open_files.
 //
 // @req identifies this request, and is used only to send a
 // response back to fuse with fuse_reply_buf or fuse_reply_err.
@@ -243,16 +509,43 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
 {
 #if 1
     // Change the above line to "#if 1", and your code goes here
+    if (yfs->issnapshot(ino)) {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+
+    open_file *f = (open_file *) fi->fh;
+    off_t flush_off;
+    std::string flush;
+    size_t written;
     int r;
-    if ((r = yfs->write(ino, size, off, buf, size)) == yfs_client::OK) {
-        fuse_reply_write(req, size);
-    } else {
-		if (r == yfs_client::NOPEM) {
-			fuse_reply_err(req, EACCES);
-		} else {
-        	fuse_reply_err(req, ENOENT);
-		}
+
+    if (f == NULL) {
+        r = yfs->write(ino, size, off, buf, written);
+        if (r != yfs_client::OK)
+            fuse_reply_err(req, write_error(r));
+        else
+            fuse_reply_write(req, size);
+        return;
+    }
+
+    // what another open file held back over the same bytes was written
+    // first, it goes out before this one is held back
+    while (files.take_other(f, off, off + size, flush_off, flush)) {
+        if (yfs->write(ino, flush.size(), flush_off, flush.data(), written) != yfs_client::OK)
+            LOG(ERROR, "   write: fail to write %lu bytes of %lu\n", flush.size(), ino);
+    }
+
+    // this write is held back by now, what it pushed out was written before
+    // and fails like any held back write, on the next flush
+    if (files.add(f, buf, size, off, flush_off, flush)) {
+        r = yfs->write(ino, flush.size(), flush_off, flush.data(), written);
+        if (r != yfs_client::OK) {
+            LOG(ERROR, "   write: fail to write %lu bytes of %lu\n", flush.size(), ino);
+            files.failed(f, write_error(r));
+        }
     }
+    fuse_reply_write(req, size);
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -271,8 +564,8 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
 // - Change the parent's mtime and ctime to the current time/date
 //   (this may fall naturally out of your extent server code).
 // - On success, store the inum of newly created file into @e->ino,
-//   and the new file's attribute into @e->attr. Get the file's
-//   attributes with getattr().
+//   and the new file's attribute into @e->attr. The attributes come
+//   back with the create, see entry_stat().
 //
 // @return yfs_client::OK on success, and EXIST if @name already exists.
 //
@@ -281,20 +574,24 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
         mode_t mode, struct fuse_entry_param *e, int type)
 {
     int ret;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
+    // In yfs, generations are always set to 0, timeouts are set once the
+    // locks are known
     e->attr_timeout = 0.0;
     e->entry_timeout = 0.0;
     e->generation = 0;
 
     yfs_client::inum inum;
+    extent_protocol::attr a;
     if ( type == extent_protocol::T_FILE )
-		ret = yfs->create(parent, name, mode, inum);
+		ret = yfs->create(parent, name, mode, inum, &a);
 	else
-		ret = yfs->mkdir(parent,name,mode,inum);
+		ret = yfs->mkdir(parent,name,mode,inum, &a);
     if (ret != yfs_client::OK)
         return ret;
     e->ino = inum;
-    ret = getattr(inum, e->attr);
+    ret = entry_stat(inum, a, e->attr);
+    e->attr_timeout = cache_timeout(inum);
+    e->entry_timeout = cache_timeout(parent);
     return ret;
 }
 
@@ -305,13 +602,16 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     struct fuse_entry_param e;
     yfs_client::status ret;
     if( (ret = fuseserver_createhelper( parent, name, mode, &e, extent_protocol::T_FILE)) == yfs_client::OK ) {
+        fi->fh = (uint64_t) files.open(e.ino);
         fuse_reply_create(req, &e, fi);
-        printf("OK: create returns.\n");
+        LOG(DEBUG, "OK: create returns.\n");
     } else {
         if (ret == yfs_client::EXIST) {
             fuse_reply_err(req, EEXIST);
         } else if (ret == yfs_client::NOPEM) {
 			fuse_reply_err(req, EACCES);
+		} else if (ret == yfs_client::RDONLY) {
+			fuse_reply_err(req, EROFS);
 		}else{
             fuse_reply_err(req, ENOENT);
         }
@@ -329,6 +629,8 @@ void fuseserver_mknod( fuse_req_t req, fuse_ino_t parent,
             fuse_reply_err(req, EEXIST);
         }else if (ret == yfs_client::NOPEM) {
 			fuse_reply_err(req, EACCES);
+		} else if (ret == yfs_client::RDONLY) {
+			fuse_reply_err(req, EROFS);
 		}else{
             fuse_reply_err(req, ENOENT);
         }
@@ -337,14 +639,15 @@ void fuseserver_mknod( fuse_req_t req, fuse_ino_t parent,
 
 //
 // Look up file or directory @name in the directory @parent. If @name is
-// found, set e.attr (using getattr) and e.ino to the attribute and inum of
-// the file.
+// found, set e.attr (using entry_stat) and e.ino to the attribute and inum
+// of the file.
 //
 void
 fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct fuse_entry_param e;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
+    // In yfs, generations are always set to 0, timeouts are set once the
+    // locks are known
     e.attr_timeout = 0.0;
     e.entry_timeout = 0.0;
     e.generation = 0;
@@ -352,7 +655,8 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 	yfs_client::status ret;
 
      yfs_client::inum ino;
-     ret = yfs->lookup(parent, name, found, ino);
+     extent_protocol::attr a;
+     ret = yfs->lookup(parent, name, found, ino, &a);
 
 	if (ret == yfs_client::NOPEM){
 		fuse_reply_err(req, EACCES);
@@ -360,7 +664,9 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 	}
     if (found) {
         e.ino = ino;
-        getattr(ino, e.attr);
+        entry_stat(ino, a, e.attr);
+        e.attr_timeout = cache_timeout(ino);
+        e.entry_timeout = cache_timeout(parent);
         fuse_reply_entry(req, &e);
     } else {
         	fuse_reply_err(req, ENOENT);
@@ -369,66 +675,59 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 }
 
 
-struct dirbuf {
-    char *p;
-    size_t size;
-};
-
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
-{
-    struct stat stbuf;
-    size_t oldsize = b->size;
-    b->size += fuse_dirent_size(strlen(name));
-    b->p = (char *) realloc(b->p, b->size);
-    memset(&stbuf, 0, sizeof(stbuf));
-    stbuf.st_ino = ino;
-    fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
-}
-
-#define min(x, y) ((x) < (y) ? (x) : (y))
-
-int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
-        off_t off, size_t maxsize)
-{
-    if ((size_t)off < bufsize)
-        return fuse_reply_buf(req, buf + off, min(bufsize - off, maxsize));
-    else
-        return fuse_reply_buf(req, NULL, 0);
-}
-
-//
-// Retrieve all the file names / i-numbers pairs
-// in directory @ino. Send the reply using reply_buf_limited.
 //
-// You can ignore @size and @off (except that you must pass
-// them to reply_buf_limited).
+// Retrieve the file names / i-numbers pairs in directory @ino,
+// as many as fit in @size bytes.
 //
-// Call dirbuf_add(&b, name, inum) for each entry in the directory.
+// @off is 0 for the first call and after that the position stored with
+// the last entry returned, so every call picks up where the previous one
+// stopped and only reads that part of the directory. The attributes come
+// along and give each entry its type.
 //
 void
 fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
         off_t off, struct fuse_file_info *fi)
 {
     yfs_client::inum inum = ino; // req->in.h.nodeid;
-    struct dirbuf b;
 
-    printf("fuseserver_readdir\n");
+    LOG(DEBUG, "fuseserver_readdir\n");
 
     if(!yfs->isdir(inum)){
         fuse_reply_err(req, ENOTDIR);
         return;
     }
 
-    memset(&b, 0, sizeof(b));
-
+    // no entry takes less than fuse_dirent_size(1)
     std::list<yfs_client::dirent> entries;
-    yfs->readdir(inum, entries);
+    if (yfs->readdirplus(inum, off, size / fuse_dirent_size(1), entries) != yfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    char *buf = (char *) malloc(size);
+    size_t used = 0;
+
     for (std::list<yfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
+        size_t len = fuse_dirent_size(it->name.size());
+        if (used + len > size)
+            break;
+
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = it->inum;
+        if (it->a.type == extent_protocol::T_DIR)
+            st.st_mode = S_IFDIR;
+        else if (it->a.type == extent_protocol::T_FILE)
+            st.st_mode = S_IFREG;
+        else if (it->a.type == extent_protocol::T_SLINK)
+            st.st_mode = S_IFLNK;
+
+        fuse_add_dirent(buf + used, it->name.c_str(), &st, it->next);
+        used += len;
     }
 
-    reply_buf_limited(req, b.p, b.size, off, size);
-    free(b.p);
+    fuse_reply_buf(req, buf, used);
+    free(buf);
 }
 
 
@@ -436,9 +735,39 @@ void
 fuseserver_open(fuse_req_t req, fuse_ino_t ino,
         struct fuse_file_info *fi)
 {
+    fi->fh = (uint64_t) files.open(ino);
     fuse_reply_open(req, fi);
 }
 
+//
+// Called on every close() of a file descriptor, which is to see errors of
+// the writes held back so far.
+//
+void
+fuseserver_flush(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, flush_file((open_file *) fi->fh));
+}
+
+void
+fuseserver_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+        struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, flush_file((open_file *) fi->fh));
+}
+
+void
+fuseserver_release(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    open_file *f = (open_file *) fi->fh;
+    int error = flush_file(f);
+    if (f && files.close(f) && yfs->remove_orphan(ino) != yfs_client::OK)
+        LOG(WARN, "   release: fail to remove orphan %lu\n", ino);
+    fuse_reply_err(req, error);
+}
+
 //
 // Create a new directory with name @name in parent directory @parent.
 // Leave new directory's inum in e.ino and attributes in e.attr.
@@ -471,6 +800,8 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
             fuse_reply_err(req, EEXIST);
         } else if (ret == yfs_client::NOPEM) {
 			fuse_reply_err(req, EACCES);
+		} else if (ret == yfs_client::RDONLY) {
+			fuse_reply_err(req, EROFS);
 		}else {
             fuse_reply_err(req, ENOENT);
         }
@@ -483,7 +814,8 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 
 //
 // Remove the file named @name from directory @parent.
-// Free the file's extent.
+// Free the file's extent with its last link, or at its last close
+// if it is open.
 // If the file doesn't exist, indicate error ENOENT.
 //
 // Do *not* allow unlinking of a directory.
@@ -492,13 +824,20 @@ void
 fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     int r;
-    if ((r = yfs->unlink(parent, name)) == yfs_client::OK) {
+    bool found = false;
+    yfs_client::inum ino;
+
+    yfs->lookup(parent, name, found, ino);
+    bool open = found && files.unlinking(ino);
+    if ((r = yfs->unlink(parent, name, open)) == yfs_client::OK) {
         fuse_reply_err(req, 0);
     } else {
         if (r == yfs_client::NOENT) {
             fuse_reply_err(req, ENOENT);
         } else if (r == yfs_client::NOPEM) {
 			fuse_reply_err(req, EACCES);
+		} else if (r == yfs_client::RDONLY) {
+			fuse_reply_err(req, EROFS);
 		}else{
             fuse_reply_err(req, ENOTEMPTY);
         }
@@ -510,7 +849,7 @@ fuseserver_statfs(fuse_req_t req)
 {
     struct statvfs buf;
 
-    printf("statfs\n");
+    LOG(DEBUG, "statfs\n");
 
     memset(&buf, 0, sizeof(buf));
 
@@ -534,7 +873,11 @@ void fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, con
     if ((r = yfs->symlink(parent, link, name, inum)) == yfs_client::OK) {
         e.ino = inum;
         getattr(inum, e.attr);
+        e.attr_timeout  = cache_timeout(inum);
+        e.entry_timeout = cache_timeout(parent);
         fuse_reply_entry(req, &e);
+    } else if (r == yfs_client::RDONLY) {
+        fuse_reply_err(req, EROFS);
     } else {
         fuse_reply_err(req, r);
     }
@@ -559,46 +902,190 @@ void fuseserver_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
     } else {
         if (r == yfs_client::NOENT) {
             fuse_reply_err(req, ENOENT);
+        } else if (r == yfs_client::RDONLY) {
+            fuse_reply_err(req, EROFS);
         } else {
             fuse_reply_err(req, ENOTEMPTY);
         }
     }
 }
 
+//
+// Move @name in @parent to @newname in @newparent, replacing what
+// @newname named. yfs moves the entry on the server without touching
+// the file, see yfs_client::rename.
+//
+void fuseserver_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_ino_t newparent, const char *newname) {
+    int r;
+    bool found = false, replaces = false;
+    yfs_client::inum ino, old;
+
+    yfs->lookup(parent, name, found, ino);
+    yfs->lookup(newparent, newname, replaces, old);
+    bool open = replaces && !(found && ino == old) && files.unlinking(old);
+    if ((r = yfs->rename(parent, name, newparent, newname, open)) == yfs_client::OK) {
+        fuse_reply_err(req, 0);
+    } else if (r == yfs_client::NOENT) {
+        fuse_reply_err(req, ENOENT);
+    } else if (r == yfs_client::RDONLY) {
+        fuse_reply_err(req, EROFS);
+    } else if (r == yfs_client::NOTDIR) {
+        fuse_reply_err(req, ENOTDIR);
+    } else if (r == yfs_client::ISDIR) {
+        fuse_reply_err(req, EISDIR);
+    } else if (r == yfs_client::NOTEMPTY) {
+        fuse_reply_err(req, ENOTEMPTY);
+    } else if (r == yfs_client::EINVA) {
+        fuse_reply_err(req, EINVAL);
+    } else {
+        fuse_reply_err(req, EIO);
+    }
+}
+
+//
+// Give the file @ino one more name, @newname in @newparent.
+// Reply with its attributes like lookup does.
+//
+void fuseserver_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+        const char *newname) {
+    struct fuse_entry_param e;
+    int r;
+
+    e.attr_timeout  = 0.0;
+    e.entry_timeout = 0.0;
+    e.generation    = 0;
+
+    if ((r = yfs->link(ino, newparent, newname)) == yfs_client::OK) {
+        e.ino = ino;
+        if (getattr(ino, e.attr) != yfs_client::OK) {
+            fuse_reply_err(req, EIO);
+            return;
+        }
+        e.attr_timeout  = cache_timeout(ino);
+        e.entry_timeout = cache_timeout(newparent);
+        fuse_reply_entry(req, &e);
+    } else if (r == yfs_client::EXIST) {
+        fuse_reply_err(req, EEXIST);
+    } else if (r == yfs_client::NOENT) {
+        fuse_reply_err(req, ENOENT);
+    } else if (r == yfs_client::RDONLY) {
+        fuse_reply_err(req, EROFS);
+    } else if (r == yfs_client::ISDIR) {
+        fuse_reply_err(req, EPERM);
+    } else {
+        fuse_reply_err(req, EIO);
+    }
+}
+
 struct fuse_lowlevel_ops fuseserver_oper;
 
-// register sig handler for version control
-void sig_handler(int no) {
-    switch (no) {
-        case SIGINT:
-            printf("[version]commit a new version\n");
-            yfs->commit();
-            break;
-        case SIGUSR1:
-            printf("[version]to previous version\n");
-            yfs->rollback();
+// requests are served by this many threads, unless YFS_THREADS says otherwise
+#define FUSE_THREADS 8
+
+//
+// Each worker takes the next request from the kernel and serves it, so a
+// request waiting on a lock or a slow RPC does not hold up the others. This
+// is fuse_session_loop() run by several threads at once; yfs_client keeps
+// the per-inode locks, so requests on different files run in parallel.
+//
+void *
+fuseserver_worker(void *x)
+{
+    struct fuse_session *se = (struct fuse_session *) x;
+    struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *buf = (char *) malloc(bufsize);
+
+    while (!fuse_session_exited(se)) {
+        int res = fuse_chan_receive(ch, buf, bufsize);
+        if (res == 0)
+            continue;
+        if (res == -1)
             break;
-        case SIGUSR2:
-            printf("[version]to next version\n");
-            yfs->forward();
+        fuse_session_process(se, buf, res, ch);
+    }
+
+    // wake up the others
+    fuse_session_exit(se);
+    free(buf);
+    return NULL;
+}
+
+int
+fuseserver_loop(struct fuse_session *se, int nthreads)
+{
+    std::vector<pthread_t> workers(nthreads);
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&workers[i], NULL, fuseserver_worker, se) != 0) {
+            fprintf(stderr, "fuseserver_loop: cannot start worker %d\n", i);
+            fuse_session_exit(se);
+            nthreads = i;
             break;
+        }
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    return nthreads > 0 ? 0 : -1;
+}
+
+// Signals for version control. A commit or a switch takes the locks the
+// workers take, so the handler only passes the signal on through a pipe
+// and version_thread runs it.
+static int version_pipe[2];
+
+void sig_handler(int no) {
+    char c = (char) no;
+    if (write(version_pipe[1], &c, 1) != 1) {
+        // the pipe is full of pending requests, this one is dropped
+    }
+}
+
+static void *
+version_thread(void *)
+{
+    char c;
+
+    while (read(version_pipe[0], &c, 1) == 1) {
+        switch (c) {
+            case SIGINT:
+                printf("[version]commit a new version\n");
+                yfs->commit();
+                break;
+            case SIGUSR1:
+                printf("[version]to previous version\n");
+                yfs->rollback();
+                break;
+            case SIGUSR2:
+                printf("[version]to next version\n");
+                yfs->forward();
+                break;
+        }
     }
+    return NULL;
 }
 
 
 int
 main(int argc, char *argv[])
 {
+    if (pipe(version_pipe) != 0) {
+        LOG(ERROR, "fail to create the version pipe\n");
+        return -1;
+    }
     if (signal(SIGINT, sig_handler) == SIG_ERR) {
-        printf("fail to register signal handler\n");
+        LOG(ERROR, "fail to register signal handler\n");
         return -1;
     }
     if (signal(SIGUSR1, sig_handler) == SIG_ERR) {
-        printf("fail to register signal handler\n");
+        LOG(ERROR, "fail to register signal handler\n");
         return -1;
     }
     if (signal(SIGUSR2, sig_handler) == SIG_ERR) {
-        printf("fail to register signal handler\n");
+        LOG(ERROR, "fail to register signal handler\n");
         return -1;
     }
 
@@ -626,8 +1113,12 @@ main(int argc, char *argv[])
     myid = random();
 
     yfs = new yfs_client(argv[2], argv[3], argv[4]);
+    yfs->set_write_behind(&files);
     // yfs = new yfs_client();
 
+    pthread_t version_th;
+    VERIFY(pthread_create(&version_th, NULL, version_thread, NULL) == 0);
+
     fuseserver_oper.getattr    = fuseserver_getattr;
     fuseserver_oper.statfs     = fuseserver_statfs;
     fuseserver_oper.readdir    = fuseserver_readdir;
@@ -635,6 +1126,9 @@ main(int argc, char *argv[])
     fuseserver_oper.create     = fuseserver_create;
     fuseserver_oper.mknod      = fuseserver_mknod;
     fuseserver_oper.open       = fuseserver_open;
+    fuseserver_oper.flush      = fuseserver_flush;
+    fuseserver_oper.fsync      = fuseserver_fsync;
+    fuseserver_oper.release    = fuseserver_release;
     fuseserver_oper.read       = fuseserver_read;
     fuseserver_oper.write      = fuseserver_write;
     fuseserver_oper.setattr    = fuseserver_setattr;
@@ -643,6 +1137,8 @@ main(int argc, char *argv[])
     fuseserver_oper.symlink    = fuseserver_symlink;
     fuseserver_oper.readlink   = fuseserver_readlink;
     fuseserver_oper.rmdir      = fuseserver_rmdir;
+    fuseserver_oper.rename     = fuseserver_rename;
+    fuseserver_oper.link       = fuseserver_link;
 
     const char *fuse_argv[20];
     int fuse_argc = 0;
@@ -658,12 +1154,19 @@ main(int argc, char *argv[])
     //fuse_argv[fuse_argc++] = "-o";
     //fuse_argv[fuse_argc++] = "allow_other";
 
+    // let the kernel send reads and writes in large pieces
+    char io_opts[64];
+    snprintf(io_opts, sizeof(io_opts), "max_read=%d,max_write=%d", FUSE_MAX_IO, FUSE_MAX_IO);
+    fuse_argv[fuse_argc++] = "-o";
+    fuse_argv[fuse_argc++] = io_opts;
+
     fuse_argv[fuse_argc++] = mountpoint;
     fuse_argv[fuse_argc++] = "-d";
 
     fuse_args args = FUSE_ARGS_INIT( fuse_argc, (char **) fuse_argv );
     int foreground;
-    int res = fuse_parse_cmdline( &args, &mountpoint, 0 /*multithreaded*/,
+    int multithreaded;
+    int res = fuse_parse_cmdline( &args, &mountpoint, &multithreaded,
             &foreground );
     if( res == -1 ) {
         fprintf(stderr, "fuse_parse_cmdline failed\n");
@@ -694,8 +1197,14 @@ main(int argc, char *argv[])
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+
+    // -s asks for one thread, YFS_THREADS for another number of them
+    int nthreads = multithreaded ? FUSE_THREADS : 1;
+    char *threads_env = getenv("YFS_THREADS");
+    if (threads_env != NULL && atoi(threads_env) > 0) {
+        nthreads = atoi(threads_env);
+    }
+    err = fuseserver_loop(se, nthreads);
 
     fuse_session_destroy(se);
     close(fd);
@@ -0,0 +1,248 @@
+#include "handle.h"
+#include <stdio.h>
+#include <unistd.h>
+#include "tprintf.h"
+
+handle_mgr mgr;
+
+handle::handle(std::string m) 
+{
+  h = mgr.get_handle(m);
+}
+
+rpcc *
+handle::safebind()
+{
+  if (!h)
+    return NULL;
+
+  // established, take the next bound connection
+  int n = h->nbound;
+  if (n > 0) {
+    __sync_synchronize();
+    if (h->del)
+      return NULL;
+    return h->cl[__sync_fetch_and_add(&h->next, 1) % n];
+  }
+
+  ScopedLock ml(&h->cl_mutex);
+  if (h->del)
+    return NULL;
+  if (h->nbound > 0)
+    return h->cl[0];
+  sockaddr_in dstsock;
+  make_sockaddr(h->m.c_str(), &dstsock);
+  rpcc *cl = new rpcc(dstsock);
+  tprintf("handler_mgr::get_handle trying to bind...%s\n", h->m.c_str());
+  int ret;
+  // Starting with lab 6, our test script assumes that the failure
+  // can be detected by paxos and rsm layer within few seconds. We have
+  // to set the timeout with a small value to support the assumption.
+  // 
+  // Note: with RPC_LOSSY=5, your lab would failed to pass the tests of
+  // lab 6 and lab 7 because the rpc layer may delay your RPC request, 
+  // and cause a time out failure. Please make sure RPC_LOSSY is set to 0.
+  ret = cl->bind(rpcc::to(1000));
+  if (ret < 0) {
+    tprintf("handle_mgr::get_handle bind failure! %s %d\n", h->m.c_str(), ret);
+    delete cl;
+    h->del = true;
+    return NULL;
+  }
+  tprintf("handle_mgr::get_handle bind succeeded %s\n", h->m.c_str());
+  h->cl[0] = cl;
+  __sync_synchronize();
+  h->nbound = 1;
+  // the rest are bound in the background
+  mgr.grow(h);
+  return cl;
+}
+
+handle::~handle() 
+{
+  if (h) mgr.done_handle(h);
+}
+
+handle_mgr::handle_mgr()
+{
+  VERIFY (pthread_rwlock_init(&handle_lock, NULL) == 0);
+  VERIFY (pthread_mutex_init(&bind_mutex, NULL) == 0);
+  VERIFY (pthread_cond_init(&bind_cond, NULL) == 0);
+  binder_started = false;
+}
+
+struct hinfo *
+handle_mgr::get_handle(std::string m)
+{
+  struct hinfo *h = 0;
+  std::map<std::string, struct hinfo *>::iterator it;
+
+  VERIFY (pthread_rwlock_rdlock(&handle_lock) == 0);
+  it = hmap.find(m);
+  if (it != hmap.end()) {
+    if (!it->second->del) {
+      h = it->second;
+      __sync_fetch_and_add(&h->refcnt, 1);
+    }
+    VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+    return h;
+  }
+  VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+
+  VERIFY (pthread_rwlock_wrlock(&handle_lock) == 0);
+  it = hmap.find(m);
+  if (it == hmap.end()) {
+    h = new hinfo;
+    h->nbound = 0;
+    h->next = 0;
+    h->del = false;
+    h->queued = false;
+    h->failures = 0;
+    h->refcnt = 1;
+    h->m = m;
+    pthread_mutex_init(&h->cl_mutex, NULL);
+    hmap[m] = h;
+  } else if (!it->second->del) {
+    h = it->second;
+    __sync_fetch_and_add(&h->refcnt, 1);
+  }
+  VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+  return h;
+}
+
+void 
+handle_mgr::done_handle(struct hinfo *h)
+{
+  std::string m;
+
+  VERIFY (pthread_rwlock_rdlock(&handle_lock) == 0);
+  bool last = __sync_sub_and_fetch(&h->refcnt, 1) == 0 && h->del;
+  if (last)
+    m = h->m;
+  VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+
+  if (last) {
+    // h may be gone by now, look it up again
+    VERIFY (pthread_rwlock_wrlock(&handle_lock) == 0);
+    std::map<std::string, struct hinfo *>::iterator it = hmap.find(m);
+    if (it != hmap.end() && it->second == h && h->refcnt == 0)
+      delete_handle_wo(m);
+    VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+  }
+}
+
+void
+handle_mgr::delete_handle(std::string m)
+{
+  VERIFY (pthread_rwlock_wrlock(&handle_lock) == 0);
+  delete_handle_wo(m);
+  VERIFY (pthread_rwlock_unlock(&handle_lock) == 0);
+}
+
+// Must be called with handle_lock write-locked.
+void
+handle_mgr::delete_handle_wo(std::string m)
+{
+  if (hmap.find(m) == hmap.end()) {
+    tprintf("handle_mgr::delete_handle_wo: cl %s isn't in cl list\n", m.c_str());
+  } else {
+    tprintf("handle_mgr::delete_handle_wo: cl %s refcnt %d\n", m.c_str(),
+	   hmap[m]->refcnt);
+    struct hinfo *h = hmap[m];
+    if (h->refcnt == 0) {
+      for (int i = 0; i < h->nbound; i++) {
+        h->cl[i]->cancel();
+        delete h->cl[i];
+      }
+      pthread_mutex_destroy(&h->cl_mutex);
+      hmap.erase(m);
+      delete h;
+    } else {
+      h->del = true;
+    }
+  }
+}
+
+// queue h for the binder, which keeps a reference until it is done
+void
+handle_mgr::grow(struct hinfo *h)
+{
+  ScopedLock ml(&bind_mutex);
+  if (h->queued)
+    return;
+  h->queued = true;
+  __sync_fetch_and_add(&h->refcnt, 1);
+  to_bind.push_back(h);
+  if (!binder_started) {
+    pthread_t th;
+    VERIFY (pthread_create(&th, NULL, &handle_mgr::binder_thread, this) == 0);
+    pthread_detach(th);
+    binder_started = true;
+  }
+  VERIFY (pthread_cond_signal(&bind_cond) == 0);
+}
+
+void *
+handle_mgr::binder_thread(void *x)
+{
+  ((handle_mgr *) x)->binder();
+  return 0;
+}
+
+// bind one more connection per turn for each queued handle, so a slow
+// or dead host holds up the others for at most one bind timeout.
+void
+handle_mgr::binder()
+{
+  VERIFY (pthread_mutex_lock(&bind_mutex) == 0);
+  while (true) {
+    while (to_bind.empty())
+      VERIFY (pthread_cond_wait(&bind_cond, &bind_mutex) == 0);
+    struct hinfo *h = to_bind.front();
+    to_bind.pop_front();
+    VERIFY (pthread_mutex_unlock(&bind_mutex) == 0);
+
+    rpcc *cl = NULL;
+    if (!h->del) {
+      sockaddr_in dstsock;
+      make_sockaddr(h->m.c_str(), &dstsock);
+      cl = new rpcc(dstsock);
+      if (cl->bind(rpcc::to(1000)) < 0) {
+        tprintf("handle_mgr::binder bind failure %s\n", h->m.c_str());
+        delete cl;
+        cl = NULL;
+      }
+    }
+
+    bool more, backoff;
+    {
+      ScopedLock ml(&h->cl_mutex);
+      if (cl && !h->del && h->nbound < HANDLE_CONNS) {
+        h->cl[h->nbound] = cl;
+        __sync_synchronize();
+        h->nbound++;
+        h->failures = 0;
+        cl = NULL;
+      } else if (!cl) {
+        h->failures++;
+      }
+      more = !h->del && h->nbound < HANDLE_CONNS && h->failures < HANDLE_RETRIES;
+      backoff = more && h->failures > 0;
+    }
+    if (cl)
+      delete cl;
+    // give a host that refused us a moment before trying it again
+    if (backoff)
+      sleep(1);
+
+    VERIFY (pthread_mutex_lock(&bind_mutex) == 0);
+    if (more) {
+      to_bind.push_back(h);
+    } else {
+      h->queued = false;
+      VERIFY (pthread_mutex_unlock(&bind_mutex) == 0);
+      done_handle(h);
+      VERIFY (pthread_mutex_lock(&bind_mutex) == 0);
+    }
+  }
+}
@@ -0,0 +1,113 @@
+// manage a cache of RPC connections.
+// assuming cid is a std::string holding the
+// host:port of the RPC server you want
+// to talk to:
+//
+// handle h(cid);
+// rpcc *cl = h.safebind();
+// if(cl){
+//   ret = cl->call(...);
+// } else {
+//   bind() failed
+// }
+//
+// if the calling program has not contacted
+// cid before, safebind() will create a new
+// connection, call bind(), and return
+// an rpcc*, or 0 if bind() failed. if the
+// program has previously contacted cid,
+// safebind() just returns the previously
+// created rpcc*. best not to hold any
+// mutexes while calling safebind().
+//
+// a destination gets up to HANDLE_CONNS
+// connections. the first is bound by the
+// first safebind(); the others are bound,
+// and rebound after a failure, by a
+// background thread. safebind() hands the
+// bound ones out in turn, so that threads
+// talking to the same host do not all
+// queue behind one socket.
+
+#ifndef handle_h
+#define handle_h
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include "rpc.h"
+
+#define HANDLE_CONNS 4
+// failed background binds in a row before giving up on more connections
+#define HANDLE_RETRIES 3
+
+struct hinfo {
+  // cl[0..nbound-1] are bound. a connection is only added, never
+  // removed, until the handle is deleted, so callers pick one without
+  // taking cl_mutex.
+  rpcc *cl[HANDLE_CONNS];
+  volatile int nbound;
+  unsigned next;
+  int refcnt;
+  volatile bool del;
+  bool queued;  // waiting for the binder
+  int failures; // failed background binds in a row
+  std::string m;
+  pthread_mutex_t cl_mutex;
+};
+
+class handle {
+ private:
+  struct hinfo *h;
+ public:
+  handle(std::string m);
+  ~handle();
+  /* safebind will try to bind with the rpc server on the first call.
+   * Since bind may block, the caller probably should not hold a mutex
+   * when calling safebind.
+   *
+   * return: 
+   *   if the first safebind succeeded, all later calls would return
+   *   a rpcc object, not always the same one; otherwise, all later
+   *   calls would return NULL.
+   *
+   * Example:
+   *   handle h(dst);
+   *   XXX_protocol::status ret;
+   *   if (h.safebind()) {
+   *     ret = h.safebind()->call(...);
+   *   }
+   *   if (!h.safebind() || ret != XXX_protocol::OK) {
+   *     // handle failure
+   *   }
+   */
+  rpcc *safebind();
+};
+
+class handle_mgr {
+ private:
+  // lookups of existing handles share the lock, only adding and
+  // deleting a handle takes it exclusively.
+  pthread_rwlock_t handle_lock;
+  std::map<std::string, struct hinfo *> hmap;
+
+  // handles that want more connections, each holds a reference
+  pthread_mutex_t bind_mutex;
+  pthread_cond_t bind_cond;
+  std::list<struct hinfo *> to_bind;
+  bool binder_started;
+  void binder();
+  static void *binder_thread(void *x);
+ public:
+  handle_mgr();
+  struct hinfo *get_handle(std::string m);
+  void done_handle(struct hinfo *h);
+  void delete_handle(std::string m);
+  void delete_handle_wo(std::string m);
+  void grow(struct hinfo *h);
+};
+
+extern class handle_mgr mgr;
+
+#endif
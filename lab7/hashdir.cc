@@ -0,0 +1,323 @@
+// hashed directory format, see hashdir.h
+#include "hashdir.h"
+#include "logger.h"
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+typedef struct hashdir_header {
+    uint32_t magic;
+    uint32_t depth;     // global depth, the table has 1 << depth slots
+    uint32_t nbuckets;  // buckets are blocks 1..nbuckets
+    uint32_t nentries;
+    uint16_t table[1 << HASHDIR_MAX_DEPTH];  // slot -> bucket block
+} hashdir_header_t;
+
+// a bucket block starts with its local depth and the bytes used by records,
+// each record is a 4-byte inum, a 1-byte name length and the name.
+#define BUCKET_HEAD 4
+#define RECORD_SIZE(name) (5 + (int)(name).size())
+
+struct bucket {
+    int depth;
+    int used;
+    std::vector<hashdir::entry> entries;
+};
+
+// FNV-1a
+static uint32_t hash(const std::string &name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < name.size(); i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// return NOENT for an empty directory
+static int read_header(hashdir::storage &s, hashdir_header_t &hdr) {
+    std::string block;
+    int r = s.read(0, block);
+    if (r != hashdir::OK)
+        return r;
+
+    memcpy(&hdr, block.data(), sizeof(hdr));
+    if (hdr.magic != HASHDIR_MAGIC) {
+        LOG(ERROR, "hd: bad directory header\n");
+        return hashdir::IOERR;
+    }
+    return hashdir::OK;
+}
+
+static int write_header(hashdir::storage &s, const hashdir_header_t &hdr) {
+    std::string block(BLOCK_SIZE, '\0');
+    memcpy(&block[0], &hdr, sizeof(hdr));
+    return s.write(0, block);
+}
+
+static int read_bucket(hashdir::storage &s, int index, bucket &b) {
+    std::string block;
+    if (s.read(index, block) != hashdir::OK)
+        return hashdir::IOERR;
+
+    const unsigned char *p = (const unsigned char *)block.data();
+    b.depth = p[0] | p[1] << 8;
+    b.used  = p[2] | p[3] << 8;
+    b.entries.clear();
+
+    for (int off = BUCKET_HEAD; off < BUCKET_HEAD + b.used; ) {
+        hashdir::entry e;
+        memcpy(&e.inum, p + off, 4);
+        e.name.assign((const char *)p + off + 5, p[off + 4]);
+        off += RECORD_SIZE(e.name);
+        b.entries.push_back(e);
+    }
+    return hashdir::OK;
+}
+
+static int write_bucket(hashdir::storage &s, int index, const bucket &b) {
+    std::string block(BLOCK_SIZE, '\0');
+    unsigned char *p = (unsigned char *)&block[0];
+    int off = BUCKET_HEAD;
+
+    for (size_t i = 0; i < b.entries.size(); i++) {
+        const hashdir::entry &e = b.entries[i];
+        memcpy(p + off, &e.inum, 4);
+        p[off + 4] = e.name.size();
+        memcpy(p + off + 5, e.name.data(), e.name.size());
+        off += RECORD_SIZE(e.name);
+    }
+
+    p[0] = b.depth & 0xff;
+    p[1] = b.depth >> 8;
+    p[2] = (off - BUCKET_HEAD) & 0xff;
+    p[3] = (off - BUCKET_HEAD) >> 8;
+    return s.write(index, block);
+}
+
+// a scan position is the reversed hash in the upper bits and, in the low 16,
+// the rank of the name among those sharing that hash
+#define SCAN_END ((uint64_t)1 << 48)
+
+static uint32_t reverse(uint32_t x) {
+    uint32_t r = 0;
+    for (int i = 0; i < 32; i++, x >>= 1) {
+        r = r << 1 | (x & 1);
+    }
+    return r;
+}
+
+static int slot_of(const hashdir_header_t &hdr, const std::string &name) {
+    return hash(name) & ((1u << hdr.depth) - 1);
+}
+
+int hashdir::lookup(storage &s, const std::string &name, uint32_t &inum) {
+    hashdir_header_t hdr;
+    int r = read_header(s, hdr);
+    if (r != OK)
+        return r;
+
+    bucket b;
+    if (read_bucket(s, hdr.table[slot_of(hdr, name)], b) != OK)
+        return IOERR;
+
+    for (size_t i = 0; i < b.entries.size(); i++) {
+        if (b.entries[i].name == name) {
+            inum = b.entries[i].inum;
+            return OK;
+        }
+    }
+    return NOENT;
+}
+
+int hashdir::add(storage &s, const std::string &name, uint32_t inum) {
+    if (name.empty() || name.size() > HASHDIR_MAX_NAME)
+        return NOSPC;
+
+    hashdir_header_t hdr;
+    int r = read_header(s, hdr);
+
+    if (r == NOENT) {  // first entry, lay out header and one bucket
+        bzero(&hdr, sizeof(hdr));
+        hdr.magic = HASHDIR_MAGIC;
+        hdr.nbuckets = 1;
+        hdr.table[0] = 1;
+
+        bucket empty;
+        empty.depth = 0;
+        if (write_header(s, hdr) != OK || write_bucket(s, 1, empty) != OK)
+            return IOERR;
+    } else if (r != OK) {
+        return r;
+    }
+
+    uint32_t h = hash(name);
+
+    while (true) {
+        int index = hdr.table[h & ((1u << hdr.depth) - 1)];
+        bucket b;
+        if (read_bucket(s, index, b) != OK)
+            return IOERR;
+
+        for (size_t i = 0; i < b.entries.size(); i++) {
+            if (b.entries[i].name == name)
+                return EXIST;
+        }
+
+        if (BUCKET_HEAD + b.used + RECORD_SIZE(name) <= BLOCK_SIZE) {
+            entry e;
+            e.name = name;
+            e.inum = inum;
+            b.entries.push_back(e);
+            hdr.nentries++;
+
+            if (write_bucket(s, index, b) != OK || write_header(s, hdr) != OK)
+                return IOERR;
+            return OK;
+        }
+
+        // bucket is full, split it on the next hash bit
+        if (b.depth == (int)hdr.depth) {
+            if (hdr.depth == HASHDIR_MAX_DEPTH) {
+                LOG(WARN, "hd: directory full\n");
+                return NOSPC;
+            }
+            for (int i = 0; i < (1 << hdr.depth); i++) {
+                hdr.table[i + (1 << hdr.depth)] = hdr.table[i];
+            }
+            hdr.depth++;
+        }
+
+        bucket low, high;
+        low.depth = high.depth = b.depth + 1;
+        for (size_t i = 0; i < b.entries.size(); i++) {
+            if (hash(b.entries[i].name) >> b.depth & 1)
+                high.entries.push_back(b.entries[i]);
+            else
+                low.entries.push_back(b.entries[i]);
+        }
+
+        int new_index = ++hdr.nbuckets;
+        for (int i = 0; i < (1 << hdr.depth); i++) {
+            if (hdr.table[i] == index && (i >> b.depth & 1))
+                hdr.table[i] = new_index;
+        }
+
+        if (write_bucket(s, index, low) != OK || write_bucket(s, new_index, high) != OK ||
+            write_header(s, hdr) != OK)
+            return IOERR;
+    }
+}
+
+// buckets are never merged back, the directory keeps its size
+int hashdir::remove(storage &s, const std::string &name, uint32_t &inum) {
+    hashdir_header_t hdr;
+    int r = read_header(s, hdr);
+    if (r != OK)
+        return r;
+
+    int index = hdr.table[slot_of(hdr, name)];
+    bucket b;
+    if (read_bucket(s, index, b) != OK)
+        return IOERR;
+
+    for (size_t i = 0; i < b.entries.size(); i++) {
+        if (b.entries[i].name == name) {
+            inum = b.entries[i].inum;
+            b.entries.erase(b.entries.begin() + i);
+            hdr.nentries--;
+
+            if (write_bucket(s, index, b) != OK || write_header(s, hdr) != OK)
+                return IOERR;
+            return OK;
+        }
+    }
+    return NOENT;
+}
+
+int hashdir::list(storage &s, std::list<entry> &entries) {
+    entries.clear();
+
+    hashdir_header_t hdr;
+    int r = read_header(s, hdr);
+    if (r == NOENT)
+        return OK;
+    if (r != OK)
+        return r;
+
+    for (uint32_t index = 1; index <= hdr.nbuckets; index++) {
+        bucket b;
+        if (read_bucket(s, index, b) != OK)
+            return IOERR;
+        entries.insert(entries.end(), b.entries.begin(), b.entries.end());
+    }
+    return OK;
+}
+
+int hashdir::count(storage &s, int &n) {
+    hashdir_header_t hdr;
+    int r = read_header(s, hdr);
+
+    n = r == OK ? hdr.nentries : 0;
+    return r == NOENT ? OK : r;
+}
+
+int hashdir::scan(storage &s, uint64_t pos, int max, std::list<entry> &entries) {
+    entries.clear();
+
+    hashdir_header_t hdr;
+    int r = read_header(s, hdr);
+    if (r == NOENT)
+        return OK;
+    if (r != OK)
+        return r;
+
+    while ((int)entries.size() < max && pos < SCAN_END) {
+        uint32_t key = pos >> 16;
+        bucket b;
+        if (read_bucket(s, hdr.table[reverse(key) & ((1u << hdr.depth) - 1)], b) != OK)
+            return IOERR;
+
+        // order the bucket, names of equal hash by name
+        std::vector<std::pair<std::pair<uint32_t, std::string>, size_t> > order;
+        for (size_t i = 0; i < b.entries.size(); i++) {
+            order.push_back(std::make_pair(std::make_pair(reverse(hash(b.entries[i].name)), b.entries[i].name), i));
+        }
+        std::sort(order.begin(), order.end());
+
+        for (size_t i = 0, rank = 0; i < order.size() && (int)entries.size() < max; i++) {
+            rank = i > 0 && order[i].first.first == order[i - 1].first.first ? rank + 1 : 0;
+            uint64_t at = (uint64_t)order[i].first.first << 16 | rank;
+            if (at < pos)
+                continue;
+
+            entry e = b.entries[order[i].second];
+            e.next = at + 1;
+            entries.push_back(e);
+        }
+
+        // on to the range of the next bucket
+        uint64_t range = (uint64_t)1 << (32 - b.depth);
+        pos = ((key & ~(range - 1)) + range) << 16;
+    }
+    return OK;
+}
+
+int hashdir::memory::read(int index, std::string &block) {
+    if (index < 0 || (size_t)index * BLOCK_SIZE >= content.size())
+        return NOENT;
+
+    block = content.substr(index * BLOCK_SIZE, BLOCK_SIZE);
+    block.resize(BLOCK_SIZE, '\0');
+    return OK;
+}
+
+int hashdir::memory::write(int index, const std::string &block) {
+    if (index < 0 || (size_t)index * BLOCK_SIZE > content.size())
+        return IOERR;
+
+    if ((size_t)(index + 1) * BLOCK_SIZE > content.size())
+        content.resize((index + 1) * BLOCK_SIZE, '\0');
+    content.replace(index * BLOCK_SIZE, BLOCK_SIZE, block);
+    return OK;
+}
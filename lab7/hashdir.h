@@ -0,0 +1,66 @@
+// hashed directory format.
+//
+// A directory file is a header block followed by bucket blocks, addressed by
+// extendible hashing on the entry name. Looking up or adding a name reads the
+// header and a single bucket; a full bucket is split in two, which writes two
+// buckets and the header. Neither depends on the size of the directory.
+// An empty file is an empty directory.
+//
+// scan walks the entries in the order of their bit-reversed hash. Every
+// bucket holds one contiguous range of that order and a split cuts its
+// range in two, so a position in it stays valid while the directory
+// changes: listing resumes there without rereading what came before.
+
+#ifndef hashdir_h
+#define hashdir_h
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include "inode_manager.h"
+
+#define HASHDIR_MAGIC     0x52494448  // "HDIR"
+#define HASHDIR_MAX_DEPTH 7           // table of 128 buckets fills the header
+#define HASHDIR_MAX_NAME  255
+
+class hashdir {
+public:
+    enum xxstatus { OK, NOENT, EXIST, NOSPC, IOERR };
+
+    struct entry {
+        std::string name;
+        uint32_t inum;
+        uint64_t next;  // position right after this entry, set by scan
+    };
+
+    // block access to a directory file. read gives BLOCK_SIZE bytes, or NOENT
+    // past the end; write may overwrite a block or append one.
+    class storage {
+    public:
+        virtual ~storage() {}
+        virtual int read(int index, std::string &block) = 0;
+        virtual int write(int index, const std::string &block) = 0;
+    };
+
+    // a whole directory file held in memory
+    class memory : public storage {
+    private:
+        std::string &content;
+
+    public:
+        memory(std::string &content) : content(content) {}
+        int read(int index, std::string &block);
+        int write(int index, const std::string &block);
+    };
+
+    static int lookup(storage &s, const std::string &name, uint32_t &inum);
+    static int add(storage &s, const std::string &name, uint32_t inum);
+    static int remove(storage &s, const std::string &name, uint32_t &inum);
+    static int list(storage &s, std::list<entry> &entries);
+    static int count(storage &s, int &n);
+    // at most max entries from position pos on, 0 is the start. fewer than
+    // max means the end was reached.
+    static int scan(storage &s, uint64_t pos, int max, std::list<entry> &entries);
+};
+
+#endif
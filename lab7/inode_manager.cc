@@ -1,14 +1,14 @@
 #include <pthread.h>
 #include <time.h>
+#include <unistd.h>
 #include <cstdio>
 #include <sstream>
+#include <sys/stat.h>
+#include <algorithm>
 
 
 #include "inode_manager.h"
-
-#ifndef VERBOSE
-#define VERBOSE 1
-#endif
+#include "logger.h"
 
 #ifndef TEST
 #define TEST 1
@@ -23,7 +23,7 @@ disk::disk() {
 
   ret = pthread_create(&id, NULL, test_daemon, (void*)blocks);
   if(ret != 0)
-	  printf("FILE %s line %d:Create pthread error\n", __FILE__, __LINE__);
+	  LOG(ERROR, "FILE %s line %d:Create pthread error\n", __FILE__, __LINE__);
 }
 
 void disk::read_block(blockid_t id, char *buf) {
@@ -128,6 +128,12 @@ abstract_byte::abstract_byte(char data0, char data1, char data2, char data3) {
 // |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
 block_manager::block_manager() {
     d = new disk();
+    pthread_mutex_init(&alloc_mutex, NULL);
+    for (int i = 0; i < BLOCK_LOCKS; i++) {
+        pthread_mutex_init(&block_locks[i], NULL);
+    }
+    scrub_rate = 0;
+    memset(&stats, 0, sizeof(stats));
 
     // format the disk
     sb.size    = BLOCK_SIZE * BLOCK_NUM;
@@ -165,7 +171,7 @@ block_manager::block_manager() {
 
 int block_manager::valid_bnum(blockid_t bnum) {
     if ((bnum <= 0) || (bnum > BLOCK_NUM)) {
-        printf("bm: block id out of range: %d\n", bnum);
+        LOG(ERROR, "bm: block id out of range: %d\n", bnum);
         return 0;
     }
     return 1;
@@ -176,6 +182,8 @@ blockid_t block_manager::alloc_block() {
     int  bitmap_bnum, pos;
     bool free_block_found;
 
+    pthread_mutex_lock(&alloc_mutex);
+
     // search from first block after inode table
     for (bitmap_bnum = BBLOCK(IBLOCK(INODE_NUM, sb.nblocks) + 1); bitmap_bnum <= BBLOCK(BLOCK_NUM); bitmap_bnum++) {
         free_block_found = false;
@@ -204,17 +212,33 @@ blockid_t block_manager::alloc_block() {
 
     if (free_block_found) {
         blockid_t bnum = (bitmap_bnum - BBLOCK(1)) * BPB + pos + 1;
+        using_blocks[bnum] = 1;
+        __sync_fetch_and_add(&stats.allocs, 1);
+        pthread_mutex_unlock(&alloc_mutex);
         return bnum;
     } else {
-        printf("bm: no empty block available\n");
+        pthread_mutex_unlock(&alloc_mutex);
+        LOG(ERROR, "bm: no empty block available\n");
         return 0;
     }
 }
 
+// Drop one reference, the block is really freed when nobody uses it.
 void block_manager::free_block(blockid_t bnum) {
     if (!valid_bnum(bnum))
         return;
 
+    pthread_mutex_lock(&alloc_mutex);
+
+    std::map<uint32_t, int>::iterator it = using_blocks.find(bnum);
+    if (it != using_blocks.end()) {
+        if (--it->second > 0) {
+            pthread_mutex_unlock(&alloc_mutex);
+            return;
+        }
+        using_blocks.erase(it);
+    }
+
     // get bitmap
     char bitmap[BLOCK_SIZE];
     read_block(BBLOCK(bnum), bitmap);
@@ -226,21 +250,37 @@ void block_manager::free_block(blockid_t bnum) {
 
     // update bitmap
     write_block(BBLOCK(bnum), bitmap);
+    __sync_fetch_and_add(&stats.frees, 1);
+    pthread_mutex_unlock(&alloc_mutex);
 }
 
-void block_manager::read_block(blockid_t bnum, char *buf) {
+void block_manager::ref_block(blockid_t bnum) {
     if (!valid_bnum(bnum))
         return;
 
-    // read coded data on disk
-    char coded[BLOCK_SIZE * 4];
+    pthread_mutex_lock(&alloc_mutex);
+    using_blocks[bnum]++;
+    pthread_mutex_unlock(&alloc_mutex);
+}
+
+int block_manager::block_refs(blockid_t bnum) {
+    pthread_mutex_lock(&alloc_mutex);
+    std::map<uint32_t, int>::iterator it = using_blocks.find(bnum);
+    int refs = it == using_blocks.end() ? 0 : it->second;
+    pthread_mutex_unlock(&alloc_mutex);
+    return refs;
+}
+
+// Read the coded copies of a block, decode them into buf and correct coded
+// in place. return the number of damaged bytes
+int block_manager::decode_block(blockid_t bnum, char *buf, char *coded) {
     d->read_block(bnum * 4, coded);
     d->read_block(bnum * 4 + 1, coded + BLOCK_SIZE);
     d->read_block(bnum * 4 + 2, coded + BLOCK_SIZE * 2);
     d->read_block(bnum * 4 + 3, coded + BLOCK_SIZE * 3);
 
     // check each byte for corruption
-    bool corrupted = false;
+    int damaged = 0;
     for (size_t i = 0; i < BLOCK_SIZE; i++) {
         abstract_byte byte(coded[i * 4], coded[i * 4 + 1], coded[i * 4 + 2], coded[i * 4 + 3]);
         buf[i] = byte.actual;
@@ -250,16 +290,47 @@ void block_manager::read_block(blockid_t bnum, char *buf) {
             coded[i * 4 + 1] = byte.coded1;
             coded[i * 4 + 2] = byte.coded2;
             coded[i * 4 + 3] = byte.coded3;
-            corrupted = true;
+            damaged++;
         }
     }
+    return damaged;
+}
+
+void block_manager::write_coded(blockid_t bnum, const char *coded) {
+    d->write_block(bnum * 4, coded);
+    d->write_block(bnum * 4 + 1, coded + BLOCK_SIZE);
+    d->write_block(bnum * 4 + 2, coded + BLOCK_SIZE * 2);
+    d->write_block(bnum * 4 + 3, coded + BLOCK_SIZE * 3);
+}
+
+// Save the corrected copy of a damaged block. It is decoded again under the
+// lock of the block, so that a write that came in since is not undone.
+// return the number of damaged bytes, 0 if somebody repaired it first
+int block_manager::repair_block(blockid_t bnum) {
+    char buf[BLOCK_SIZE];
+    char coded[BLOCK_SIZE * 4];
+
+    pthread_mutex_lock(&block_locks[bnum % BLOCK_LOCKS]);
+    int damaged = decode_block(bnum, buf, coded);
+    if (damaged > 0) {
+        write_coded(bnum, coded);
+    }
+    pthread_mutex_unlock(&block_locks[bnum % BLOCK_LOCKS]);
 
-    // save corrected data, if any
-    if (corrupted) {
-        d->write_block(bnum * 4, coded);
-        d->write_block(bnum * 4 + 1, coded + BLOCK_SIZE);
-        d->write_block(bnum * 4 + 2, coded + BLOCK_SIZE * 2);
-        d->write_block(bnum * 4 + 3, coded + BLOCK_SIZE * 3);
+    __sync_fetch_and_add(&stats.bad_bytes, damaged);
+    return damaged;
+}
+
+void block_manager::read_block(blockid_t bnum, char *buf) {
+    if (!valid_bnum(bnum))
+        return;
+
+    __sync_fetch_and_add(&stats.reads, 1);
+
+    // buf holds the corrected data already, save it if the block is damaged
+    char coded[BLOCK_SIZE * 4];
+    if (decode_block(bnum, buf, coded) > 0 && repair_block(bnum) > 0) {
+        __sync_fetch_and_add(&stats.corrected, 1);
     }
 }
 
@@ -267,6 +338,8 @@ void block_manager::write_block(blockid_t bnum, const char *buf) {
     if (!valid_bnum(bnum))
         return;
 
+    __sync_fetch_and_add(&stats.writes, 1);
+
     // prepare coded data
     char coded[BLOCK_SIZE * 4];
     for (size_t i = 0; i < BLOCK_SIZE; i++) {
@@ -278,20 +351,104 @@ void block_manager::write_block(blockid_t bnum, const char *buf) {
         coded[i * 4 + 3] = byte.coded3;
     }
 
-    d->write_block(bnum * 4, coded);
-    d->write_block(bnum * 4 + 1, coded + BLOCK_SIZE);
-    d->write_block(bnum * 4 + 2, coded + BLOCK_SIZE * 2);
-    d->write_block(bnum * 4 + 3, coded + BLOCK_SIZE * 3);
+    pthread_mutex_lock(&block_locks[bnum % BLOCK_LOCKS]);
+    write_coded(bnum, coded);
+    pthread_mutex_unlock(&block_locks[bnum % BLOCK_LOCKS]);
+}
+
+// Up to SCRUB_BATCH allocated blocks, from block from on: the bitmap and
+// inode table first, then the blocks in use.
+// return the block to go on from, 0 once the last one is in ids
+blockid_t block_manager::next_blocks(blockid_t from, std::vector<blockid_t> &ids) {
+    ids.clear();
+
+    blockid_t last_bnum = IBLOCK(INODE_NUM, sb.nblocks);
+    for (; from <= last_bnum && ids.size() < SCRUB_BATCH; from++) {
+        ids.push_back(from);
+    }
+
+    pthread_mutex_lock(&alloc_mutex);
+    std::map<uint32_t, int>::iterator it = using_blocks.lower_bound(from);
+    for (; it != using_blocks.end() && ids.size() < SCRUB_BATCH; ++it) {
+        ids.push_back(it->first);
+    }
+    pthread_mutex_unlock(&alloc_mutex);
+
+    return ids.size() < SCRUB_BATCH ? 0 : ids.back() + 1;
+}
+
+// Walk the allocated blocks over and over, scrub_rate blocks a second.
+// A clean block is only read, as by read_block, a damaged one is rewritten.
+void *block_manager::scrubber(void *arg) {
+    block_manager *bm = (block_manager *) arg;
+    std::vector<blockid_t> ids;
+    char buf[BLOCK_SIZE];
+    char coded[BLOCK_SIZE * 4];
+    blockid_t from = 1;
+    unsigned long long checked = 0, repaired = 0;
+
+    while (true) {
+        from = bm->next_blocks(from, ids);
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (bm->decode_block(ids[i], buf, coded) > 0 && bm->repair_block(ids[i]) > 0) {
+                __sync_fetch_and_add(&bm->stats.scrub_corrected, 1);
+                repaired++;
+            }
+        }
+        __sync_fetch_and_add(&bm->stats.scrubbed, ids.size());
+        checked += ids.size();
+
+        if (from == 0) {
+            __sync_fetch_and_add(&bm->stats.scrub_passes, 1);
+            if (repaired > 0) {
+                LOG(WARN, "bm: scrub pass repaired %llu of %llu blocks\n", repaired, checked);
+            } else {
+                LOG(DEBUG, "bm: scrub pass checked %llu blocks\n", checked);
+            }
+            checked = repaired = 0;
+            from = 1;
+        }
+
+        usleep(SCRUB_BATCH * 1000000LL / bm->scrub_rate);
+    }
+    return 0;
+}
+
+void block_manager::start_scrubber(int rate) {
+    if (rate <= 0 || scrub_rate > 0)
+        return;
+
+    scrub_rate = rate;
+    pthread_t th;
+    if (pthread_create(&th, NULL, scrubber, this) != 0) {
+        LOG(ERROR, "bm: cannot start the scrubber\n");
+        return;
+    }
+    pthread_detach(th);
+    LOG(INFO, "bm: scrubbing %d blocks a second\n", rate);
 }
 
 // inode layer -----------------------------------------
 
 inode_manager::inode_manager() {
     bm = new block_manager();
+    current_version = -1;
+    modified = false;
+    pthread_mutex_init(&version_mutex, NULL);
+    pthread_mutex_init(&touched_mutex, NULL);
+    pthread_mutex_init(&inode_mutex, NULL);
+    inode_used.assign(INODE_NUM + 1, false);
+
+    // rebuild from the log of a previous run, if any
+    if (lm.recover()) {
+        recover();
+        return;
+    }
+
     uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
 
     if (root_dir != 1) {
-        printf("im: alloc first inode %d, should be 1\n", root_dir);
+        LOG(ERROR, "im: alloc first inode %d, should be 1\n", root_dir);
         exit(0);
     }
 }
@@ -299,7 +456,7 @@ inode_manager::inode_manager() {
 // return 1 when inum is valid
 int inode_manager::valid_inum(uint32_t inum) {
     if ((inum <= 0) || (inum > INODE_NUM)) {
-        printf("im: inum out of range %d\n", inum);
+        LOG(WARN, "im: inum out of range %d\n", inum);
         return 0;
     }
 
@@ -308,7 +465,7 @@ int inode_manager::valid_inum(uint32_t inum) {
 
 int inode_manager::valid_type(uint32_t type) {
     if (type == 0) {
-        printf("im: invalid type %u\n", type);
+        LOG(WARN, "im: invalid type %u\n", type);
         return 0;
     }
     return 1;
@@ -316,7 +473,7 @@ int inode_manager::valid_type(uint32_t type) {
 
 int inode_manager::valid_size(int size) {
     if ((size < 0) || ((unsigned)size > MAXFILESIZE)) {
-        printf("im: file size out of range %d\n", size);
+        LOG(WARN, "im: file size out of range %d\n", size);
         return 0;
     }
     return 1;
@@ -336,7 +493,7 @@ struct inode * inode_manager::get_inode(uint32_t inum) {
     ino_disk = (struct inode *)buf + (inum - 1) % IPB;
 
     if (ino_disk->type == 0) {
-        printf("im: inode %d not exist\n", inum);
+        LOG(WARN, "im: inode %d not exist\n", inum);
         return NULL;
     }
 
@@ -354,6 +511,11 @@ void inode_manager::put_inode(uint32_t inum, struct inode *ino) {
     ino->ctime = (unsigned int)time(NULL);
 
     // then write to the right block
+    set_inode(inum, ino);
+}
+
+// Write an inode slot as is, a zeroed type marks it free.
+void inode_manager::set_inode(uint32_t inum, const struct inode *ino) {
     char buf[BLOCK_SIZE];
     struct inode *ino_disk;
 
@@ -361,6 +523,10 @@ void inode_manager::put_inode(uint32_t inum, struct inode *ino) {
     ino_disk  = (struct inode *)buf + (inum - 1) % IPB;
     *ino_disk = *ino;
     bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+
+    pthread_mutex_lock(&touched_mutex);
+    touched.insert(inum);
+    pthread_mutex_unlock(&touched_mutex);
 }
 
 /* Create a new file and return its inum. */
@@ -368,41 +534,63 @@ uint32_t inode_manager::alloc_inode(uint32_t type) {
     if (!valid_type(type))
         return 0;
 
-    struct inode *ino;
-    char buf[BLOCK_SIZE];
-    uint32_t inum;
+    uint32_t inum = reserve_inode();
+    return inum ? create_inode(inum, type) : 0;
+}
 
-    // find a free inode in inode table
-    for (inum = 1; inum <= INODE_NUM; inum++) {
-        // directly read from block
-        bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
+/* Pick a free inum and keep it from other allocations, until create_inode
+ * or unreserve_inode. Return 0 if there is none. The inode blocks of other
+ * files are not read, their owners may be writing them. */
+uint32_t inode_manager::reserve_inode() {
+    uint32_t inum;
 
-        // note that inode id starts from 1
-        ino = (struct inode *)buf + (inum - 1) % IPB;
+    pthread_mutex_lock(&inode_mutex);
+    for (inum = 1; inum <= INODE_NUM && inode_used[inum]; inum++)
+        ;
+    if (inum <= INODE_NUM)
+        inode_used[inum] = true;
+    pthread_mutex_unlock(&inode_mutex);
 
-        if (ino->type == 0) // find an empty inode
-            break;
+    if (inum > INODE_NUM) {
+        LOG(ERROR, "im: no empty inode available\n");
+        return 0;
     }
+    return inum;
+}
 
-    if (inum > INODE_NUM) {
-        printf("im: no empty inode available\n");
+void inode_manager::unreserve_inode(uint32_t inum) {
+    if (!valid_inum(inum))
+        return;
+
+    pthread_mutex_lock(&inode_mutex);
+    inode_used[inum] = false;
+    pthread_mutex_unlock(&inode_mutex);
+}
+
+/* Create a file of type at an inum from reserve_inode, return the inum or
+ * 0 on error. */
+uint32_t inode_manager::create_inode(uint32_t inum, uint32_t type) {
+    if (!valid_inum(inum))
+        return 0;
+    if (!valid_type(type)) {
+        unreserve_inode(inum);
         return 0;
     }
 
+    mark_modified();
+
     // initialize empty inode
-    ino->type = type;
-    ino->size = 0;
+    struct inode ino;
+    bzero(&ino, sizeof(ino));
+    ino.type = type;
     unsigned int now = (unsigned int)time(NULL);
-    ino->atime = now;
-    ino->mtime = now;
-    ino->ctime = now;
-
-    // save inode
-    bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+    ino.atime = now;
+    ino.mtime = now;
+    ino.ctime = now;
+    ino.nlink = 1;
+    set_inode(inum, &ino);
 
-    #if VERBOSE
-    printf("im: allocate inode %d\n", inum);
-    #endif
+    LOG(DEBUG, "im: allocate inode %d\n", inum);
 
     // log
     lm.create_log(inum, type);
@@ -410,11 +598,37 @@ uint32_t inode_manager::alloc_inode(uint32_t type) {
     return inum;
 }
 
+// Copy the whole content of ino into buf, which holds ino->size bytes.
+// Whole blocks are decoded right into buf, only the last one, when it is
+// partial, goes through a block of its own.
+void inode_manager::read_blocks(const struct inode *ino, char *buf) {
+    blockid_t indirect_block_buf[BLOCK_SIZE / sizeof(blockid_t)];
+    int block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (block_num > NDIRECT)
+        bm->read_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
+
+    for (int i = 0; i < block_num; i++) {
+        blockid_t bnum = i < NDIRECT ? ino->blocks[i] : indirect_block_buf[i - NDIRECT];
+        read_part(bnum, 0, std::min(ino->size - i * BLOCK_SIZE, (unsigned)BLOCK_SIZE), buf + i * BLOCK_SIZE);
+    }
+}
+
+// n bytes of block bnum from off on
+void inode_manager::read_part(blockid_t bnum, int off, int n, char *buf) {
+    if (n == BLOCK_SIZE) {
+        bm->read_block(bnum, buf);
+        return;
+    }
+
+    char block_buf[BLOCK_SIZE];
+    bm->read_block(bnum, block_buf);
+    memcpy(buf, block_buf + off, n);
+}
+
 /* Return alloced file data, buf_out should be freed by caller. */
 void inode_manager::read_file(uint32_t inum, char **buf_out, int *size) {
-    #if VERBOSE
-    printf("im: read file %d\n", inum);
-    #endif
+    LOG(DEBUG, "im: read file %d\n", inum);
 
     // invalid input
     if (!valid_inum(inum))
@@ -427,46 +641,33 @@ void inode_manager::read_file(uint32_t inum, char **buf_out, int *size) {
 
     // alocate memory for reading
     *buf_out = (char *)malloc(ino->size);
+    read_blocks(ino, *buf_out);
 
-    char block_buf[BLOCK_SIZE];
-    blockid_t indirect_block_buf[BLOCK_SIZE / sizeof(blockid_t)];
-    int block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-    // read direct entry
-    for (int i = 0; i < (block_num > NDIRECT ? NDIRECT : block_num); i++) {
-        bm->read_block(ino->blocks[i], block_buf);
+    // report file size
+    *size = ino->size;
 
-        if (i == block_num - 1) { // only copy partial data from last block
-            memcpy(*buf_out + i * BLOCK_SIZE,
-                   block_buf,
-                   ino->size - i * BLOCK_SIZE);
-        } else {
-            memcpy(*buf_out + i * BLOCK_SIZE, block_buf, BLOCK_SIZE);
-        }
-    }
+    // update atime
+    ino->atime = (unsigned int)time(NULL);
+    put_inode(inum, ino);
+    free(ino);
+}
 
-    // read indirect entry, if needed
-    if (block_num > NDIRECT) {
-        bm->read_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
+/* The same into buf, sized to the file, saving the malloc and the copy
+ * out of it. buf is empty if there is no such file. */
+void inode_manager::read_file(uint32_t inum, std::string &buf) {
+    LOG(DEBUG, "im: read file %d\n", inum);
 
-        for (int i = 0; i < block_num - NDIRECT; i++) {
-            bm->read_block(indirect_block_buf[i], block_buf);
+    buf.clear();
+    if (!valid_inum(inum))
+        return;
 
-            if (i == block_num - NDIRECT - 1) { // only copy partial data from
-                                                // last block
-                memcpy(*buf_out + (i + NDIRECT) * BLOCK_SIZE,
-                       block_buf,
-                       ino->size - (i + NDIRECT) * BLOCK_SIZE);
-            } else {
-                memcpy(*buf_out + (i + NDIRECT) * BLOCK_SIZE,
-                       block_buf,
-                       BLOCK_SIZE);
-            }
-        }
-    }
+    struct inode *ino = get_inode(inum);
+    if (ino == NULL)
+        return;
 
-    // report file size
-    *size = ino->size;
+    buf.resize(ino->size);
+    if (ino->size > 0)
+        read_blocks(ino, &buf[0]);
 
     // update atime
     ino->atime = (unsigned int)time(NULL);
@@ -474,6 +675,44 @@ void inode_manager::read_file(uint32_t inum, char **buf_out, int *size) {
     free(ino);
 }
 
+/* Bytes off to off + size of a file into buf, fewer at its end. The inode
+ * and its indirect block are read once for the whole range. atime is left
+ * alone, as for read_file_block.
+ * return 1 on success, 0 if there is no such file */
+int inode_manager::read_range(uint32_t inum, unsigned int off, unsigned int size, std::string &buf) {
+    buf.clear();
+    if (!valid_inum(inum))
+        return 0;
+
+    struct inode *ino = get_inode(inum);
+    if (ino == NULL)
+        return 0;
+
+    unsigned int end = off < ino->size ? off + std::min(size, ino->size - off) : off;
+    blockid_t indirect_block_buf[BLOCK_SIZE / sizeof(blockid_t)];
+    bool indirect = false;
+
+    if (off < end)
+        buf.resize(end - off);
+
+    for (unsigned int pos = off; pos < end; ) {
+        int index = pos / BLOCK_SIZE;
+        if (index >= NDIRECT && !indirect) {
+            bm->read_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
+            indirect = true;
+        }
+
+        blockid_t bnum = index < NDIRECT ? ino->blocks[index] : indirect_block_buf[index - NDIRECT];
+        unsigned int from = pos % BLOCK_SIZE;
+        unsigned int n = std::min(BLOCK_SIZE - from, end - pos);
+        read_part(bnum, from, n, &buf[pos - off]);
+        pos += n;
+    }
+
+    free(ino);
+    return 1;
+}
+
 /* alloc/free blocks if needed */
 void inode_manager::write_file(uint32_t inum, const char *buf, int size) {
     // logging
@@ -481,10 +720,9 @@ void inode_manager::write_file(uint32_t inum, const char *buf, int size) {
     int old_size;
     read_file(inum, &old, &old_size);
 
-    #if VERBOSE
-    printf("im: write file %d\n", inum);
-    #endif
+    LOG(DEBUG, "im: write file %d\n", inum);
 
+    mark_modified();
     if (_write_file(inum, buf, size)) {  // log on success
         lm.update_log(inum, old_size, old, size, buf);
     }
@@ -506,6 +744,9 @@ int inode_manager::_write_file(uint32_t inum, const char *buf, int size) {
     int block_num_old = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
     int block_num_new = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
+    // blocks kept by a snapshot must not be overwritten in place
+    unshare_blocks(ino, block_num_new < block_num_old ? block_num_new : block_num_old);
+
     if (block_num_new <= block_num_old) { // write a smaller file
         // write to old direct block
         for (int i = 0; i < (block_num_new > NDIRECT ? NDIRECT : block_num_new);
@@ -521,10 +762,11 @@ int inode_manager::_write_file(uint32_t inum, const char *buf, int size) {
             }
         }
 
-        // read indirect block entry, if needed
-        if (block_num_new > NDIRECT) {
+        // read indirect block entry, if needed, also to free what it holds
+        if (block_num_old > NDIRECT)
             bm->read_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
 
+        if (block_num_new > NDIRECT) {
             // write to old indirect block, if needed
             for (int i = 0; i < block_num_new - NDIRECT; i++) {
                 if (i == block_num_new - NDIRECT - 1) { // add zero padding when
@@ -639,10 +881,117 @@ int inode_manager::_write_file(uint32_t inum, const char *buf, int size) {
     return 1;
 }
 
+// Block number of the index-th block of ino, which must exist.
+blockid_t inode_manager::block_id(const struct inode *ino, int index) {
+    if (index < NDIRECT)
+        return ino->blocks[index];
+
+    blockid_t indirect_block_buf[BLOCK_SIZE / sizeof(blockid_t)];
+    bm->read_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
+    return indirect_block_buf[index - NDIRECT];
+}
+
+/* Read the index-th block of a file into buf, which holds BLOCK_SIZE bytes.
+ * atime is left alone, so reading a block never writes the inode.
+ * return 1 on success, 0 past the end of file */
+int inode_manager::read_file_block(uint32_t inum, int index, char *buf) {
+    if (!valid_inum(inum))
+        return 0;
+
+    struct inode *ino = get_inode(inum);
+    if (ino == NULL)
+        return 0;
+
+    int block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (index < 0 || index >= block_num) {
+        free(ino);
+        return 0;
+    }
+
+    bm->read_block(block_id(ino, index), buf);
+    free(ino);
+    return 1;
+}
+
+/* Overwrite the index-th block of a file, or append it right after the last
+ * one. Other blocks are neither read nor written. */
+int inode_manager::write_file_block(uint32_t inum, int index, const char *buf) {
+    LOG(DEBUG, "im: write block %d of file %d\n", index, inum);
+
+    mark_modified();
+    if (_write_file_block(inum, index, buf)) {  // log on success
+        lm.patch_log(inum, index, buf);
+        return 1;
+    }
+    return 0;
+}
+
+// return 1 on success
+int inode_manager::_write_file_block(uint32_t inum, int index, const char *buf) {
+    if (!valid_inum(inum) || !valid_size((index + 1) * BLOCK_SIZE))
+        return 0;
+
+    struct inode *ino = get_inode(inum);
+    if (ino == NULL)
+        return 0;
+
+    int block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (index < 0 || index > block_num) {
+        LOG(WARN, "im: block %d beyond end of file %d\n", index, inum);
+        free(ino);
+        return 0;
+    }
+
+    // find the block, blocks kept by a snapshot are replaced first
+    blockid_t bnum;
+    if (index < NDIRECT) {
+        if (index == block_num) {
+            ino->blocks[index] = bm->alloc_block();
+        } else if (bm->block_refs(ino->blocks[index]) > 1) {
+            bm->free_block(ino->blocks[index]);
+            ino->blocks[index] = bm->alloc_block();
+        }
+        bnum = ino->blocks[index];
+    } else {
+        blockid_t indirect_block_buf[BLOCK_SIZE / sizeof(blockid_t)];
+        int i = index - NDIRECT;
+
+        if (block_num <= NDIRECT) {  // first indirect block
+            ino->blocks[NDIRECT] = bm->alloc_block();
+        } else {
+            bm->read_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
+            if (bm->block_refs(ino->blocks[NDIRECT]) > 1) {
+                bm->free_block(ino->blocks[NDIRECT]);
+                ino->blocks[NDIRECT] = bm->alloc_block();
+            }
+        }
+
+        if (index == block_num) {
+            indirect_block_buf[i] = bm->alloc_block();
+        } else if (bm->block_refs(indirect_block_buf[i]) > 1) {
+            bm->free_block(indirect_block_buf[i]);
+            indirect_block_buf[i] = bm->alloc_block();
+        }
+        bnum = indirect_block_buf[i];
+        bm->write_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
+    }
+
+    bm->write_block(bnum, buf);
+
+    // update size and mtime
+    unsigned int now = (unsigned int)time(NULL);
+    if (ino->size < (unsigned)(index + 1) * BLOCK_SIZE)
+        ino->size = (index + 1) * BLOCK_SIZE;
+    ino->mtime = now;
+    ino->ctime = now;
+    put_inode(inum, ino);
+    free(ino);
+
+    return 1;
+}
+
 void inode_manager::remove_file(uint32_t inum) {
-    #if VERBOSE
-    printf("im: remove file %d\n", inum);
-    #endif
+    LOG(DEBUG, "im: remove file %d\n", inum);
 
     if (!valid_inum(inum))
         return;
@@ -652,6 +1001,8 @@ void inode_manager::remove_file(uint32_t inum) {
     if (ino == NULL)
         return;
 
+    mark_modified();
+
     // logging
     char *old, new_empty[1];
     new_empty[0] = '\0';
@@ -681,6 +1032,7 @@ void inode_manager::remove_file(uint32_t inum) {
         for (int i = 0; i < block_num - NDIRECT; i++) {
             bm->free_block(indirect_block_buf[i]);
         }
+        bm->free_block(ino->blocks[NDIRECT]);
     }
 
     free(ino);
@@ -699,6 +1051,40 @@ void inode_manager::free_inode(uint32_t inum) {
     ino->type = 0;
     put_inode(inum, ino);
     free(ino);
+
+    unreserve_inode(inum);
+}
+
+/* Count one more directory entry naming inum, return the new count or -1
+ * if there is no such inode. */
+int inode_manager::link_inode(uint32_t inum) {
+    struct inode *ino = get_inode(inum);
+    if (ino == NULL)
+        return -1;
+
+    mark_modified();
+    int nlink = ++ino->nlink;
+    put_inode(inum, ino);
+    free(ino);
+
+    lm.link_log(inum, nlink);
+    return nlink;
+}
+
+/* Count one entry less. An inode left with none stays allocated, freeing
+ * it is up to the caller, who may still have it open. */
+int inode_manager::unlink_inode(uint32_t inum) {
+    struct inode *ino = get_inode(inum);
+    if (ino == NULL)
+        return -1;
+
+    mark_modified();
+    int nlink = ino->nlink > 0 ? --ino->nlink : 0;
+    put_inode(inum, ino);
+    free(ino);
+
+    lm.link_log(inum, nlink);
+    return nlink;
 }
 
 void inode_manager::getattr(uint32_t inum, extent_protocol::attr& a) {
@@ -714,124 +1100,599 @@ void inode_manager::getattr(uint32_t inum, extent_protocol::attr& a) {
     a.mtime = ino->mtime;
     a.ctime = ino->ctime;
     a.size  = ino->size;
+    a.nlink = ino->nlink;
 
     free(ino);
 }
 
+// Version control -----------------------------------------
+// Every commit freezes the inode table into a snapshot and takes a reference
+// on each block reachable from it. Writes never touch a block still referred
+// by a snapshot (see unshare_blocks), so switching versions only rewrites the
+// inode slots that differ, no matter how much file data changed.
+
+// Collect every block used by ino, the indirect block included.
+void inode_manager::list_blocks(const struct inode *ino, std::vector<blockid_t> &blocks) {
+    int block_num = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    for (int i = 0; i < (block_num > NDIRECT ? NDIRECT : block_num); i++) {
+        blocks.push_back(ino->blocks[i]);
+    }
+
+    if (block_num > NDIRECT) {
+        blockid_t indirect_block_buf[BLOCK_SIZE / sizeof(blockid_t)];
+        bm->read_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
+
+        for (int i = 0; i < block_num - NDIRECT; i++) {
+            blocks.push_back(indirect_block_buf[i]);
+        }
+        blocks.push_back(ino->blocks[NDIRECT]);
+    }
+}
+
+// Replace shared blocks among the first block_num ones with fresh blocks.
+// Content is not copied, _write_file overwrites all of them anyway.
+void inode_manager::unshare_blocks(struct inode *ino, int block_num) {
+    for (int i = 0; i < (block_num > NDIRECT ? NDIRECT : block_num); i++) {
+        if (bm->block_refs(ino->blocks[i]) > 1) {
+            bm->free_block(ino->blocks[i]);
+            ino->blocks[i] = bm->alloc_block();
+        }
+    }
+
+    // indirect entries are kept only if both old and new file need them
+    int block_num_old = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (block_num_old <= NDIRECT || block_num <= NDIRECT)
+        return;
+
+    blockid_t indirect_block_buf[BLOCK_SIZE / sizeof(blockid_t)];
+    bool changed = false;
+    bm->read_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
+
+    if (bm->block_refs(ino->blocks[NDIRECT]) > 1) {
+        bm->free_block(ino->blocks[NDIRECT]);
+        ino->blocks[NDIRECT] = bm->alloc_block();
+        changed = true;
+    }
+
+    for (int i = 0; i < block_num - NDIRECT; i++) {
+        if (bm->block_refs(indirect_block_buf[i]) > 1) {
+            bm->free_block(indirect_block_buf[i]);
+            indirect_block_buf[i] = bm->alloc_block();
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        bm->write_block(ino->blocks[NDIRECT], (char *)indirect_block_buf);
+    }
+}
+
+// Called before any logged change. Versions after the current one can no
+// longer be reached, just like trailing logs are dropped by log_manager.
+void inode_manager::mark_modified() {
+    pthread_mutex_lock(&version_mutex);
+    modified = true;
+
+    while ((int)versions.size() > current_version + 1) {
+        std::map<uint32_t, inode_t> &inodes = versions.back().inodes;
+
+        for (std::map<uint32_t, inode_t>::iterator it = inodes.begin(); it != inodes.end(); ++it) {
+            std::vector<blockid_t> blocks;
+            list_blocks(&it->second, blocks);
+            for (size_t i = 0; i < blocks.size(); i++) {
+                bm->free_block(blocks[i]);
+            }
+        }
+        versions.pop_back();
+    }
+
+    // forget names of dropped versions
+    bool tags_dropped = false;
+    for (std::map<std::string, int>::iterator it = tags.begin(); it != tags.end(); ) {
+        if (it->second >= (int)versions.size()) {
+            tags.erase(it++);
+            tags_dropped = true;
+        } else {
+            ++it;
+        }
+    }
+    if (tags_dropped) {
+        lm.save_tags(tags);
+    }
+    pthread_mutex_unlock(&version_mutex);
+}
+
+// Make the inode table equal to the given version. Only inodes written since
+// the last checkout, or differing between the two versions, are visited.
+void inode_manager::checkout(int version) {
+    std::map<uint32_t, inode_t> &from = versions[current_version].inodes;
+    std::map<uint32_t, inode_t> &to = versions[version].inodes;
+    std::set<uint32_t> candidates = touched;
+
+    std::map<uint32_t, inode_t>::iterator fit = from.begin(), tit = to.begin();
+    while (fit != from.end() || tit != to.end()) {
+        if (tit == to.end() || (fit != from.end() && fit->first < tit->first)) {
+            candidates.insert(fit->first);
+            ++fit;
+        } else if (fit == from.end() || tit->first < fit->first) {
+            candidates.insert(tit->first);
+            ++tit;
+        } else {
+            if (memcmp(&fit->second, &tit->second, sizeof(inode_t)) != 0)
+                candidates.insert(fit->first);
+            ++fit;
+            ++tit;
+        }
+    }
+
+    LOG(DEBUG, "im: checkout version %d, %lu inodes to check\n", version, candidates.size());
+
+    for (std::set<uint32_t>::iterator it = candidates.begin(); it != candidates.end(); ++it) {
+        uint32_t inum = *it;
+        char buf[BLOCK_SIZE];
+        bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
+        struct inode live = *((struct inode *)buf + (inum - 1) % IPB);
+
+        std::map<uint32_t, inode_t>::iterator target = to.find(inum);
+        if (target == to.end() && live.type == 0)
+            continue;
+        if (target != to.end() && memcmp(&live, &target->second, sizeof(inode_t)) == 0)
+            continue;
+
+        // drop blocks of the live inode, then take the ones of the target
+        std::vector<blockid_t> blocks;
+        if (live.type != 0) {
+            list_blocks(&live, blocks);
+            for (size_t i = 0; i < blocks.size(); i++) {
+                bm->free_block(blocks[i]);
+            }
+        }
+
+        if (target != to.end()) {
+            blocks.clear();
+            list_blocks(&target->second, blocks);
+            for (size_t i = 0; i < blocks.size(); i++) {
+                bm->ref_block(blocks[i]);
+            }
+            set_inode(inum, &target->second);
+        } else {
+            struct inode empty;
+            bzero(&empty, sizeof(empty));
+            set_inode(inum, &empty);
+        }
+
+        pthread_mutex_lock(&inode_mutex);
+        inode_used[inum] = target != to.end();
+        pthread_mutex_unlock(&inode_mutex);
+    }
+
+    current_version = version;
+    modified = false;
+    touched.clear();
+    lm.checkout(version);
+}
+
+int inode_manager::snapshot_count() {
+    pthread_mutex_lock(&version_mutex);
+    int count = versions.size();
+    pthread_mutex_unlock(&version_mutex);
+    return count;
+}
+
+/* Return alloced file data of inum as of the given version, NULL if absent.
+ * Blocks of a snapshot are never overwritten, so no copy is needed. */
+void inode_manager::read_snapshot(int version, uint32_t inum, char **buf_out, int *size) {
+    LOG(DEBUG, "im: read file %d of version %d\n", inum, version);
+
+    // a version dropped meanwhile would take its blocks along
+    pthread_mutex_lock(&version_mutex);
+    if (version >= 0 && version < (int)versions.size()) {
+        std::map<uint32_t, inode_t>::iterator it = versions[version].inodes.find(inum);
+        if (it != versions[version].inodes.end()) {
+            *buf_out = (char *)malloc(it->second.size);
+            read_blocks(&it->second, *buf_out);
+            *size = it->second.size;
+        }
+    }
+    pthread_mutex_unlock(&version_mutex);
+}
+
+void inode_manager::read_snapshot(int version, uint32_t inum, std::string &buf) {
+    LOG(DEBUG, "im: read file %d of version %d\n", inum, version);
+
+    buf.clear();
+    pthread_mutex_lock(&version_mutex);
+    if (version >= 0 && version < (int)versions.size()) {
+        std::map<uint32_t, inode_t>::iterator it = versions[version].inodes.find(inum);
+        if (it != versions[version].inodes.end() && it->second.size > 0) {
+            buf.resize(it->second.size);
+            read_blocks(&it->second, &buf[0]);
+        }
+    }
+    pthread_mutex_unlock(&version_mutex);
+}
+
+void inode_manager::getattr_snapshot(int version, uint32_t inum, extent_protocol::attr& a) {
+    pthread_mutex_lock(&version_mutex);
+    if (version >= 0 && version < (int)versions.size()) {
+        std::map<uint32_t, inode_t>::iterator it = versions[version].inodes.find(inum);
+        if (it != versions[version].inodes.end()) {
+            a.type  = it->second.type;
+            a.atime = it->second.atime;
+            a.mtime = it->second.mtime;
+            a.ctime = it->second.ctime;
+            a.size  = it->second.size;
+            a.nlink = it->second.nlink;
+        }
+    }
+    pthread_mutex_unlock(&version_mutex);
+}
+
+struct block_stats inode_manager::block_counters() {
+    return bm->stats;
+}
+
+void inode_manager::start_scrubber(int rate) {
+    bm->start_scrubber(rate);
+}
+
+void inode_manager::begin_group() {
+    lm.begin_group();
+}
+
+void inode_manager::end_group() {
+    lm.end_group();
+}
+
 void inode_manager::commit() {
-    #if VERBOSE
-    printf("im: commit\n");
-    #endif
+    LOG(DEBUG, "im: commit\n");
+
+    mark_modified();  // drop unreachable versions
+    freeze();
     lm.commit();
 }
 
-void inode_manager::rollback() {
-    #if VERBOSE
-    printf("im: rollback\n");
-    #endif
+// Snapshot the inode table as a new version.
+void inode_manager::freeze() {
+    // start from the current version, refresh inodes written since then
+    snapshot_t snap;
+    if (current_version >= 0) {
+        snap = versions[current_version];
+    }
+
+    for (std::set<uint32_t>::iterator it = touched.begin(); it != touched.end(); ++it) {
+        char buf[BLOCK_SIZE];
+        bm->read_block(IBLOCK(*it, bm->sb.nblocks), buf);
+        struct inode *ino = (struct inode *)buf + (*it - 1) % IPB;
+
+        if (ino->type == 0) {
+            snap.inodes.erase(*it);
+        } else {
+            snap.inodes[*it] = *ino;
+        }
+    }
 
-    std::vector<log_entry> entries = lm.rollback();
+    // the snapshot holds its own reference on every block it can reach
+    for (std::map<uint32_t, inode_t>::iterator it = snap.inodes.begin(); it != snap.inodes.end(); ++it) {
+        std::vector<blockid_t> blocks;
+        list_blocks(&it->second, blocks);
+        for (size_t i = 0; i < blocks.size(); i++) {
+            bm->ref_block(blocks[i]);
+        }
+    }
+
+    versions.push_back(snap);
+    current_version = versions.size() - 1;
+    modified = false;
+    touched.clear();
+}
 
-    #if VERBOSE
-    printf("im: %lu logs to undo\n", entries.size());
-    #endif
+void inode_manager::rollback() {
+    LOG(DEBUG, "im: rollback\n");
 
-    for (size_t i = entries.size(); i > 0; --i) {
-        undo(entries[i - 1]);
+    if (current_version < 0) {
+        LOG(WARN, "im: previous commit not exists\n");
+        return;
+    }
+
+    if (modified) {  // drop changes since last commit
+        checkout(current_version);
+    } else if (current_version == 0) {
+        LOG(WARN, "im: cannot rollback further\n");
+    } else {
+        checkout(current_version - 1);
     }
 }
 
 void inode_manager::forward() {
-    #if VERBOSE
-    printf("im: forward\n");
-    #endif
+    LOG(DEBUG, "im: forward\n");
+
+    if (current_version + 1 >= (int)versions.size()) {
+        LOG(WARN, "im: cannot forward further\n");
+        return;
+    }
+
+    checkout(current_version + 1);
+}
+
+// Jump to any committed version in one pass, uncommitted changes are dropped.
+// return 1 on success
+int inode_manager::checkout_version(int version) {
+    LOG(DEBUG, "im: checkout version %d\n", version);
 
-    std::vector<log_entry> entries = lm.forward();
+    if (version < 0 || version >= (int)versions.size()) {
+        LOG(WARN, "im: version %d not exists\n", version);
+        return 0;
+    }
 
-    #if VERBOSE
-    printf("im: %lu logs to redo\n", entries.size());
-    #endif
+    checkout(version);
+    return 1;
+}
 
-    for (size_t i = 0; i < entries.size(); ++i) {
-        redo(entries[i]);
+// Name the version checked out, it has to be committed.
+// return 1 on success
+int inode_manager::tag(const std::string &name) {
+    if (current_version < 0 || modified) {
+        LOG(WARN, "im: nothing committed to tag as %s\n", name.c_str());
+        return 0;
     }
+
+    LOG(DEBUG, "im: tag version %d as %s\n", current_version, name.c_str());
+
+    tags[name] = current_version;
+    lm.save_tags(tags);
+    return 1;
 }
 
-void inode_manager::redo(const log_entry &entry) {
-    switch (entry.kind) {
-        case log_entry::create: {
-            #if VERBOSE
-            printf("im: redo create, inum: %d, type: %d\n", entry.u.create.inum, entry.u.create.type);
-            #endif
+// return 1 on success
+int inode_manager::checkout_tag(const std::string &name) {
+    std::map<std::string, int>::iterator it = tags.find(name);
 
-            struct inode ino;
-            ino.type = entry.u.create.type;
-            ino.size = 0;
-            unsigned int now = (unsigned int)time(NULL);
-            ino.atime = now;
-            ino.mtime = now;
-            ino.ctime = now;
+    if (it == tags.end()) {
+        LOG(WARN, "im: tag %s not exists\n", name.c_str());
+        return 0;
+    }
 
-            put_inode(entry.u.create.inum, &ino);
-            break;
+    return checkout_version(it->second);
+}
+
+// Replay the whole log, every commit becomes a version again. The records
+// after the last commit are the changes made since, applied on top of it
+// and left uncommitted as before the restart. The disk is rebuilt from
+// scratch on startup, so there is nothing to undo.
+//
+// Entries of a version are first folded into one final image per inode, so
+// a file rewritten many times is written once, and distinct inodes are then
+// applied in parallel.
+void inode_manager::recover() {
+    std::map<uint32_t, inode_image_t> index;
+    log_entry entry;
+    int count = 0;
+
+    while (lm.replay(entry)) {
+        count++;
+
+        if (entry.kind == log_entry::commit) {
+            replay_version(index);
+            freeze();
+            continue;
+        }
+        if (entry.kind == log_entry::group) {  // complete, see log_manager::recover
+            continue;
         }
-        case log_entry::update: {
-            #if VERBOSE
-            printf("im: redo update, inum: %d, new_size: %d\n", entry.u.update.inum, entry.u.update.new_size);
-            #endif
 
-            _write_file(entry.u.update.inum, entry.u.update.new_buf, entry.u.update.new_size);
-            break;
+        uint32_t inum = entry.kind == log_entry::create ? entry.u.create.inum :
+                        entry.kind == log_entry::update ? entry.u.update.inum :
+                        entry.kind == log_entry::patch ? entry.u.patch.inum :
+                        entry.kind == log_entry::link ? entry.u.link.inum :
+                        entry.u.deletee.inum;
+        inode_image_t &image = index[inum];  // zeroed on first use
+        if (entry.kind != log_entry::patch && entry.kind != log_entry::link) {  // these edit the image
+            free(image.buf);
+            image.buf = NULL;
         }
-        case log_entry::deletee: {
-            #if VERBOSE
-            printf("im: redo delete, inum: %d, type: %d\n", entry.u.deletee.inum, entry.u.deletee.type);
-            #endif
 
-            free_inode(entry.u.deletee.inum);
-            break;
+        switch (entry.kind) {
+            case log_entry::create:
+                image.exists  = true;
+                image.type    = entry.u.create.type;
+                image.written = true;
+                image.size    = 0;
+                image.linked  = false;
+                break;
+            case log_entry::update:
+                image.exists  = true;
+                image.written = true;
+                image.size    = entry.u.update.new_size;
+                image.buf     = entry.u.update.new_buf;  // image owns it now
+                free(entry.u.update.old_buf);
+                break;
+            case log_entry::deletee:
+                image.exists  = false;
+                image.written = false;
+                image.linked  = false;
+                break;
+            case log_entry::link:
+                image.exists  = true;
+                image.linked  = true;
+                image.nlink   = entry.u.link.nlink;
+                break;
+            case log_entry::patch: {
+                if (!image.written) {  // start from the content of last version
+                    image.buf  = NULL;
+                    image.size = 0;
+                    read_file(inum, &image.buf, &image.size);
+                    image.exists  = true;
+                    image.written = true;
+                }
+
+                int end = (entry.u.patch.index + 1) * BLOCK_SIZE;
+                if (image.size < end) {
+                    image.buf = (char *)realloc(image.buf, end);
+                    bzero(image.buf + image.size, end - image.size);
+                    image.size = end;
+                }
+                memcpy(image.buf + entry.u.patch.index * BLOCK_SIZE, entry.u.patch.buf, BLOCK_SIZE);
+                free(entry.u.patch.buf);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // a rollback or checkout leaves what follows its version in the log
+    // until the next write, go back to the version checked out. otherwise
+    // the records after the last commit are the changes made since.
+    int version = lm.saved_version();
+    if (version >= 0 && version < (int)versions.size()) {
+        for (std::map<uint32_t, inode_image_t>::iterator it = index.begin(); it != index.end(); ++it) {
+            free(it->second.buf);
         }
-        case log_entry::commit:
-        default:
-            printf("im: unexpected log entry to redo %d\n", entry.kind);
+        index.clear();
+        checkout(version);
+    } else if (!index.empty()) {
+        replay_version(index);
+        modified = true;
+    }
+
+    scan_inodes();
+
+    // tags may name versions lost in the crash
+    tags = lm.load_tags();
+    for (std::map<std::string, int>::iterator it = tags.begin(); it != tags.end(); ) {
+        if (it->second >= (int)versions.size()) {
+            tags.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    LOG(INFO, "im: recovered %lu versions from %d logs, version %d checked out\n",
+        versions.size(), count, current_version);
+}
+
+// Rebuild the table of inodes in use from the inode blocks.
+void inode_manager::scan_inodes() {
+    pthread_mutex_lock(&inode_mutex);
+    for (uint32_t inum = 1; inum <= INODE_NUM; inum++) {
+        char buf[BLOCK_SIZE];
+        bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
+        inode_used[inum] = ((struct inode *)buf + (inum - 1) % IPB)->type != 0;
     }
+    pthread_mutex_unlock(&inode_mutex);
 }
 
-void inode_manager::undo(const log_entry &entry) {
-    switch (entry.kind) {
-        case log_entry::create: {
-            #if VERBOSE
-            printf("im: undo create, inum: %d, type: %d\n", entry.u.create.inum, entry.u.create.type);
-            #endif
-            free_inode(entry.u.create.inum);
+struct replay_job {
+    inode_manager *im;
+    std::vector<std::pair<uint32_t, inode_image_t *> > images;
+    size_t next;
+    pthread_mutex_t mutex;
+};
+
+void *inode_manager::replay_worker(void *arg) {
+    replay_job *job = (replay_job *)arg;
+
+    while (true) {
+        pthread_mutex_lock(&job->mutex);
+        size_t i = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+
+        if (i >= job->images.size())
             break;
+        job->im->apply_image(job->images[i].first, *job->images[i].second);
+    }
+    return NULL;
+}
+
+// Apply and release the images of one version, one inode per task.
+void inode_manager::replay_version(std::map<uint32_t, inode_image_t> &index) {
+    replay_job job;
+    job.im = this;
+    job.next = 0;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    for (std::map<uint32_t, inode_image_t>::iterator it = index.begin(); it != index.end(); ++it) {
+        job.images.push_back(std::make_pair(it->first, &it->second));
+    }
+
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers > (long)job.images.size())
+        nworkers = job.images.size();
+
+    LOG(DEBUG, "im: replay %lu inodes with %ld workers\n", job.images.size(), nworkers);
+
+    if (nworkers <= 1) {
+        replay_worker(&job);
+    } else {
+        std::vector<pthread_t> workers(nworkers);
+        for (long i = 0; i < nworkers; i++) {
+            if (pthread_create(&workers[i], NULL, replay_worker, &job) != 0) {
+                LOG(ERROR, "im: fail to create replay worker\n");
+                workers.resize(i);
+                break;
+            }
         }
-        case log_entry::update: {
-            #if VERBOSE
-            printf("im: undo update, inum: %d, old_size: %d\n", entry.u.update.inum, entry.u.update.old_size);
-            #endif
-            _write_file(entry.u.update.inum, entry.u.update.old_buf, entry.u.update.old_size);
-            break;
+        replay_worker(&job);  // help, and cover for workers not started
+        for (size_t i = 0; i < workers.size(); i++) {
+            pthread_join(workers[i], NULL);
         }
-        case log_entry::deletee: {
-            #if VERBOSE
-            printf("im: undo delete, inum: %d, type: %d\n", entry.u.deletee.inum, entry.u.deletee.type);
-            #endif
-
-            struct inode ino;
-            ino.type = entry.u.deletee.type;
-            ino.size = 0;
-            unsigned int now = (unsigned int)time(NULL);
-            ino.atime = now;
-            ino.mtime = now;
-            ino.ctime = now;
-            put_inode(entry.u.deletee.inum, &ino);
+    }
+    pthread_mutex_destroy(&job.mutex);
 
-            break;
+    for (std::map<uint32_t, inode_image_t>::iterator it = index.begin(); it != index.end(); ++it) {
+        free(it->second.buf);
+    }
+    index.clear();
+}
+
+// Bring one inode to its final image. Safe to run in parallel for distinct
+// inodes: each has its own inode block, and block allocation is latched.
+void inode_manager::apply_image(uint32_t inum, const inode_image_t &image) {
+    char buf[BLOCK_SIZE];
+    bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
+    uint32_t live_type = ((struct inode *)buf + (inum - 1) % IPB)->type;
+
+    if (!image.exists) {
+        LOG(DEBUG, "im: replay delete, inum: %d\n", inum);
+        if (live_type != 0) {
+            _write_file(inum, "", 0);  // release blocks
+            free_inode(inum);
+        }
+        return;
+    }
+
+    if (image.type != 0) {  // created within this version
+        LOG(DEBUG, "im: replay create, inum: %d, type: %d\n", inum, image.type);
+        if (live_type != 0) {
+            _write_file(inum, "", 0);  // release blocks of the former file
+        }
+
+        struct inode ino;
+        bzero(&ino, sizeof(ino));
+        ino.type = image.type;
+        unsigned int now = (unsigned int)time(NULL);
+        ino.atime = now;
+        ino.mtime = now;
+        ino.ctime = now;
+        ino.nlink = 1;
+        put_inode(inum, &ino);
+    }
+
+    if (image.written) {
+        LOG(DEBUG, "im: replay update, inum: %d, size: %d\n", inum, image.size);
+        _write_file(inum, image.buf ? image.buf : "", image.size);
+    }
+
+    if (image.linked) {
+        LOG(DEBUG, "im: replay link, inum: %d, nlink: %d\n", inum, image.nlink);
+        struct inode *ino = get_inode(inum);
+        if (ino != NULL) {
+            ino->nlink = image.nlink;
+            put_inode(inum, ino);
+            free(ino);
         }
-        case log_entry::commit:
-        default:
-            printf("im: unexpected log entry to undo %d\n", entry.kind);
     }
 }
 
@@ -839,47 +1700,68 @@ void inode_manager::undo(const log_entry &entry) {
 
 log_manager::log_manager() {
     filename = "disk.log";
-    logfile.open(filename.c_str(), std::fstream::in | std::fstream::out | std::fstream::trunc);
+    version = -1;
+    version_saved = false;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_key_create(&group_key, NULL);
+    logfile.open(filename.c_str(), std::fstream::in | std::fstream::out | std::fstream::app);
 }
 
 log_manager::~log_manager() {
     logfile.close();
 }
 
+// a group a thread has begun, its records and how many
+struct log_group {
+    std::string records;
+    int count;
+};
+
+// Entries of one inode reach the log in the order of their changes, its
+// caller holds the inode. Entries of distinct inodes interleave freely,
+// recovery folds them per inode anyway.
 void log_manager::log(const std::string &entry) {
+    log_group *group = (log_group *) pthread_getspecific(group_key);
+    if (group != NULL) {
+        group->records += entry;
+        group->count++;
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
     if (logfile.peek() != EOF) {  // writing to disk after some rollbacks
-        // create a temp file
-        std::ofstream newdata("temp", std::ios::out);
-        int size = logfile.tellp();
-        char buf[size];
-    	logfile.seekp(0);
-    	logfile.read(buf, size);
-    	newdata.write(buf, size);
-        newdata.close();
-
-        // remove old log and use newly created one as new log
-        logfile.close();
-        std::rename("temp", filename.c_str());
-        logfile.open(filename.c_str(), std::fstream::in | std::fstream::out | std::fstream::app);
-
-        #if VERBOSE
-        printf("lm: clean trailing logs\n");
-        #endif
+        truncate(logfile.tellp());
+        checkpoints.resize(version + 1);
+
+        LOG(TRACE, "lm: clean trailing logs\n");
     } else {
         logfile.clear();
     }
 
     logfile << entry;
     logfile.flush();
+
+    if (version_saved) {  // stale now, see save_version
+        unlink((filename + ".version").c_str());
+        version_saved = false;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+// Drop everything after pos, later writes are appended from there.
+void log_manager::truncate(int pos) {
+    logfile.close();
+    if (::truncate(filename.c_str(), pos) != 0) {
+        LOG(ERROR, "lm: fail to truncate log at %d\n", pos);
+    }
+    logfile.open(filename.c_str(), std::fstream::in | std::fstream::out | std::fstream::app);
 }
 
 void log_manager::create_log(uint32_t inum, uint32_t type) {
     std::stringstream ss;
     ss << "create " << inum << ' ' << type << '\n';
 
-    #if VERBOSE
-    printf("lm: new create log, inum: %d, type: %d\n", inum, type);
-    #endif
+    LOG(TRACE, "lm: new create log, inum: %d, type: %d\n", inum, type);
     log(ss.str());
 }
 
@@ -891,9 +1773,7 @@ void log_manager::update_log(uint32_t inum, int old_size, const char *old_buf, i
     ss.write(new_buf, new_size);
     ss << '\n';
 
-    #if VERBOSE
-    printf("lm: new update log, inum: %d, old_size: %d, new_size: %d\n", inum, old_size, new_size);
-    #endif
+    LOG(TRACE, "lm: new update log, inum: %d, old_size: %d, new_size: %d\n", inum, old_size, new_size);
     log(ss.str());
 }
 
@@ -901,17 +1781,56 @@ void log_manager::delete_log(uint32_t inum, uint32_t type) {
     std::stringstream ss;
     ss << "delete " << inum << ' ' << type << '\n';
 
-    #if VERBOSE
-    printf("lm: new delete log, inum: %d, type: %d\n", inum, type);
-    #endif
+    LOG(TRACE, "lm: new delete log, inum: %d, type: %d\n", inum, type);
+    log(ss.str());
+}
+
+void log_manager::patch_log(uint32_t inum, int index, const char *buf) {
+    std::stringstream ss;
+    ss << "patch " << inum << ' ' << index << ' ';
+    ss.write(buf, BLOCK_SIZE);
+    ss << '\n';
+
+    LOG(TRACE, "lm: new patch log, inum: %d, index: %d\n", inum, index);
     log(ss.str());
 }
 
+void log_manager::link_log(uint32_t inum, uint32_t nlink) {
+    std::stringstream ss;
+    ss << "link " << inum << ' ' << nlink << '\n';
+
+    LOG(TRACE, "lm: new link log, inum: %d, nlink: %d\n", inum, nlink);
+    log(ss.str());
+}
+
+void log_manager::begin_group() {
+    log_group *group = new log_group();
+    group->count = 0;
+    pthread_setspecific(group_key, group);
+}
+
+// One append for the whole group, so no other record comes in between.
+// The caller still holds the inodes, and the version lock keeps commit out.
+void log_manager::end_group() {
+    log_group *group = (log_group *) pthread_getspecific(group_key);
+    if (group == NULL)
+        return;
+    pthread_setspecific(group_key, NULL);
+
+    if (group->count > 1) {
+        std::stringstream ss;
+        ss << "group " << group->count << '\n';
+        LOG(TRACE, "lm: new group log, count: %d\n", group->count);
+        log(ss.str() + group->records);
+    } else if (group->count == 1) {
+        log(group->records);
+    }
+    delete group;
+}
+
 // buf needs to be freed by user
 log_entry log_manager::next_log() {
-    #if VERBOSE
     int cursor = logfile.tellp();
-    #endif
 
     log_entry entry;
 
@@ -921,9 +1840,7 @@ log_entry log_manager::next_log() {
     if (log_type == "create") {
         entry.kind = log_entry::create;
         logfile >> entry.u.create.inum >> entry.u.create.type;
-        #if VERBOSE
-        printf("lm: reading create log at %d, inum: %d, type: %d\n", cursor, entry.u.create.inum, entry.u.create.type);
-        #endif
+        LOG(TRACE, "lm: reading create log at %d, inum: %d, type: %d\n", cursor, entry.u.create.inum, entry.u.create.type);
     } else if (log_type == "update") {
         entry.kind = log_entry::update;
 
@@ -936,108 +1853,177 @@ log_entry log_manager::next_log() {
         logfile.read(entry.u.update.old_buf, entry.u.update.old_size);
         logfile.read(entry.u.update.new_buf, entry.u.update.new_size);
 
-        #if VERBOSE
-        printf("lm: reading update log at %d, inum: %d, old_size: %d, new_size: %d\n", cursor, entry.u.update.inum, entry.u.update.old_size, entry.u.update.new_size);
-        #endif
+        LOG(TRACE, "lm: reading update log at %d, inum: %d, old_size: %d, new_size: %d\n", cursor, entry.u.update.inum, entry.u.update.old_size, entry.u.update.new_size);
     } else if (log_type == "delete") {
         entry.kind = log_entry::deletee;
         logfile >> entry.u.deletee.inum >> entry.u.deletee.type;
-        #if VERBOSE
-        printf("lm: reading delete log at %d, inum: %d, type: %d\n", cursor, entry.u.deletee.inum, entry.u.deletee.type);
-        #endif
+        LOG(TRACE, "lm: reading delete log at %d, inum: %d, type: %d\n", cursor, entry.u.deletee.inum, entry.u.deletee.type);
+    } else if (log_type == "patch") {
+        entry.kind = log_entry::patch;
+
+        logfile >> entry.u.patch.inum >> entry.u.patch.index;
+        logfile.get();
+
+        entry.u.patch.buf = (char*)malloc(BLOCK_SIZE);
+        logfile.read(entry.u.patch.buf, BLOCK_SIZE);
+
+        LOG(TRACE, "lm: reading patch log at %d, inum: %d, index: %d\n", cursor, entry.u.patch.inum, entry.u.patch.index);
+    } else if (log_type == "link") {
+        entry.kind = log_entry::link;
+        logfile >> entry.u.link.inum >> entry.u.link.nlink;
+        LOG(TRACE, "lm: reading link log at %d, inum: %d, nlink: %d\n", cursor, entry.u.link.inum, entry.u.link.nlink);
+    } else if (log_type == "group") {
+        entry.kind = log_entry::group;
+        logfile >> entry.u.group.count;
+        LOG(TRACE, "lm: reading group log at %d, count: %d\n", cursor, entry.u.group.count);
     } else if (log_type == "commit") {
         entry.kind = log_entry::commit;
-        #if VERBOSE
-        printf("lm: reading commit log at %d\n", cursor);
-        #endif
-    } else {
-        printf("lm: unexpected log type %s\n", log_type.c_str());
+        LOG(TRACE, "lm: reading commit log at %d\n", cursor);
+    } else {  // most likely a record torn by a crash
+        LOG(WARN, "lm: unexpected log type %s\n", log_type.c_str());
         entry.kind = log_entry::commit;
-        #if VERBOSE
-        printf("lm: reading unexpected log at %d, cursor at: %d", cursor, (int)logfile.tellp());
-        exit(-1);
-        #endif
+        logfile.setstate(std::ios::failbit);
+        LOG(TRACE, "lm: reading unexpected log at %d, cursor at: %d\n", cursor, (int)logfile.tellp());
     }
 
-    logfile.get();  // skip trailing newline
+    if (logfile.get() != '\n') {  // skip trailing newline
+        logfile.setstate(std::ios::failbit);
+    }
     return entry;
 }
 
 void log_manager::commit() {
-    #if VERBOSE
-    printf("lm: new commit log\n");
-    #endif
+    LOG(TRACE, "lm: new commit log\n");
     log("commit\n");
-    previous_checkpoints.push_back(logfile.tellp());
+    pthread_mutex_lock(&mutex);
+    checkpoints.push_back(logfile.tellp());
+    version = checkpoints.size() - 1;
+    pthread_mutex_unlock(&mutex);
 }
 
-std::vector<log_entry> log_manager::rollback() {
-    std::vector<log_entry> entries;
-
-    if (previous_checkpoints.size() == 0) {
-        printf("lm: previous commit not exists\n");
-        return entries;
+// Move the cursor right after the given commit, next write drops the rest.
+void log_manager::checkout(int version) {
+    if (version < 0 || version >= (int)checkpoints.size()) {
+        LOG(WARN, "lm: checkpoint %d not exists\n", version);
+        return;
     }
 
-    int curr_pos = logfile.tellp();
-    int prev_ckp = previous_checkpoints.back();
-
-    if (curr_pos > prev_ckp) {  // some writes need to be undone
-        // go to last checkpoint
-        logfile.seekp(previous_checkpoints.back());
+    LOG(TRACE, "lm: checkout checkpoint %d at %d\n", version, checkpoints[version]);
+    pthread_mutex_lock(&mutex);
+    logfile.clear();
+    logfile.seekp(checkpoints[version]);
+    this->version = version;
+    save_version();
+    pthread_mutex_unlock(&mutex);
+}
 
-        // read all writes since checkpoint
-        while (logfile.tellp() < curr_pos) {
-            entries.push_back(next_log());
-        }
+// A checkout leaves the newer versions in the log until the next write
+// drops them, so the version checked out is kept beside the log, with the
+// size of the log at the time. Any record appended since makes it stale.
+void log_manager::save_version() {
+    struct stat st;
+    std::string versionfile = filename + ".version";
+    std::ofstream out((versionfile + ".tmp").c_str(), std::ios::out | std::ios::trunc);
+    out << version << ' ' << (stat(filename.c_str(), &st) == 0 ? (long)st.st_size : -1L) << '\n';
+    out.close();
+
+    // replace at once, a crash leaves either the old or the new version
+    std::rename((versionfile + ".tmp").c_str(), versionfile.c_str());
+    version_saved = true;
+}
 
-        logfile.seekp(previous_checkpoints.back());
+// The version saved by the last checkout, -1 if the log changed since.
+int log_manager::saved_version() {
+    std::ifstream in((filename + ".version").c_str());
+    int version = -1;
+    long size = -1;
+    struct stat st;
 
-        return entries;
-    } else if (curr_pos == prev_ckp) {  // rollback after just commit
-        if (previous_checkpoints.size() == 1) {
-            printf("lm: cannot rollback further\n");
-            return entries;
-        }
+    if (!(in >> version >> size) || stat(filename.c_str(), &st) != 0 || st.st_size != size)
+        return -1;
+    return version;
+}
 
-        // skip last commit
-        logfile.seekp(-7, std::ios_base::cur);  // 7 == length of "commit\n"
-        previous_checkpoints.pop_back();
-        int curr_pos = logfile.tellp();
-        int prev_ckp = previous_checkpoints.back();
+// Tags are rewritten as a whole, one "version name" pair per line.
+void log_manager::save_tags(const std::map<std::string, int> &tags) {
+    std::string tagfile = filename + ".tags";
+    std::ofstream out((tagfile + ".tmp").c_str(), std::ios::out | std::ios::trunc);
 
-        // see if there is any write needs to be undone
-        if (curr_pos > prev_ckp) {
-            return rollback();
-        } else {
-            return entries;
-        }
+    for (std::map<std::string, int>::const_iterator it = tags.begin(); it != tags.end(); ++it) {
+        out << it->second << ' ' << it->first << '\n';
     }
+    out.close();
+
+    // replace at once, a crash leaves either the old or the new tags
+    std::rename((tagfile + ".tmp").c_str(), tagfile.c_str());
 }
 
-std::vector<log_entry> log_manager::forward() {
-    std::vector<log_entry> entries;
+std::map<std::string, int> log_manager::load_tags() {
+    std::map<std::string, int> tags;
+    std::ifstream in((filename + ".tags").c_str());
+    int version;
+    std::string name;
 
-    if (logfile.peek() == EOF) {  // if no log entry available
-        printf("lm: cannot forward further\n");
-        logfile.clear();
-        return entries;
+    while (in >> version && std::getline(in.ignore(1), name)) {
+        tags[name] = version;
     }
+    return tags;
+}
 
-    log_entry entry;
-    do {
-        entry = next_log();
-        if (entry.kind != log_entry::commit) {
-            entries.push_back(entry);
-        } else {
-            previous_checkpoints.push_back(logfile.tellp());
+// Analysis pass of crash recovery: find the end of the last complete record
+// and drop a record torn by a crash after it. Every complete record is the
+// state of the file system, committed or not. A group counts as one record,
+// complete with the last of its records.
+// Return true if there is anything to replay.
+bool log_manager::recover() {
+    int end = 0;
+    int grouped = 0;  // records of the current group still to come
+
+    logfile.seekg(0);
+    while (logfile.peek() != EOF) {
+        log_entry entry = next_log();
+        if (logfile.fail())
             break;
+
+        if (entry.kind == log_entry::update) {
+            free(entry.u.update.old_buf);
+            free(entry.u.update.new_buf);
+        } else if (entry.kind == log_entry::patch) {
+            free(entry.u.patch.buf);
         }
-    } while (logfile.peek() != EOF);
 
-    if (logfile.eof()) {
+        if (entry.kind == log_entry::group)
+            grouped = entry.u.group.count;
+        else if (grouped > 0)
+            grouped--;
+        if (grouped == 0)
+            end = logfile.tellg();
+    }
+    logfile.clear();
+    logfile.seekg(0, std::ios::end);
+
+    int size = logfile.tellg();
+    if (size > end) {
+        LOG(WARN, "lm: drop a torn record of %d bytes at %d\n", size - end, end);
+        truncate(end);
+    }
+
+    logfile.seekg(0);
+    return end > 0;
+}
+
+// Redo pass of crash recovery: read entries from the start, false at the end.
+// Update and patch entries hold buffers to be freed by caller.
+bool log_manager::replay(log_entry &entry) {
+    if (logfile.peek() == EOF) {
         logfile.clear();
+        version = checkpoints.size() - 1;
+        return false;
     }
 
-    return entries;
+    entry = next_log();
+    if (entry.kind == log_entry::commit) {
+        checkpoints.push_back(logfile.tellp());
+    }
+    return true;
 }
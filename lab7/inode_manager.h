@@ -4,8 +4,11 @@
 #define inode_h
 
 #include <stdint.h>
+#include <pthread.h>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <set>
 #include "extent_protocol.h" // TODO: delete it
 
 #define DISK_SIZE  1024*1024*16
@@ -49,44 +52,89 @@ public:
     bool corrupted;
 };
 
+// what the block layer has done since start, counted with atomic adds
+struct block_stats {
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long corrected;  // reads that repaired the coded copy
+    unsigned long long allocs;
+    unsigned long long frees;
+
+    unsigned long long bad_bytes;  // damaged coded bytes found, by reads or the scrubber
+    unsigned long long scrubbed;   // blocks checked by the scrubber
+    unsigned long long scrub_corrected;  // blocks the scrubber rewrote
+    unsigned long long scrub_passes;
+};
+
+// blocks the scrubber checks per second by default, 0 leaves it off
+#define SCRUB_RATE   1024
+#define SCRUB_BATCH  32
+// writes and repairs of a block are serialized on one of these
+#define BLOCK_LOCKS  64
+
 class block_manager {
 private:
     disk *d;
-    std::map<uint32_t, int>using_blocks;
+    std::map<uint32_t, int>using_blocks;  // reference count of each allocated block
+    pthread_mutex_t alloc_mutex;           // guards bitmap and reference counts
+    pthread_mutex_t block_locks[BLOCK_LOCKS];
+    int scrub_rate;                        // blocks per second
 
     int valid_bnum(uint32_t bnum);
     int buf_not_null(char *buf);
 
+    int decode_block(uint32_t id, char *buf, char *coded);
+    void write_coded(uint32_t id, const char *coded);
+    int repair_block(uint32_t id);
+    uint32_t next_blocks(uint32_t from, std::vector<uint32_t> &ids);
+    static void *scrubber(void *arg);
+
 public:
     block_manager();
     struct superblock sb;
+    struct block_stats stats;
 
     uint32_t alloc_block();
     void free_block(uint32_t id);
+    void ref_block(uint32_t id);
+    int block_refs(uint32_t id);
     void read_block(uint32_t id, char *buf);
     void write_block(uint32_t id, const char *buf);
+
+    // check every allocated block in the background, rate blocks per
+    // second, and rewrite the damaged ones before they pile up more errors
+    void start_scrubber(int rate);
 };
 
 // inode layer -----------------------------------------
 
 struct log_entry {
-    enum { create = 0, update, deletee, commit } kind;
+    enum { create = 0, update, deletee, commit, patch, link, group } kind;
     union {
         struct {uint32_t inum, type;} create;
         struct {uint32_t inum; int old_size, new_size; char *old_buf, *new_buf;} update;
         struct {uint32_t inum, type;} deletee;
+        struct {uint32_t inum; int index; char *buf;} patch;  // one block rewritten
+        struct {uint32_t inum, nlink;} link;                   // new link count
+        struct {int count;} group;  // the records that follow, all or none
     } u;
 };
 
 class log_manager {
 private:
     std::string filename;
+    pthread_mutex_t mutex;         // appends and moves of the cursor, one at a time
 
     std::fstream logfile;
-    std::vector<int> previous_checkpoints;
+    std::vector<int> checkpoints;  // log position right after each commit
+    int version;                   // checkpoint the log cursor belongs to, -1 if none
+    bool version_saved;            // a checkout left version beside the log
+    pthread_key_t group_key;       // records held back by a thread, see begin_group
 
     void log(const std::string &entry);
+    void truncate(int pos);
     log_entry next_log();
+    void save_version();
 
 public:
     log_manager();
@@ -94,9 +142,25 @@ public:
     void create_log(uint32_t inum, uint32_t type);
     void update_log(uint32_t inum, int old_size, const char *old_buf, int new_size, const char *new_buf);
     void delete_log(uint32_t inum, uint32_t type);
+    void patch_log(uint32_t inum, int index, const char *buf);
+    void link_log(uint32_t inum, uint32_t nlink);
     void commit();
-    std::vector<log_entry> rollback();
-    std::vector<log_entry> forward();
+    void checkout(int version);
+
+    // the records the calling thread logs in between are appended at once
+    // behind a group record, recovery keeps them all or none
+    void begin_group();
+    void end_group();
+
+    // named versions, kept beside the log
+    void save_tags(const std::map<std::string, int> &tags);
+    std::map<std::string, int> load_tags();
+    // the version of the last checkout, while the log is as it left it
+    int saved_version();
+
+    // crash recovery
+    bool recover();
+    bool replay(log_entry &entry);
 };
 
 
@@ -122,37 +186,106 @@ typedef struct inode {
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
+    unsigned int nlink;               // directory entries naming it
     blockid_t    blocks[NDIRECT + 1]; // Data block addresses
 } inode_t;
 
+// a frozen inode table, taken at commit time. blocks reachable from it
+// hold one reference each, so they are never overwritten in place.
+typedef struct snapshot {
+    std::map<uint32_t, inode_t> inodes;  // allocated inodes only
+} snapshot_t;
+
+// final state of one inode within a version, collected while replaying the log
+typedef struct inode_image {
+    bool exists;
+    uint32_t type;  // set if the inode was (re)created, 0 keeps the current one
+    bool written;   // content below replaces the file
+    int size;
+    char *buf;
+    bool linked;    // nlink below was changed by a link or an unlink
+    uint32_t nlink;
+} inode_image_t;
+
+// Calls on distinct inodes may run in parallel. The caller serializes calls
+// on one inode, and runs commit and the version switches alone (see
+// extent_server). The state shared by all inodes is latched here.
 class inode_manager {
 private:
     block_manager *bm;
     log_manager lm;
 
+    std::vector<snapshot_t> versions;
+    std::map<std::string, int> tags;
+    int current_version;           // version checked out, -1 before first commit
+    bool modified;                 // changed since current version was checked out
+    pthread_mutex_t version_mutex; // guards the above against writers and snapshot readers
+    std::set<uint32_t> touched;    // inodes written since current version was checked out
+    pthread_mutex_t touched_mutex;
+    std::vector<bool> inode_used;  // by inum, allocated or reserved
+    pthread_mutex_t inode_mutex;   // guards inode_used
+
     int valid_inum(uint32_t inum);
     int valid_type(uint32_t type);
     int valid_size(int size);
 
     struct inode* get_inode(uint32_t inum);
     void put_inode(uint32_t inum, struct inode *ino);
+    void set_inode(uint32_t inum, const struct inode *ino);
 
+    void read_blocks(const struct inode *ino, char *buf);
+    void read_part(blockid_t bnum, int off, int n, char *buf);
     int _write_file(uint32_t inum, const char *buf, int size);
+    blockid_t block_id(const struct inode *ino, int index);
+    int _write_file_block(uint32_t inum, int index, const char *buf);
+
+    void list_blocks(const struct inode *ino, std::vector<blockid_t> &blocks);
+    void unshare_blocks(struct inode *ino, int block_num);
+    void mark_modified();
+    void freeze();
+    void checkout(int version);
 
-    void redo(const log_entry &entry);
-    void undo(const log_entry &entry);
+    void scan_inodes();
+    void recover();
+    void replay_version(std::map<uint32_t, inode_image_t> &index);
+    void apply_image(uint32_t inum, const inode_image_t &image);
+    static void *replay_worker(void *arg);
 
 public:
     inode_manager();
     uint32_t alloc_inode(uint32_t type);
+    uint32_t reserve_inode();
+    void unreserve_inode(uint32_t inum);
+    uint32_t create_inode(uint32_t inum, uint32_t type);
     void free_inode(uint32_t inum);
     void read_file(uint32_t inum, char **buf, int *size);
+    void read_file(uint32_t inum, std::string &buf);
+    int read_range(uint32_t inum, unsigned int off, unsigned int size, std::string &buf);
     void write_file(uint32_t inum, const char *buf, int size);
     void remove_file(uint32_t inum);
+    int link_inode(uint32_t inum);
+    int unlink_inode(uint32_t inum);
+    int read_file_block(uint32_t inum, int index, char *buf);
+    int write_file_block(uint32_t inum, int index, const char *buf);
     void getattr(uint32_t inum, extent_protocol::attr& a);
+    // the changes of one request, replayed all or none, see log_manager
+    void begin_group();
+    void end_group();
     void commit();
     void rollback();
     void forward();
+    int checkout_version(int version);
+    int tag(const std::string &name);
+    int checkout_tag(const std::string &name);
+
+    // read-only access to committed versions
+    int snapshot_count();
+    void read_snapshot(int version, uint32_t inum, char **buf, int *size);
+    void read_snapshot(int version, uint32_t inum, std::string &buf);
+    void getattr_snapshot(int version, uint32_t inum, extent_protocol::attr& a);
+
+    struct block_stats block_counters();
+    void start_scrubber(int rate);
 };
 
 
@@ -23,17 +23,3 @@ lock_protocol::status lock_client::stat(lock_protocol::lockid_t lid) {
 	VERIFY (ret == lock_protocol::OK);
 	return ret;
 }
-
-lock_protocol::status lock_client::acquire(lock_protocol::lockid_t lid) {
-    int r;
-	lock_protocol::status ret = cl->call(lock_protocol::acquire, cl->id(), lid, r);
-	VERIFY (ret == lock_protocol::OK);
-	return ret;
-}
-
-lock_protocol::status lock_client::release(lock_protocol::lockid_t lid) {
-    int r;
-	lock_protocol::status ret = cl->call(lock_protocol::release, cl->id(), lid, r);
-	VERIFY (ret == lock_protocol::OK);
-	return ret;
-}
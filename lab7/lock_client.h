@@ -8,15 +8,16 @@
 #include "rpc.h"
 #include <vector>
 
-// Client interface to the lock server
+// Client interface to the lock server. The server hands out locks to be
+// cached and revokes them, acquire and release are lock_client_cache's.
 class lock_client {
  protected:
   rpcc *cl;
  public:
   lock_client(std::string d);
   virtual ~lock_client() {};
-  virtual lock_protocol::status acquire(lock_protocol::lockid_t);
-  virtual lock_protocol::status release(lock_protocol::lockid_t);
+  virtual lock_protocol::status acquire(lock_protocol::lockid_t) = 0;
+  virtual lock_protocol::status release(lock_protocol::lockid_t) = 0;
   virtual lock_protocol::status stat(lock_protocol::lockid_t);
 };
 
@@ -0,0 +1,182 @@
+// RPC stubs for clients to talk to lock_server, and cache the locks
+// see lock_client_cache.h for protocol details.
+
+#include "lock_client_cache.h"
+#include "rpc.h"
+#include "logger.h"
+#include <sstream>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int lock_client_cache::last_port = 0;
+
+static void *releasethread(void *x) {
+    lock_client_cache *cc = (lock_client_cache *) x;
+    cc->releaser();
+    return 0;
+}
+
+lock_client_cache::lock_client_cache(std::string xdst, class lock_release_user *_lu)
+    : lock_client(xdst), lu(_lu) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&releaser_cond, NULL);
+
+    srand(time(NULL) ^ last_port);
+    rlock_port = ((rand() % 32000) | (0x1 << 10));
+    const char *hname;
+    // VERIFY(gethostname(hname, 100) == 0);
+    hname = "127.0.0.1";
+    std::ostringstream host;
+    host << hname << ":" << rlock_port;
+    id = host.str();
+    last_port = rlock_port;
+
+    rpcs *rlsrpc = new rpcs(rlock_port);
+    rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache::revoke_handler);
+    rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache::retry_handler);
+
+    pthread_t th;
+    VERIFY(pthread_create(&th, NULL, &releasethread, (void *) this) == 0);
+}
+
+lock_protocol::status lock_client_cache::acquire(lock_protocol::lockid_t lid) {
+    pthread_mutex_lock(&mutex);
+    lock_entry &lock = locks[lid];
+
+    while (true) {
+        if (lock.status == FREE) {  // cached, no RPC at all
+            lock.status = LOCKED;
+            break;
+        }
+
+        if (lock.status != NONE) {  // another thread has it or is at the server
+            pthread_cond_wait(&lock.cond, &mutex);
+            continue;
+        }
+
+        // ask the server, until granted
+        lock.status = ACQUIRING;
+        lock.revoked = false;
+        lock_protocol::status ret;
+
+        while (true) {
+            lock.retry = false;
+            pthread_mutex_unlock(&mutex);
+            int r;
+            ret = cl->call(lock_protocol::acquire, lid, id, r);
+            pthread_mutex_lock(&mutex);
+
+            if (ret != lock_protocol::RETRY)
+                break;
+            while (!lock.retry)  // the retry may arrive before this reply
+                pthread_cond_wait(&lock.cond, &mutex);
+        }
+
+        if (ret != lock_protocol::OK) {
+            LOG(ERROR, "lock_client_cache: fail to acquire lock %llu\n", lid);
+            lock.status = NONE;
+            pthread_cond_broadcast(&lock.cond);
+            pthread_mutex_unlock(&mutex);
+            return ret;
+        }
+        lock.status = LOCKED;
+        break;
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return lock_protocol::OK;
+}
+
+lock_protocol::status lock_client_cache::release(lock_protocol::lockid_t lid) {
+    pthread_mutex_lock(&mutex);
+    lock_entry &lock = locks[lid];
+    VERIFY(lock.status == LOCKED);
+
+    if (!lock.revoked) {  // keep it
+        lock.status = FREE;
+        pthread_cond_signal(&lock.cond);
+        pthread_mutex_unlock(&mutex);
+        return lock_protocol::OK;
+    }
+
+    lock.status = RELEASING;
+    pthread_mutex_unlock(&mutex);
+
+    giveback(lid);
+    return lock_protocol::OK;
+}
+
+// return a lock in RELEASING to the server
+void lock_client_cache::giveback(lock_protocol::lockid_t lid) {
+    if (lu)
+        lu->dorelease(lid);
+
+    int r;
+    lock_protocol::status ret = cl->call(lock_protocol::release, lid, id, r);
+    if (ret != lock_protocol::OK)
+        LOG(ERROR, "lock_client_cache: fail to release lock %llu\n", lid);
+
+    pthread_mutex_lock(&mutex);
+    lock_entry &lock = locks[lid];
+    lock.status = NONE;
+    lock.revoked = false;
+    pthread_cond_broadcast(&lock.cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+// the release RPC is left to releaser, the server may be waiting for this reply
+rlock_protocol::status lock_client_cache::revoke_handler(lock_protocol::lockid_t lid, int &) {
+    pthread_mutex_lock(&mutex);
+    lock_entry &lock = locks[lid];
+
+    if (lock.status != NONE && lock.status != RELEASING) {
+        lock.revoked = true;
+        if (lock.status == FREE) {
+            lock.status = RELEASING;
+            to_release.push_back(lid);
+            pthread_cond_signal(&releaser_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return rlock_protocol::OK;
+}
+
+rlock_protocol::status lock_client_cache::retry_handler(lock_protocol::lockid_t lid, int &) {
+    pthread_mutex_lock(&mutex);
+    lock_entry &lock = locks[lid];
+    lock.retry = true;
+    pthread_cond_broadcast(&lock.cond);
+    pthread_mutex_unlock(&mutex);
+    return rlock_protocol::OK;
+}
+
+void lock_client_cache::releaser() {
+    pthread_mutex_lock(&mutex);
+    while (true) {
+        while (to_release.empty())
+            pthread_cond_wait(&releaser_cond, &mutex);
+
+        lock_protocol::lockid_t lid = to_release.front();
+        to_release.pop_front();
+        pthread_mutex_unlock(&mutex);
+        giveback(lid);
+        pthread_mutex_lock(&mutex);
+    }
+}
+
+bool lock_client_cache::cached(lock_protocol::lockid_t lid) {
+    pthread_mutex_lock(&mutex);
+    std::map<lock_protocol::lockid_t, lock_entry>::iterator it = locks.find(lid);
+    bool result = it != locks.end() && (it->second.status == FREE || it->second.status == LOCKED) &&
+            !it->second.revoked;
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
+lock_protocol::status lock_client_cache::revoke_all() {
+    int r;
+    return cl->call(lock_protocol::revoke_all, cl->id(), r);
+}
@@ -0,0 +1,68 @@
+// lock client interface with caching.
+// a lock released by the application stays with the client, so acquiring it
+// again needs no RPC, until the server revokes it on behalf of another client.
+
+#ifndef lock_client_cache_h
+#define lock_client_cache_h
+
+#include <string>
+#include <map>
+#include <list>
+#include "lock_protocol.h"
+#include "rpc.h"
+#include "lock_client.h"
+#include "lang/verify.h"
+
+// Whatever the application cached under a lock has to be dropped, or written
+// back, before the lock leaves the client. dorelease is called just before.
+class lock_release_user {
+ public:
+  virtual void dorelease(lock_protocol::lockid_t) = 0;
+  virtual ~lock_release_user() {};
+};
+
+class lock_client_cache : public lock_client {
+ private:
+  enum lock_status { NONE, FREE, LOCKED, ACQUIRING, RELEASING };
+
+  struct lock_entry {
+    lock_status status;
+    bool revoked;  // give back to the server once free
+    bool retry;    // server says it is worth asking again
+    pthread_cond_t cond;
+    lock_entry() : status(NONE), revoked(false), retry(false) {
+      pthread_cond_init(&cond, NULL);
+    }
+  };
+
+  class lock_release_user *lu;
+  int rlock_port;
+  std::string hostname;
+  std::string id;
+
+  std::map<lock_protocol::lockid_t, lock_entry> locks;
+  std::list<lock_protocol::lockid_t> to_release;  // revoked while free
+  pthread_mutex_t mutex;
+  pthread_cond_t releaser_cond;
+
+  void giveback(lock_protocol::lockid_t);
+
+ public:
+  static int last_port;
+  lock_client_cache(std::string xdst, class lock_release_user *l = 0);
+  virtual ~lock_client_cache() {};
+  lock_protocol::status acquire(lock_protocol::lockid_t);
+  lock_protocol::status release(lock_protocol::lockid_t);
+  rlock_protocol::status revoke_handler(lock_protocol::lockid_t, int &);
+  rlock_protocol::status retry_handler(lock_protocol::lockid_t, int &);
+
+  // true while the lock stays with this client, so that nobody else can
+  // have changed what is cached under it
+  bool cached(lock_protocol::lockid_t);
+  // make the server take back the locks of every client
+  lock_protocol::status revoke_all();
+
+  void releaser();
+};
+
+#endif
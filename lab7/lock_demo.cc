@@ -3,7 +3,7 @@
 //
 
 #include "lock_protocol.h"
-#include "lock_client.h"
+#include "lock_client_cache.h"
 #include "rpc.h"
 #include <arpa/inet.h>
 #include <vector>
@@ -11,7 +11,7 @@
 #include <stdio.h>
 
 std::string dst;
-lock_client *lc;
+lock_client_cache *lc;
 
 int
 main(int argc, char *argv[])
@@ -24,7 +24,7 @@ main(int argc, char *argv[])
   }
 
   dst = argv[1];
-  lc = new lock_client(dst);
+  lc = new lock_client_cache(dst);
   r = lc->stat(1);
   printf ("stat returned %d\n", r);
 }
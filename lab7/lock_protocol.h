@@ -13,7 +13,20 @@ class lock_protocol {
   enum rpc_numbers {
     acquire = 0x7001,
     release,
-    stat
+    stat,
+    revoke_all,
+    server_stats
+  };
+};
+
+// calls from lock_server_cache back to lock_client_cache
+class rlock_protocol {
+ public:
+  enum xxstatus { OK, RPCERR };
+  typedef int status;
+  enum rpc_numbers {
+    revoke = 0x8001,
+    retry = 0x8002
   };
 };
 
@@ -0,0 +1,125 @@
+// the caching lock server implementation
+
+#include "lock_server_cache.h"
+#include "handle.h"
+#include "logger.h"
+#include <sstream>
+#include <stdio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <vector>
+
+// count the request in stats while the handler runs
+#define STAT(proc) rpc_stats::call counted(stats, lock_protocol::proc, #proc)
+
+lock_server_cache::lock_server_cache()
+    : nacquire (0), stats("lock_server", lock_protocol::acquire) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+// callbacks are sent without holding mutex
+void lock_server_cache::revoke(std::string id, lock_protocol::lockid_t lid) {
+    handle h(id);
+    int r;
+
+    if (!h.safebind() || h.safebind()->call(rlock_protocol::revoke, lid, r) != rlock_protocol::OK) {
+        LOG(ERROR, "fail to revoke lock %llu from client %s\n", lid, id.c_str());
+    }
+}
+
+void lock_server_cache::retry(std::string id, lock_protocol::lockid_t lid) {
+    handle h(id);
+    int r;
+
+    if (!h.safebind() || h.safebind()->call(rlock_protocol::retry, lid, r) != rlock_protocol::OK) {
+        LOG(ERROR, "fail to ask client %s to retry lock %llu\n", id.c_str(), lid);
+    }
+}
+
+lock_protocol::status lock_server_cache::stat(int clt, lock_protocol::lockid_t lid, int &r) {
+    STAT(stat);
+    LOG(DEBUG, "stat request from clt %d\n", clt);
+    r = nacquire;
+    return lock_protocol::OK;
+}
+
+lock_protocol::status lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id, int &) {
+    STAT(acquire);
+    pthread_mutex_lock(&mutex);
+    lock_state &lock = locks[lid];
+
+    // free, grant it and ask for it back at once if others wait
+    if (lock.owner.empty()) {
+        lock.owner = id;
+        lock.waiting.erase(id);
+        lock.revoke_sent = !lock.waiting.empty();
+        bool need_revoke = lock.revoke_sent;
+        nacquire++;
+        pthread_mutex_unlock(&mutex);
+
+        LOG(INFO, "client %s acquired lock %llu\n", id.c_str(), lid);
+        if (need_revoke)
+            revoke(id, lid);
+        return lock_protocol::OK;
+    }
+
+    // held by another client, which is asked to give it back once
+    lock.waiting.insert(id);
+    bool need_revoke = !lock.revoke_sent;
+    lock.revoke_sent = true;
+    std::string owner = lock.owner;
+    pthread_mutex_unlock(&mutex);
+
+    if (need_revoke)
+        revoke(owner, lid);
+    return lock_protocol::RETRY;
+}
+
+lock_protocol::status lock_server_cache::release(lock_protocol::lockid_t lid, std::string id, int &) {
+    STAT(release);
+    pthread_mutex_lock(&mutex);
+    lock_state &lock = locks[lid];
+
+    if (lock.owner != id) {
+        LOG(ERROR, "client %s tries to release un held lock %llu\n", id.c_str(), lid);
+        pthread_mutex_unlock(&mutex);
+        return lock_protocol::NOENT;
+    }
+
+    lock.owner.clear();
+    lock.revoke_sent = false;
+    std::string next = lock.waiting.empty() ? "" : *lock.waiting.begin();
+    pthread_mutex_unlock(&mutex);
+
+    LOG(INFO, "client %s released lock %llu\n", id.c_str(), lid);
+    if (!next.empty())
+        retry(next, lid);
+    return lock_protocol::OK;
+}
+
+// Take back every cached lock, so that clients drop whatever they cached
+// under them. Used when the file system changes as a whole, e.g. rollback.
+lock_protocol::status lock_server_cache::revoke_all(int clt, int &) {
+    STAT(revoke_all);
+    std::vector<std::pair<std::string, lock_protocol::lockid_t> > owners;
+
+    pthread_mutex_lock(&mutex);
+    for (std::map<lock_protocol::lockid_t, lock_state>::iterator it = locks.begin(); it != locks.end(); ++it) {
+        if (!it->second.owner.empty() && !it->second.revoke_sent) {
+            it->second.revoke_sent = true;
+            owners.push_back(std::make_pair(it->second.owner, it->first));
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t i = 0; i < owners.size(); i++) {
+        revoke(owners[i].first, owners[i].second);
+    }
+    return lock_protocol::OK;
+}
+
+lock_protocol::status lock_server_cache::server_stats(int clt, std::string &out) {
+    out.clear();
+    stats.dump(out);
+    return lock_protocol::OK;
+}
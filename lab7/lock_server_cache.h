@@ -0,0 +1,43 @@
+// lock server that lets clients cache locks.
+// a lock stays with its client after release until another client asks for
+// it, then the holder is sent a revoke; a client told to retry is sent a
+// retry once the lock comes back.
+
+#ifndef lock_server_cache_h
+#define lock_server_cache_h
+
+#include <string>
+#include <map>
+#include <set>
+#include "lock_protocol.h"
+#include "rpc.h"
+#include "rpc_stats.h"
+
+class lock_server_cache {
+ private:
+  struct lock_state {
+    std::string owner;              // empty when the server holds the lock
+    std::set<std::string> waiting;  // clients told to retry
+    bool revoke_sent;
+    lock_state() : revoke_sent(false) {}
+  };
+
+  int nacquire;
+  std::map<lock_protocol::lockid_t, lock_state> locks;
+  pthread_mutex_t mutex;
+  rpc_stats stats;
+
+  void revoke(std::string id, lock_protocol::lockid_t lid);
+  void retry(std::string id, lock_protocol::lockid_t lid);
+
+ public:
+  lock_server_cache();
+  lock_protocol::status stat(int clt, lock_protocol::lockid_t lid, int &);
+  lock_protocol::status acquire(lock_protocol::lockid_t lid, std::string id, int &);
+  lock_protocol::status release(lock_protocol::lockid_t lid, std::string id, int &);
+  lock_protocol::status revoke_all(int clt, int &);
+  // request counters and latencies, see rpc_stats.h
+  lock_protocol::status server_stats(int clt, std::string &);
+};
+
+#endif
@@ -2,12 +2,30 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include "lock_server.h"
+#include "lock_server_cache.h"
 #include <unistd.h>
 #include "jsl_log.h"
 
 // Main loop of lock_server
 
+#ifndef RSM
+static int stats_interval;
+
+// print the counters every stats_interval seconds
+static void *
+dump_stats(void *x)
+{
+  lock_server_cache *ls = (lock_server_cache *) x;
+  while(1){
+    sleep(stats_interval);
+    std::string out;
+    ls->server_stats(0, out);
+    printf("%s", out.c_str());
+  }
+  return 0;
+}
+#endif
+
 int
 main(int argc, char *argv[])
 {
@@ -31,11 +49,20 @@ main(int argc, char *argv[])
   //jsl_set_debug(2);
 
 #ifndef RSM
-  lock_server ls;
+  lock_server_cache ls;
   rpcs server(atoi(argv[1]), count);
-  server.reg(lock_protocol::stat, &ls, &lock_server::stat);
-  server.reg(lock_protocol::acquire, &ls, &lock_server::acquire);
-  server.reg(lock_protocol::release, &ls, &lock_server::release);
+  server.reg(lock_protocol::stat, &ls, &lock_server_cache::stat);
+  server.reg(lock_protocol::acquire, &ls, &lock_server_cache::acquire);
+  server.reg(lock_protocol::release, &ls, &lock_server_cache::release);
+  server.reg(lock_protocol::revoke_all, &ls, &lock_server_cache::revoke_all);
+  server.reg(lock_protocol::server_stats, &ls, &lock_server_cache::server_stats);
+
+  char *interval_env = getenv("STATS_INTERVAL");
+  if(interval_env != NULL && atoi(interval_env) > 0){
+    stats_interval = atoi(interval_env);
+    pthread_t th;
+    pthread_create(&th, NULL, dump_stats, &ls);
+  }
 #endif
 
 
@@ -0,0 +1,139 @@
+// leveled logging, see logger.h
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+static const char *names[] = { "error", "warn", "info", "debug", "trace" };
+static const char *tags[] = { "ERROR", "WARN", "INFO", "DEBUG", "TRACE" };
+
+static int level_from_env() {
+    const char *env = getenv("YFS_LOG");
+    if (env == NULL)
+        return logger::WARN;
+
+    for (int i = 0; i <= logger::TRACE; i++) {
+        if (!strcasecmp(env, names[i]))
+            return i;
+    }
+    return atoi(env);
+}
+
+int logger::max_level = level_from_env();
+pthread_mutex_t logger::list_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t logger::output_mutex = PTHREAD_MUTEX_INITIALIZER;
+logger::buffer *logger::buffers = NULL;
+pthread_key_t logger::key;
+pthread_once_t logger::once = PTHREAD_ONCE_INIT;
+
+void logger::init() {
+    pthread_key_create(&key, release);
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, flusher, NULL) == 0)
+        pthread_detach(th);
+    atexit(flush);
+}
+
+logger::buffer *logger::thread_buffer() {
+    pthread_once(&once, init);
+
+    buffer *b = (buffer *) pthread_getspecific(key);
+    if (b == NULL) {
+        b = new buffer;
+        pthread_mutex_init(&b->mutex, NULL);
+        b->used = 0;
+
+        pthread_mutex_lock(&list_mutex);
+        b->next = buffers;
+        buffers = b;
+        pthread_mutex_unlock(&list_mutex);
+        pthread_setspecific(key, b);
+    }
+    return b;
+}
+
+void logger::write(int level, const char *fmt, ...) {
+    char line[1024];
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    int n = snprintf(line, sizeof(line), "%lu:\t[%s] ", tv.tv_sec * 1000 + tv.tv_usec / 1000, tags[level]);
+
+    va_list ap;
+    va_start(ap, fmt);
+    n += vsnprintf(line + n, sizeof(line) - n, fmt, ap);
+    va_end(ap);
+    if (n >= (int) sizeof(line))
+        n = sizeof(line) - 1;  // cut long lines
+
+    buffer *b = thread_buffer();
+    pthread_mutex_lock(&b->mutex);
+    if (b->used + n > LOGGER_BUF_SIZE) {
+        pthread_mutex_unlock(&b->mutex);
+        drain(b);
+        pthread_mutex_lock(&b->mutex);
+    }
+    memcpy(b->data + b->used, line, n);
+    b->used += n;
+    pthread_mutex_unlock(&b->mutex);
+
+    if (level == ERROR)
+        drain(b);
+}
+
+// the lines of one thread leave in order, as output_mutex is held from
+// taking them out of the buffer until they are written
+void logger::drain(buffer *b) {
+    char out[LOGGER_BUF_SIZE];
+
+    pthread_mutex_lock(&output_mutex);
+    pthread_mutex_lock(&b->mutex);
+    int n = b->used;
+    memcpy(out, b->data, n);
+    b->used = 0;
+    pthread_mutex_unlock(&b->mutex);
+
+    if (n > 0) {
+        fwrite(out, 1, n, stdout);
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&output_mutex);
+}
+
+void logger::flush() {
+    pthread_mutex_lock(&list_mutex);
+    for (buffer *b = buffers; b != NULL; b = b->next) {
+        drain(b);
+    }
+    pthread_mutex_unlock(&list_mutex);
+}
+
+// a thread exits, write out its lines and drop its buffer
+void logger::release(void *x) {
+    buffer *b = (buffer *) x;
+    drain(b);
+
+    pthread_mutex_lock(&list_mutex);
+    for (buffer **p = &buffers; *p != NULL; p = &(*p)->next) {
+        if (*p == b) {
+            *p = b->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&list_mutex);
+
+    pthread_mutex_destroy(&b->mutex);
+    delete b;
+}
+
+void *logger::flusher(void *) {
+    while (true) {
+        usleep(LOGGER_FLUSH_MS * 1000);
+        flush();
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+// leveled logging for the servers and yfs_client.
+//
+//   LOG(DEBUG, "im: write file %d\n", inum);
+//
+// a line above the level set by YFS_LOG (error, warn, info, debug or
+// trace, warn by default) costs one compare. the others are formatted
+// into a buffer of the calling thread, and a flush thread writes all the
+// buffers to stdout every LOGGER_FLUSH_MS, so that logging does not put a
+// write on every request. errors are written out at once.
+
+#ifndef logger_h
+#define logger_h
+
+#include <pthread.h>
+
+#define LOGGER_BUF_SIZE 8192
+#define LOGGER_FLUSH_MS 100
+
+class logger {
+public:
+    enum levels { ERROR = 0, WARN, INFO, DEBUG, TRACE };
+
+    // lines of this level and below are logged
+    static int max_level;
+
+    static void write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+    // write out what every thread has buffered
+    static void flush();
+
+private:
+    struct buffer {
+        pthread_mutex_t mutex;
+        int used;
+        char data[LOGGER_BUF_SIZE];
+        buffer *next;
+    };
+
+    static pthread_mutex_t list_mutex;   // guards buffers
+    static pthread_mutex_t output_mutex; // one write to stdout at a time
+    static buffer *buffers;
+    static pthread_key_t key;
+    static pthread_once_t once;
+
+    static void init();
+    static buffer *thread_buffer();
+    static void drain(buffer *b);
+    static void release(void *x);
+    static void *flusher(void *);
+};
+
+#define LOG(level, args...) do { \
+        if (logger::level <= logger::max_level) \
+            logger::write(logger::level, args); \
+        } while (0)
+
+#endif
@@ -0,0 +1,87 @@
+/* crash recovery benchmark.
+ * Build logs of growing size, then time how long inode_manager takes to
+ * replay each of them on startup.
+ *
+ * usage: recovery_bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string>
+
+#include "inode_manager.h"
+
+#define NFILES 8
+
+static double now_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Leave a log of the given number of commits, each rewriting one file.
+static void build_log(int commits, int file_size) {
+    inode_manager *im = new inode_manager();
+    uint32_t inums[NFILES];
+
+    for (int i = 0; i < NFILES; i++)
+        inums[i] = im->alloc_inode(extent_protocol::T_FILE);
+
+    for (int i = 0; i < commits; i++) {
+        std::string content(file_size, 'a' + i % 26);
+        im->write_file(inums[i % NFILES], content.data(), content.size());
+        im->commit();
+    }
+    exit(0);
+}
+
+static void run_in_child(void (*fn)(int, int), int commits, int file_size) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        fn(commits, file_size);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+static void recover(int commits, int file_size) {
+    double start = now_ms();
+    inode_manager *im = new inode_manager();
+    double elapsed = now_ms() - start;
+
+    struct stat st;
+    stat("disk.log", &st);
+    fprintf(stderr, "%8d %10d %12lld %10d %12.2f\n", commits, file_size,
+            (long long)st.st_size, im->snapshot_count(), elapsed);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    int commits[] = {16, 64, 256};
+    int file_sizes[] = {512, 2048, 8192};
+
+    char dir[] = "/tmp/recovery_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror("recovery_bench: temp dir");
+        return 1;
+    }
+
+    fprintf(stderr, "%8s %10s %12s %10s %12s\n", "commits", "file_size", "log_bytes", "versions", "recovery_ms");
+    for (size_t i = 0; i < sizeof(commits) / sizeof(commits[0]); i++) {
+        for (size_t j = 0; j < sizeof(file_sizes) / sizeof(file_sizes[0]); j++) {
+            unlink("disk.log");
+            run_in_child(build_log, commits[i], file_sizes[j]);
+            run_in_child(recover, commits[i], file_sizes[j]);
+        }
+    }
+
+    unlink("disk.log");
+    rmdir(dir);
+    return 0;
+}
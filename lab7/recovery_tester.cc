@@ -0,0 +1,318 @@
+/* crash recovery tester.
+ * A child process runs a random workload against inode_manager and is killed
+ * with SIGKILL at a random moment. Another child then recovers from disk.log
+ * and checks every committed version, and the changes made since the last
+ * commit, against a model of the workload. A rollback must survive a
+ * restart too.
+ *
+ * usage: recovery_tester [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "inode_manager.h"
+
+#define OPS_PER_COMMIT 5
+#define MAX_COMMITS 100
+#define MAX_WRITE 4096
+
+typedef std::map<uint32_t, std::string> model_t;  // inum -> content
+
+// Apply one random operation to the model, and to im unless it is NULL.
+static void step(model_t &files, unsigned int *seed, inode_manager *im) {
+    int r = rand_r(seed) % 10;
+
+    if (r < 3 || files.empty()) {  // create, inode_manager picks the lowest free inum
+        uint32_t inum = 2;
+        while (files.find(inum) != files.end())
+            inum++;
+        files[inum] = "";
+        if (im && im->alloc_inode(extent_protocol::T_FILE) != inum) {
+            fprintf(stderr, "[TEST_ERROR]: unexpected inum allocated\n");
+            exit(1);
+        }
+    } else {
+        model_t::iterator it = files.begin();
+        std::advance(it, rand_r(seed) % files.size());
+
+        if (r < 8) {  // write
+            std::string content(rand_r(seed) % MAX_WRITE, 'a' + rand_r(seed) % 26);
+            it->second = content;
+            if (im)
+                im->write_file(it->first, content.data(), content.size());
+        } else {  // remove
+            if (im)
+                im->remove_file(it->first);
+            files.erase(it);
+        }
+    }
+}
+
+// what the workload has finished
+struct progress {
+    int steps;
+    int commits;
+};
+
+static void report(int fd, const progress &p) {
+    if (write(fd, &p, sizeof(p)) != sizeof(p))
+        exit(1);
+}
+
+// Run the workload, report every finished step and commit through fd.
+static void workload(unsigned int seed, int fd) {
+    model_t files;
+    inode_manager *im = new inode_manager();
+    progress p = {0, 0};
+
+    for (int commit = 0; commit < MAX_COMMITS; commit++) {
+        for (int i = 0; i < OPS_PER_COMMIT; i++) {
+            step(files, &seed, im);
+            p.steps++;
+            report(fd, p);
+        }
+        im->commit();
+        p.commits++;
+        report(fd, p);
+    }
+    exit(0);
+}
+
+static std::string content_of(inode_manager *im, int version, uint32_t inum) {
+    char *buf = NULL;
+    int size = 0;
+    im->read_snapshot(version, inum, &buf, &size);
+    std::string content(buf ? buf : "", size);
+    free(buf);
+    return content;
+}
+
+// true if the live file system holds exactly the files of the model
+static bool live_matches(inode_manager *im, const model_t &files) {
+    for (uint32_t inum = 2; inum <= INODE_NUM; inum++) {
+        extent_protocol::attr a;
+        memset(&a, 0, sizeof(a));
+        im->getattr(inum, a);
+
+        model_t::const_iterator it = files.find(inum);
+        if (it == files.end()) {
+            if (a.type != 0)
+                return false;
+        } else {
+            std::string content;
+            im->read_file(inum, content);
+            if (a.type == 0 || content != it->second)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Recover from disk.log and check it against the model, exit 0 on success.
+static void verify(unsigned int seed, const progress &p) {
+    inode_manager *im = new inode_manager();
+    int versions = im->snapshot_count();
+
+    // the last commit may reach the log without being reported
+    if (versions != p.commits && versions != p.commits + 1) {
+        fprintf(stderr, "[TEST_ERROR]: %d versions recovered, %d commits reported\n",
+                versions, p.commits);
+        exit(1);
+    }
+
+    // the live files are those after the last step reported, or after the
+    // one in flight. a remove logs the emptied file before the delete.
+    unsigned int live_seed = seed;
+    model_t before, after;
+    for (int i = 0; i < p.steps; i++)
+        step(before, &live_seed, NULL);
+    after = before;
+    step(after, &live_seed, NULL);
+
+    model_t emptied = before;
+    for (model_t::iterator it = emptied.begin(); it != emptied.end(); ++it) {
+        if (after.find(it->first) == after.end())
+            it->second = "";
+    }
+
+    if (!live_matches(im, before) && !live_matches(im, after) && !live_matches(im, emptied)) {
+        fprintf(stderr, "[TEST_ERROR]: live files differ after %d steps\n", p.steps);
+        exit(1);
+    }
+
+    model_t files;
+    for (int version = 0; version < versions; version++) {
+        for (int i = 0; i < OPS_PER_COMMIT; i++)
+            step(files, &seed, NULL);
+
+        for (uint32_t inum = 2; inum <= INODE_NUM; inum++) {
+            extent_protocol::attr a;
+            memset(&a, 0, sizeof(a));
+            im->getattr_snapshot(version, inum, a);
+
+            model_t::iterator it = files.find(inum);
+            if (it == files.end()) {
+                if (a.type != 0) {
+                    fprintf(stderr, "[TEST_ERROR]: version %d, inode %u should not exist\n", version, inum);
+                    exit(1);
+                }
+            } else if (content_of(im, version, inum) != it->second) {
+                fprintf(stderr, "[TEST_ERROR]: version %d, inode %u has wrong content\n", version, inum);
+                exit(1);
+            }
+        }
+    }
+
+    // recovered file system must accept new work
+    uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+    im->write_file(inum, "after", 5);
+    im->commit();
+    exit(0);
+}
+
+static int wait_for(pid_t pid) {
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void clean_log() {
+    unlink("disk.log");
+    unlink("disk.log.tags");
+    unlink("disk.log.version");
+}
+
+static void expect(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "[TEST_ERROR]: %s\n", what);
+        exit(1);
+    }
+}
+
+// Each stage runs in a process of its own, exiting without any shutdown,
+// and starts from what the one before left in the log.
+static void rollback_stage(int stage) {
+    inode_manager *im = new inode_manager();
+    uint32_t inum = 2;
+    std::string content;
+
+    switch (stage) {
+    case 0:
+        expect(im->alloc_inode(extent_protocol::T_FILE) == inum, "unexpected inum allocated");
+        im->write_file(inum, "one", 3);
+        im->commit();
+        im->write_file(inum, "two", 3);
+        im->commit();
+        im->rollback();
+        break;
+    case 1:  // the rollback holds, the newer version is still there
+        im->read_file(inum, content);
+        expect(content == "one", "rollback lost in restart");
+        expect(im->snapshot_count() == 2, "versions lost in restart");
+        im->write_file(inum, "three", 5);  // drops version 1, left uncommitted
+        break;
+    case 2:
+        im->read_file(inum, content);
+        expect(content == "three", "uncommitted write lost in restart");
+        expect(im->snapshot_count() == 1, "dropped version back after restart");
+        im->rollback();
+        break;
+    case 3:
+        im->read_file(inum, content);
+        expect(content == "one", "rollback of uncommitted write lost in restart");
+        break;
+    }
+    exit(0);
+}
+
+static bool check_rollback() {
+    clean_log();
+    for (int stage = 0; stage < 4; stage++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            rollback_stage(stage);
+        }
+        if (wait_for(pid) != 0)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 10;
+    int passed = 0;
+
+    char dir[] = "/tmp/recovery_tester.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror("recovery_tester: temp dir");
+        return 1;
+    }
+    srand(getpid());
+
+    for (int round = 0; round < rounds; round++) {
+        unsigned int seed = rand();
+        int delay = rand() % 150000;  // microseconds before the crash
+        int fds[2];
+
+        clean_log();
+        if (pipe(fds) != 0) {
+            perror("recovery_tester: pipe");
+            return 1;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            workload(seed, fds[1]);
+        }
+        close(fds[1]);
+
+        // crash
+        usleep(delay);
+        kill(pid, SIGKILL);
+        wait_for(pid);
+
+        progress p = {0, 0}, last;
+        while (read(fds[0], &last, sizeof(last)) == sizeof(last))
+            p = last;
+        close(fds[0]);
+
+        // recover
+        pid = fork();
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            verify(seed, p);
+        }
+
+        if (wait_for(pid) == 0) {
+            printf("round %d: crash after %d us, %d steps, %d commits, recovered\n", round, delay, p.steps, p.commits);
+            passed++;
+        } else {
+            printf("round %d: crash after %d us, %d steps, %d commits, FAILED (seed %u)\n", round, delay, p.steps, p.commits, seed);
+        }
+    }
+
+    bool rollback_ok = check_rollback();
+    printf("rollback across restarts: %s\n", rollback_ok ? "ok" : "FAILED");
+
+    clean_log();
+    rmdir(dir);
+
+    printf("%d/%d rounds passed\n", passed, rounds);
+    return passed == rounds && rollback_ok ? 0 : 1;
+}
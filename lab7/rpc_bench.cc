@@ -0,0 +1,169 @@
+/* extent and lock RPC benchmark suite.
+ * Clients call a running extent_server and lock_server directly, without
+ * yfs_client or fuse in the way, each over connections of its own:
+ *
+ *   getattr        stat of a file of the client
+ *   put_block      write of one block of a file of the client
+ *   get_block      read of that block
+ *   create_unlink  dir_create and dir_unlink in the client's directory
+ *   round_trip     create, write, read back, stat and unlink of a file in
+ *                  the client's directory, for 1, 2, 4... clients up to
+ *                  all of them, to see whether requests on distinct inodes
+ *                  are served in parallel
+ *   lock_private   acquire and release of a lock of the client, cached
+ *   lock_shared    acquire and release of one lock of all the clients, which
+ *                  the server revokes from one to give to the next
+ *
+ * Every test prints one line of key=value pairs, see bench.h; an operation
+ * is a call, or the calls of a round trip, and threads are clients.
+ *
+ * usage: rpc_bench <extent-port> <lock-port> [clients] [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "bench.h"
+#include "extent_client.h"
+#include "lock_client_cache.h"
+
+#define SHARED_LOCK 1
+
+static std::string extent_dst, lock_dst;
+
+struct worker {
+    int id;
+    extent_client *ec;
+    lock_client_cache *lc;
+    extent_protocol::extentid_t dir, file;
+    std::string data;
+};
+
+static bool do_getattr(void *x, long) {
+    worker *w = (worker *) x;
+    extent_protocol::attr a;
+    return w->ec->getattr(w->file, a) == extent_protocol::OK;
+}
+
+static bool do_put_block(void *x, long) {
+    worker *w = (worker *) x;
+    return w->ec->put_block(w->file, 0, w->data) == extent_protocol::OK;
+}
+
+static bool do_get_block(void *x, long) {
+    worker *w = (worker *) x;
+    std::string buf;
+    return w->ec->get_block(w->file, 0, buf) == extent_protocol::OK && buf.size() == w->data.size();
+}
+
+static bool do_create_unlink(void *x, long i) {
+    worker *w = (worker *) x;
+    char name[64];
+    snprintf(name, sizeof(name), "f%ld", i);
+    extent_protocol::dirent e;
+    extent_protocol::extentid_t id;
+    return w->ec->dir_create(w->dir, name, extent_protocol::T_FILE, e) == extent_protocol::OK &&
+           w->ec->dir_unlink(w->dir, name, false, id) == extent_protocol::OK;
+}
+
+static bool do_round_trip(void *x, long i) {
+    worker *w = (worker *) x;
+    char name[64];
+    snprintf(name, sizeof(name), "r%ld", i);
+    extent_protocol::dirent e;
+    if (w->ec->dir_create(w->dir, name, extent_protocol::T_FILE, e) != extent_protocol::OK)
+        return false;
+
+    std::string buf;
+    extent_protocol::attr a;
+    extent_protocol::extentid_t id;
+    bool ok = w->ec->put_block(e.inum, 0, w->data) == extent_protocol::OK &&
+              w->ec->get_range(e.inum, 0, w->data.size(), buf) == extent_protocol::OK &&
+              buf == w->data &&
+              w->ec->getattr(e.inum, a) == extent_protocol::OK && a.size == w->data.size();
+    return w->ec->dir_unlink(w->dir, name, false, id) == extent_protocol::OK && ok;
+}
+
+// lock ids of the clients, away from the inode numbers yfs_client locks
+static lock_protocol::lockid_t private_lock(worker *w) {
+    return (1ULL << 32) + ((lock_protocol::lockid_t) getpid() << 8) + w->id;
+}
+
+static bool do_lock_private(void *x, long) {
+    worker *w = (worker *) x;
+    lock_protocol::lockid_t lid = private_lock(w);
+    return w->lc->acquire(lid) == lock_protocol::OK && w->lc->release(lid) == lock_protocol::OK;
+}
+
+static bool do_lock_shared(void *x, long) {
+    worker *w = (worker *) x;
+    lock_protocol::lockid_t lid = (1ULL << 32) + SHARED_LOCK;
+    return w->lc->acquire(lid) == lock_protocol::OK && w->lc->release(lid) == lock_protocol::OK;
+}
+
+// the first n clients run op for seconds, then the merged numbers are printed
+static bool measure(const char *test, std::vector<worker> &ws, size_t n,
+                    bench_op op, int seconds) {
+    std::vector<void *> ctxs;
+    for (size_t i = 0; i < n; i++)
+        ctxs.push_back(&ws[i]);
+
+    bench_result r;
+    bench_measure(ctxs, op, seconds, r);
+    bench_report(test, n, r);
+    return !r.failed;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <extent-port> <lock-port> [clients] [seconds]\n", argv[0]);
+        return 1;
+    }
+    extent_dst = argv[1];
+    lock_dst = argv[2];
+    int clients = argc > 3 ? atoi(argv[3]) : 4;
+    int seconds = argc > 4 ? atoi(argv[4]) : 5;
+
+    // a directory and a file per client, the root would be shared by all
+    std::vector<worker> ws(clients);
+    char name[64];
+    for (int i = 0; i < clients; i++) {
+        worker &w = ws[i];
+        w.id = i;
+        w.ec = new extent_client(extent_dst);
+        w.lc = new lock_client_cache(lock_dst);
+        w.data = std::string(BLOCK_SIZE, 'a' + i % 26);
+
+        extent_protocol::dirent d, f;
+        snprintf(name, sizeof(name), "rpc_bench.%d.%d", getpid(), i);
+        if (w.ec->dir_create(1, name, extent_protocol::T_DIR, d) != extent_protocol::OK ||
+            w.ec->dir_create(d.inum, "data", extent_protocol::T_FILE, f) != extent_protocol::OK ||
+            w.ec->put_block(f.inum, 0, w.data) != extent_protocol::OK) {
+            fprintf(stderr, "rpc_bench: setup of client %d failed\n", i);
+            return 1;
+        }
+        w.dir = d.inum;
+        w.file = f.inum;
+    }
+
+    size_t all = ws.size();
+    bool ok = measure("getattr", ws, all, do_getattr, seconds) &&
+              measure("put_block", ws, all, do_put_block, seconds) &&
+              measure("get_block", ws, all, do_get_block, seconds) &&
+              measure("create_unlink", ws, all, do_create_unlink, seconds);
+    for (size_t n = 1; ok && n < all; n *= 2)
+        ok = measure("round_trip", ws, n, do_round_trip, seconds);
+    ok = ok && measure("round_trip", ws, all, do_round_trip, seconds) &&
+         measure("lock_private", ws, all, do_lock_private, seconds) &&
+         measure("lock_shared", ws, all, do_lock_shared, seconds);
+
+    for (int i = 0; i < clients; i++) {
+        extent_protocol::extentid_t id;
+        snprintf(name, sizeof(name), "rpc_bench.%d.%d", getpid(), i);
+        ws[i].ec->dir_unlink(ws[i].dir, "data", false, id);
+        ws[i].ec->dir_unlink(1, name, false, id);
+    }
+    return ok ? 0 : 1;
+}
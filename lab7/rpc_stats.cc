@@ -0,0 +1,86 @@
+// counters and latency histograms of an RPC server, see rpc_stats.h
+#include "rpc_stats.h"
+#include <stdio.h>
+#include <string.h>
+#include "rpc.h"
+
+rpc_stats::rpc_stats(const std::string &server, unsigned int base)
+    : server(server), base(base) {
+    memset(procs, 0, sizeof(procs));
+    in_flight = 0;
+}
+
+rpc_stats::proc &rpc_stats::slot(unsigned int number) {
+    VERIFY(number >= base && number - base < RPC_STATS_PROCS);
+    return procs[number - base];
+}
+
+rpc_stats::call::call(rpc_stats &stats, unsigned int number, const char *name)
+    : stats(stats), p(stats.slot(number)) {
+    if (!p.name)
+        __sync_bool_compare_and_swap(&p.name, (const char *) NULL, name);
+    __sync_fetch_and_add(&p.in_flight, 1);
+    __sync_fetch_and_add(&stats.in_flight, 1);
+    gettimeofday(&start, 0);
+}
+
+rpc_stats::call::~call() {
+    struct timeval end;
+    gettimeofday(&end, 0);
+    unsigned long long us = (end.tv_sec - start.tv_sec) * 1000000ULL + end.tv_usec - start.tv_usec;
+
+    int i = 0;
+    while (i < RPC_STATS_BUCKETS - 1 && us >= (1ULL << i))
+        i++;
+    __sync_fetch_and_add(&p.buckets[i], 1);
+    __sync_fetch_and_add(&p.calls, 1);
+    __sync_fetch_and_sub(&p.in_flight, 1);
+    __sync_fetch_and_sub(&stats.in_flight, 1);
+}
+
+void rpc_stats::call::in(unsigned long long bytes) {
+    __sync_fetch_and_add(&p.bytes_in, bytes);
+}
+
+void rpc_stats::call::out(unsigned long long bytes) {
+    __sync_fetch_and_add(&p.bytes_out, bytes);
+}
+
+unsigned long long rpc_stats::percentile(const proc &p, double q) {
+    unsigned long long total = 0, seen = 0;
+    for (int i = 0; i < RPC_STATS_BUCKETS; i++) {
+        total += p.buckets[i];
+    }
+
+    for (int i = 0; i < RPC_STATS_BUCKETS; i++) {
+        seen += p.buckets[i];
+        if (seen > 0 && seen >= q * total)
+            return 1ULL << i;
+    }
+    return 0;
+}
+
+void rpc_stats::dump(std::string &out) {
+    char line[256];
+    unsigned long long calls = 0;
+    for (int i = 0; i < RPC_STATS_PROCS; i++) {
+        calls += procs[i].calls;
+    }
+
+    snprintf(line, sizeof(line), "%s: %llu calls, %llu in flight\n",
+             server.c_str(), calls, in_flight);
+    out += line;
+    snprintf(line, sizeof(line), "%-18s %10s %6s %8s %8s %8s %12s %12s\n",
+             "proc", "calls", "now", "p50<us", "p99<us", "p999<us", "bytes-in", "bytes-out");
+    out += line;
+
+    for (int i = 0; i < RPC_STATS_PROCS; i++) {
+        const proc &p = procs[i];
+        if (!p.name)
+            continue;
+        snprintf(line, sizeof(line), "%-18s %10llu %6llu %8llu %8llu %8llu %12llu %12llu\n",
+                 p.name, p.calls, p.in_flight, percentile(p, 0.5), percentile(p, 0.99),
+                 percentile(p, 0.999), p.bytes_in, p.bytes_out);
+        out += line;
+    }
+}
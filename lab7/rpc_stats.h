@@ -0,0 +1,65 @@
+// counters and latency histograms of the procedures an RPC server serves.
+//
+// a handler counts itself with a call object that lives as long as the
+// handler runs:
+//
+//   rpc_stats::call c(stats, extent_protocol::get, "get");
+//   ...
+//   c.out(buf.size());
+//
+// everything is updated with atomic adds, so counting takes no lock and
+// a dump taken while calls run may be off by the calls in progress.
+
+#ifndef rpc_stats_h
+#define rpc_stats_h
+
+#include <string>
+#include <sys/time.h>
+
+// procedures are numbered from the base given to rpc_stats, at most this many
+#define RPC_STATS_PROCS 64
+// latency bucket i holds calls of less than 2^i microseconds, the last one
+// everything slower
+#define RPC_STATS_BUCKETS 32
+
+class rpc_stats {
+public:
+    struct proc {
+        const char *name;  // set by the first call
+        unsigned long long calls;
+        unsigned long long in_flight;
+        unsigned long long bytes_in;   // payload, the data of puts
+        unsigned long long bytes_out;  // payload, the data of gets
+        unsigned long long buckets[RPC_STATS_BUCKETS];
+    };
+
+    class call {
+    private:
+        rpc_stats &stats;
+        proc &p;
+        struct timeval start;
+
+    public:
+        call(rpc_stats &stats, unsigned int number, const char *name);
+        ~call();
+        void in(unsigned long long bytes);
+        void out(unsigned long long bytes);
+    };
+
+private:
+    std::string server;
+    unsigned int base;
+    proc procs[RPC_STATS_PROCS];
+    unsigned long long in_flight;
+
+    proc &slot(unsigned int number);
+    // upper bound of the bucket holding the q-th fraction of the calls
+    static unsigned long long percentile(const proc &p, double q);
+
+public:
+    rpc_stats(const std::string &server, unsigned int base);
+    // a table of the procedures called so far, one line each
+    void dump(std::string &out);
+};
+
+#endif
@@ -0,0 +1,40 @@
+/* print the request counters of a running extent_server or lock_server.
+ *
+ * usage: server_stats extent|lock <port>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "rpc.h"
+#include "extent_protocol.h"
+#include "lock_protocol.h"
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 || (strcmp(argv[1], "extent") && strcmp(argv[1], "lock"))) {
+        fprintf(stderr, "usage: %s extent|lock <port>\n", argv[0]);
+        return 1;
+    }
+
+    sockaddr_in dstsock;
+    make_sockaddr(argv[2], &dstsock);
+    rpcc cl(dstsock);
+    if (cl.bind() != 0) {
+        fprintf(stderr, "server_stats: bind failed\n");
+        return 1;
+    }
+
+    std::string out;
+    int ret;
+    if (!strcmp(argv[1], "extent"))
+        ret = cl.call(extent_protocol::server_stats, 0, out);
+    else
+        ret = cl.call(lock_protocol::server_stats, 0, out);
+
+    if (ret != 0) {
+        fprintf(stderr, "server_stats: call failed %d\n", ret);
+        return 1;
+    }
+    printf("%s", out.c_str());
+    return 0;
+}
@@ -0,0 +1,178 @@
+/* storage engine microbenchmarks.
+ * Time the layers under extent_server in-process, without RPC or fuse:
+ * coded block reads and writes, block and inode allocation, whole file
+ * reads and writes of several sizes, and commit and rollback with several
+ * numbers of changes logged since the last commit.
+ *
+ * usage: storage_bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+#include "inode_manager.h"
+
+#define BLOCK_OPS   20000
+#define BLOCKS      1024   // blocks the block tests cycle through
+#define ALLOC_ROUNDS 8
+#define INODES      512    // inodes per allocation round, under INODE_NUM
+#define FILE_BYTES  (4 * 1024 * 1024)  // written per file size
+#define FILES       64     // files the commit tests change
+#define COMMIT_ROUNDS 16
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// bytes moved by one operation give MB/s, 0 if it moves none
+static void report(const char *test, int size, int bytes, long ops, double seconds) {
+    double mb = (double) bytes * ops / seconds / (1024 * 1024);
+    printf("%-14s %8d %8ld %12.0f %10.2f\n", test, size, ops, seconds * 1e9 / ops, mb);
+    fflush(stdout);
+}
+
+// a fresh inode_manager, one that does not recover the log of the last one
+static inode_manager *fresh() {
+    unlink("disk.log");
+    unlink("disk.log.tags");
+    unlink("disk.log.version");
+    return new inode_manager();
+}
+
+static void blocks() {
+    block_manager *bm = new block_manager();
+    std::vector<blockid_t> ids;
+    for (int i = 0; i < BLOCKS; i++)
+        ids.push_back(bm->alloc_block());
+
+    char buf[BLOCK_SIZE];
+    memset(buf, 'b', BLOCK_SIZE);
+    double start = now();
+    for (int i = 0; i < BLOCK_OPS; i++)
+        bm->write_block(ids[i % BLOCKS], buf);
+    report("write_block", BLOCK_SIZE, BLOCK_SIZE, BLOCK_OPS, now() - start);
+
+    start = now();
+    for (int i = 0; i < BLOCK_OPS; i++)
+        bm->read_block(ids[i % BLOCKS], buf);
+    report("read_block", BLOCK_SIZE, BLOCK_SIZE, BLOCK_OPS, now() - start);
+
+    for (int i = 0; i < BLOCKS; i++)
+        bm->free_block(ids[i]);
+
+    // the bitmap is searched from the start, fill it as the file system would
+    double alloc = 0, free = 0;
+    for (int r = 0; r < ALLOC_ROUNDS; r++) {
+        start = now();
+        for (int i = 0; i < BLOCKS; i++)
+            ids[i] = bm->alloc_block();
+        alloc += now() - start;
+
+        start = now();
+        for (int i = 0; i < BLOCKS; i++)
+            bm->free_block(ids[i]);
+        free += now() - start;
+    }
+    report("alloc_block", 0, 0, (long) ALLOC_ROUNDS * BLOCKS, alloc);
+    report("free_block", 0, 0, (long) ALLOC_ROUNDS * BLOCKS, free);
+}
+
+static void inodes() {
+    inode_manager *im = fresh();
+    std::vector<uint32_t> inums(INODES);
+
+    double alloc = 0, free = 0;
+    for (int r = 0; r < ALLOC_ROUNDS; r++) {
+        double start = now();
+        for (int i = 0; i < INODES; i++)
+            inums[i] = im->alloc_inode(extent_protocol::T_FILE);
+        alloc += now() - start;
+
+        start = now();
+        for (int i = 0; i < INODES; i++)
+            im->free_inode(inums[i]);
+        free += now() - start;
+    }
+    report("alloc_inode", 0, 0, (long) ALLOC_ROUNDS * INODES, alloc);
+    report("free_inode", 0, 0, (long) ALLOC_ROUNDS * INODES, free);
+}
+
+static void files() {
+    int sizes[] = {512, 4096, 16384, 65536};
+    inode_manager *im = fresh();
+    uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        std::string data(sizes[i], 'f'), buf;
+        long ops = FILE_BYTES / sizes[i];
+
+        double start = now();
+        for (long n = 0; n < ops; n++)
+            im->write_file(inum, data.data(), data.size());
+        report("write_file", sizes[i], sizes[i], ops, now() - start);
+
+        start = now();
+        for (long n = 0; n < ops; n++)
+            im->read_file(inum, buf);
+        report("read_file", sizes[i], sizes[i], ops, now() - start);
+    }
+}
+
+// changes: files written since the last commit, FILES distinct ones at most
+static void versions(int changes) {
+    inode_manager *im = fresh();
+    uint32_t inums[FILES];
+    for (int i = 0; i < FILES; i++)
+        inums[i] = im->alloc_inode(extent_protocol::T_FILE);
+
+    std::string data(1024, 'v');
+    double commit = 0, rollback = 0;
+    for (int r = 0; r < COMMIT_ROUNDS; r++) {
+        for (int i = 0; i < changes; i++)
+            im->write_file(inums[i % FILES], data.data(), data.size());
+        double start = now();
+        im->commit();
+        commit += now() - start;
+
+        for (int i = 0; i < changes; i++)
+            im->write_file(inums[i % FILES], data.data(), data.size());
+        start = now();
+        im->rollback();
+        rollback += now() - start;
+    }
+    report("commit", changes, 0, COMMIT_ROUNDS, commit);
+    report("rollback", changes, 0, COMMIT_ROUNDS, rollback);
+}
+
+int main(int argc, char *argv[]) {
+    int changes[] = {16, 64, 256};
+
+    // inode_manager keeps its log in the working directory
+    char dir[] = "/tmp/storage_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror("storage_bench: temp dir");
+        return 1;
+    }
+
+    // size is the bytes of an operation, or the changes logged for commit
+    // and rollback
+    printf("%-14s %8s %8s %12s %10s\n", "test", "size", "ops", "ns/op", "MB/s");
+    blocks();
+    inodes();
+    files();
+    for (size_t i = 0; i < sizeof(changes) / sizeof(changes[0]); i++)
+        versions(changes[i]);
+
+    unlink("disk.log");
+    unlink("disk.log.tags");
+    unlink("disk.log.version");
+    rmdir(dir);
+    return 0;
+}
@@ -3,56 +3,380 @@
 #include "extent_client.h"
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/time.h>
+#include "logger.h"
 
-static bool VERBOSE = true;
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *prefetchthread(void *x) {
+    yfs_client *yc = (yfs_client *) x;
+    yc->prefetcher();
+    return 0;
+}
 
 yfs_client::yfs_client() {
     ec = NULL;
     lc = NULL;
+    wb = NULL;
+    pthread_mutex_init(&cache_mutex, NULL);
+    pthread_cond_init(&prefetch_cond, NULL);
 }
 
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst, const char* cert_file) {
     ec = new extent_client(extent_dst);
-    lc = new lock_client(lock_dst);
-    if (VERBOSE) {
-        std::cout << "yc: start new client, extent server: " << extent_dst << ", lock server: " << lock_dst << ", certicication file: " << cert_file << std::endl;
-    }
+    lc = new lock_client_cache(lock_dst, this);
+    wb = NULL;
+    pthread_mutex_init(&cache_mutex, NULL);
+    pthread_cond_init(&prefetch_cond, NULL);
+
+    pthread_t th;
+    VERIFY(pthread_create(&th, NULL, &prefetchthread, (void *) this) == 0);
+
+    LOG(DEBUG, "yc: start new client, extent server: %s, lock server: %s, certicication file: %s\n", extent_dst.c_str(), lock_dst.c_str(), cert_file);
 }
 
 int yfs_client::verify(const char* name, unsigned short *uid) {
 	return OK;
 }
 
+// snapshots never change, so they need no lock
 void yfs_client::_acquire(inum inum) {
+    if (issnapshot(inum))
+        return;
     lc->acquire(inum);
 }
 
 void yfs_client::_release(inum inum) {
+    if (issnapshot(inum))
+        return;
     lc->release(inum);
 }
 
+bool yfs_client::issnapshot(inum inum) {
+    return inum == SNAPSHOT_ROOT || (inum >> 32) != 0;
+}
+
+// whether what is known about inum stays valid until the lock server says so
+bool yfs_client::cached(inum inum) {
+    return !issnapshot(inum) && lc->cached(inum);
+}
+
+void yfs_client::set_write_behind(write_behind *w) {
+    wb = w;
+}
+
+// The lock is leaving this client, someone else may change the inode.
+// Nobody here holds it any more, held back writes go out without it.
+void yfs_client::dorelease(lock_protocol::lockid_t lid) {
+    off_t off;
+    std::string data;
+    size_t written;
+
+    while (wb && wb->take(lid, off, data)) {
+        if (_write(lid, data.size(), off, data.data(), written) != OK)
+            LOG(ERROR, "   dorelease: fail to write back %lu bytes of %llu\n", data.size(), lid);
+    }
+    _forget(lid);
+}
+
+void yfs_client::_forget(inum inum) {
+    pthread_mutex_lock(&cache_mutex);
+    attr_cache.erase(inum);
+    dentry_cache.erase(inum);
+    attr_hints.erase(inum);
+    data_cache.erase(inum);
+    // what is still queued for it was asked for under the lock that goes
+    for (std::list<prefetch_req>::iterator it = to_prefetch.begin(); it != to_prefetch.end(); ) {
+        if (it->inum == inum)
+            it = to_prefetch.erase(it);
+        else
+            ++it;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// The cache is only filled while holding the lock of the inode, or of the
+// parent for an entry, and snapshots are left out of it.
+bool yfs_client::_cached_attr(inum inum, extent_protocol::attr &a) {
+    pthread_mutex_lock(&cache_mutex);
+    std::map<yfs_client::inum, extent_protocol::attr>::iterator it = attr_cache.find(inum);
+    bool found = it != attr_cache.end();
+    if (found)
+        a = it->second;
+    pthread_mutex_unlock(&cache_mutex);
+    return found;
+}
+
+void yfs_client::_cache_attr(inum inum, const extent_protocol::attr &a) {
+    pthread_mutex_lock(&cache_mutex);
+    attr_cache[inum] = a;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void yfs_client::_forget_attr(inum inum) {
+    pthread_mutex_lock(&cache_mutex);
+    attr_cache.erase(inum);
+    attr_hints.erase(inum);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// hints are taken without the lock, they only have to be recent. with the
+// lock at hand the cache is exact, and a listing that raced with a local
+// write cannot hide it.
+bool yfs_client::_hinted_attr(inum inum, extent_protocol::attr &a) {
+    if (lc && lc->cached(inum))
+        return false;
+
+    pthread_mutex_lock(&cache_mutex);
+    std::map<yfs_client::inum, std::pair<double, extent_protocol::attr> >::iterator it = attr_hints.find(inum);
+    bool found = it != attr_hints.end() && it->second.first > now();
+    if (found)
+        a = it->second.second;
+    else if (it != attr_hints.end())
+        attr_hints.erase(it);
+    pthread_mutex_unlock(&cache_mutex);
+    return found;
+}
+
+void yfs_client::_hint_attr(inum inum, const extent_protocol::attr &a) {
+    pthread_mutex_lock(&cache_mutex);
+    attr_hints[inum] = std::make_pair(now() + ATTR_HINT_TIMEOUT, a);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+bool yfs_client::_cached_dentry(inum parent, const char *name, bool &found, inum &ino_out) {
+    pthread_mutex_lock(&cache_mutex);
+    bool hit = false;
+    std::map<inum, dentries>::iterator dir = dentry_cache.find(parent);
+
+    if (dir != dentry_cache.end()) {
+        dentries::iterator it = dir->second.find(name);
+        if (it != dir->second.end()) {
+            hit = true;
+            found = it->second != 0;
+            if (found)
+                ino_out = it->second;
+        }
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+    return hit;
+}
+
+// inum 0 records that name is absent
+void yfs_client::_cache_dentry(inum parent, const char *name, inum inum) {
+    pthread_mutex_lock(&cache_mutex);
+    dentry_cache[parent][name] = inum;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// the whole file system changed under every client, e.g. on rollback
+void yfs_client::_forget_all() {
+    pthread_mutex_lock(&cache_mutex);
+    attr_cache.clear();
+    dentry_cache.clear();
+    attr_hints.clear();
+    data_cache.clear();
+    to_prefetch.clear();
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// Data is cached under the lock of the file like its attributes, one run
+// of it per file: what is read or fetched next to it joins it, anything
+// else takes its place.
+bool yfs_client::_cached_data(inum inum, off_t off, size_t size, std::string &data) {
+    pthread_mutex_lock(&cache_mutex);
+    std::map<yfs_client::inum, prefetched>::iterator it = data_cache.find(inum);
+    bool found = it != data_cache.end() && off >= it->second.off &&
+            off + (off_t) size <= it->second.off + (off_t) it->second.data.size();
+    if (found)
+        data.assign(it->second.data, off - it->second.off, size);
+    pthread_mutex_unlock(&cache_mutex);
+    return found;
+}
+
+void yfs_client::_cache_data(inum inum, off_t off, const std::string &data) {
+    pthread_mutex_lock(&cache_mutex);
+    prefetched &p = data_cache[inum];
+
+    if (p.data.empty() || off > p.off + (off_t) p.data.size() || off + (off_t) data.size() < p.off) {
+        p.off = off;
+        p.data = data;
+        p.queued = off + data.size();
+    } else {
+        if (off < p.off) {
+            p.data.insert(0, p.off - off, '\0');
+            p.off = off;
+        }
+        p.data.replace(off - p.off, data.size(), data);
+        if (p.queued < off + (off_t) data.size())
+            p.queued = off + data.size();
+    }
+
+    // readers move on, keep what is ahead of them
+    if (p.data.size() > 2 * READAHEAD_MAX) {
+        size_t drop = p.data.size() - 2 * READAHEAD_MAX;
+        p.data.erase(0, drop);
+        p.off += drop;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void yfs_client::_forget_data(inum inum) {
+    pthread_mutex_lock(&cache_mutex);
+    data_cache.erase(inum);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// called with the lock of inum after reading off to end of a file of size,
+// asks the prefetcher for whatever of the window past end is not there yet
+void yfs_client::_read_ahead(inum inum, off_t off, off_t end, off_t size, readahead *ra) {
+    pthread_mutex_lock(&cache_mutex);
+    if (off == ra->next)
+        ra->window = ra->window == 0 ? READAHEAD_MIN : std::min(2 * ra->window, (size_t) READAHEAD_MAX);
+    else
+        ra->window = 0;
+    ra->next = end;
+
+    std::map<yfs_client::inum, prefetched>::iterator it = data_cache.find(inum);
+    if (ra->window > 0 && it != data_cache.end()) {
+        off_t from = std::max(end, it->second.queued);
+        off_t to = std::min(end + (off_t) ra->window, size);
+
+        if (from < to) {
+            prefetch_req req;
+            req.inum = inum;
+            req.off = from;
+            req.size = to - from;
+            to_prefetch.push_back(req);
+            it->second.queued = to;
+            pthread_cond_signal(&prefetch_cond);
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// fetches what _read_ahead asks for, each range under the lock of its file.
+// a range whose run of cached data was dropped while waiting for the lock
+// is stale, the lock was revoked or the file changed since it was asked for.
+void yfs_client::prefetcher() {
+    pthread_mutex_lock(&cache_mutex);
+    while (true) {
+        while (to_prefetch.empty())
+            pthread_cond_wait(&prefetch_cond, &cache_mutex);
+
+        prefetch_req req = to_prefetch.front();
+        to_prefetch.pop_front();
+        pthread_mutex_unlock(&cache_mutex);
+
+        std::string data;
+        _acquire(req.inum);
+        pthread_mutex_lock(&cache_mutex);
+        bool stale = data_cache.find(req.inum) == data_cache.end();
+        pthread_mutex_unlock(&cache_mutex);
+        if (!stale && ec->get_range(req.inum, req.off, req.size, data) == extent_protocol::OK)
+            _cache_data(req.inum, req.off, data);
+        _release(req.inum);
+
+        pthread_mutex_lock(&cache_mutex);
+    }
+}
+
+yfs_client::inum yfs_client::_snapshot_inum(int version, inum inum) {
+    return ((yfs_client::inum)(version + 1) << 32) | (inum & 0xffffffff);
+}
+
+// return -1 for inodes of the live file system
+int yfs_client::_snapshot_version(inum inum) {
+    return (int)(inum >> 32) - 1;
+}
+
+// getattr for both live and snapshot inodes. with hint the caller holds no
+// lock, a recent hint will do and nothing is cached.
+int yfs_client::_getattr(inum inum, extent_protocol::attr &a, bool hint) {
+    if (inum == SNAPSHOT_ROOT) {  // looks like the live root
+        if (ec->getattr(1, a) != extent_protocol::OK)
+            return IOERR;
+        a.type = extent_protocol::T_DIR;
+        a.size = 0;
+        return OK;
+    }
+
+    int version = _snapshot_version(inum);
+
+    if (version < 0 && hint && _hinted_attr(inum, a)) {
+        return OK;
+    }
+
+    if (version < 0 && _cached_attr(inum, a)) {
+        return OK;
+    }
+
+    extent_protocol::status ret = version < 0 ? ec->getattr(inum, a) :
+            ec->snapshot_getattr(version, inum & 0xffffffff, a);
+
+    if (ret != extent_protocol::OK) {
+        return IOERR;
+    }
+
+    // a free inum may be handed out again without its lock, keep nothing
+    // about it
+    if (version < 0 && !hint && a.type != 0) {
+        _cache_attr(inum, a);
+    }
+    return OK;
+}
+
+// content of both live and snapshot inodes, SNAPSHOT_ROOT has none
+int yfs_client::_get(inum inum, std::string &buf) {
+    if (inum == SNAPSHOT_ROOT) {
+        buf = "";
+        return OK;
+    }
+
+    int version = _snapshot_version(inum);
+    extent_protocol::status ret = version < 0 ? ec->get(inum, buf) :
+            ec->snapshot_get(version, inum & 0xffffffff, buf);
+
+    return ret == extent_protocol::OK ? OK : IOERR;
+}
+
+// the getters answer from a recent readdirplus hint without the lock
 bool yfs_client::isfile(inum inum) {
+    extent_protocol::attr a;
+
+    if (_hinted_attr(inum, a)) {
+        return _isfile(inum, true);
+    }
+
     _acquire(inum);
     bool result = _isfile(inum);
     _release(inum);
     return result;
 }
 
-bool yfs_client::_isfile(inum inum) {
+bool yfs_client::_isfile(inum inum, bool hint) {
     extent_protocol::attr a;
 
-    if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("   isfile: error getting attr\n");
+    if (_getattr(inum, a, hint) != OK) {
+        LOG(WARN, "   isfile: error getting attr\n");
         return false;
     }
 
     if (a.type != extent_protocol::T_FILE) {
-        printf("   isfile: %lld is not a file\n", inum);
+        LOG(DEBUG, "   isfile: %lld is not a file\n", inum);
         return false;
     }
 
@@ -60,22 +384,28 @@ bool yfs_client::_isfile(inum inum) {
 }
 
 bool yfs_client::isdir(inum inum) {
+    extent_protocol::attr a;
+
+    if (_hinted_attr(inum, a)) {
+        return _isdir(inum, true);
+    }
+
     _acquire(inum);
     bool result = _isdir(inum);
     _release(inum);
     return result;
 }
 
-bool yfs_client::_isdir(inum inum) {
+bool yfs_client::_isdir(inum inum, bool hint) {
     extent_protocol::attr a;
 
-    if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("   isdir: error getting attr\n");
+    if (_getattr(inum, a, hint) != OK) {
+        LOG(WARN, "   isdir: error getting attr\n");
         return false;
     }
 
     if (a.type != extent_protocol::T_DIR) {
-        printf("   isdir: %lld is not a dir\n", inum);
+        LOG(DEBUG, "   isdir: %lld is not a dir\n", inum);
         return false;
     }
 
@@ -83,16 +413,22 @@ bool yfs_client::_isdir(inum inum) {
 }
 
 int yfs_client::getfile(inum inum, fileinfo& fin) {
+    extent_protocol::attr a;
+
+    if (_hinted_attr(inum, a)) {
+        return _getfile(inum, fin, true);
+    }
+
     _acquire(inum);
     int result = _getfile(inum, fin);
     _release(inum);
     return result;
 }
 
-int yfs_client::_getfile(inum inum, fileinfo& fin) {
+int yfs_client::_getfile(inum inum, fileinfo& fin, bool hint) {
     extent_protocol::attr a;
 
-    if (ec->getattr(inum, a) != extent_protocol::OK) {
+    if (_getattr(inum, a, hint) != OK) {
         return IOERR;
     }
 
@@ -100,23 +436,30 @@ int yfs_client::_getfile(inum inum, fileinfo& fin) {
     fin.mtime = a.mtime;
     fin.ctime = a.ctime;
     fin.size  = a.size;
-    printf("   getfile %llu, size: %llu\n", inum, fin.size);
+    fin.nlink = a.nlink;
+    LOG(DEBUG, "   getfile %llu, size: %llu\n", inum, fin.size);
 
     return OK;
 }
 
 int yfs_client::getdir(inum inum, dirinfo& din) {
+    extent_protocol::attr a;
+
+    if (_hinted_attr(inum, a)) {
+        return _getdir(inum, din, true);
+    }
+
     _acquire(inum);
     int result = _getdir(inum, din);
     _release(inum);
     return result;
 }
 
-int yfs_client::_getdir(inum inum, dirinfo& din) {
-    printf("   getdir %llu\n", inum);
+int yfs_client::_getdir(inum inum, dirinfo& din, bool hint) {
+    LOG(DEBUG, "   getdir %llu\n", inum);
     extent_protocol::attr a;
 
-    if (ec->getattr(inum, a) != extent_protocol::OK) {
+    if (_getattr(inum, a, hint) != OK) {
         return IOERR;
     }
 
@@ -128,16 +471,22 @@ int yfs_client::_getdir(inum inum, dirinfo& din) {
 }
 
 int yfs_client::getslink(inum inum, slinkinfo& sin) {
+    extent_protocol::attr a;
+
+    if (_hinted_attr(inum, a)) {
+        return _getslink(inum, sin, true);
+    }
+
     _acquire(inum);
     int result = _getslink(inum, sin);
     _release(inum);
     return result;
 }
 
-int yfs_client::_getslink(inum inum, slinkinfo& sin) {
+int yfs_client::_getslink(inum inum, slinkinfo& sin, bool hint) {
     extent_protocol::attr a;
 
-    if (ec->getattr(inum, a) != extent_protocol::OK) {
+    if (_getattr(inum, a, hint) != OK) {
         return IOERR;
     }
 
@@ -145,95 +494,167 @@ int yfs_client::_getslink(inum inum, slinkinfo& sin) {
     sin.mtime = a.mtime;
     sin.ctime = a.ctime;
     sin.size  = a.size;
-    printf("   getslink %llu, size: %llu\n", inum, sin.size);
+    LOG(DEBUG, "   getslink %llu, size: %llu\n", inum, sin.size);
 
     return OK;
 }
 
-bool yfs_client::_has_duplicate(inum parent, const char *name) {
-    bool exist;
-    inum old_inum;
-
-    return _lookup(parent, name, exist, old_inum) != extent_protocol::OK ? true : exist;
-}
-
 bool yfs_client::_add_entry_and_save(inum parent, const char *name, inum inum) {
-    std::list<dirent> entries;
-
-    if (_readdir(parent, entries) != OK) {
-        return false;
-    }
-
-    dirent entry;
-    entry.name = name;
-    entry.inum = inum;
-    entries.push_back(entry);
+    _forget_attr(parent);
 
-    if (_writedir(parent, entries) != OK) {
+    if (ec->dir_add(parent, name, inum) != extent_protocol::OK) {
+        LOG(WARN, "   add entry: fail to add %s to directory %llu\n", name, parent);
         return false;
     }
 
+    _cache_dentry(parent, name, inum);
     return true;
 }
 
-int yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum& ino_out) {
-    if (VERBOSE) {
-        std::cout << "yc: mkdir under inum " << parent << ", name: " << name << std::endl;
+// creates the inode and its entry in one round trip, the attributes of the
+// new inode come back with it for the caller
+int yfs_client::_create_entry(inum parent, const char *name, uint32_t type, inum &ino_out, extent_protocol::attr *a) {
+    bool found;
+    inum old_inum;
+
+    if (a) {
+        a->type = 0;
     }
 
-    _acquire(parent);
-    int result = _mkdir(parent, name, mode, ino_out);
-    _release(parent);
-    return result;
-}
+    if (parent == 1 && strcmp(name, SNAPSHOT_DIR) == 0) {
+        return EXIST;
+    }
 
-int yfs_client::_mkdir(inum parent, const char *name, mode_t mode, inum& ino_out) {
-    // on exist, return EXIST
-    if (_has_duplicate(parent, name)) {
+    if (_cached_dentry(parent, name, found, old_inum) && found) {
         return EXIST;
     }
 
-    // create file first
-    if (ec->create(extent_protocol::T_DIR, ino_out) != extent_protocol::OK) {
-        printf("   mkdir: fail to create directory %s\n", name);
-        return IOERR;
+    _forget_attr(parent);
+
+    extent_protocol::dirent entry;
+    extent_protocol::status ret = ec->dir_create(parent, name, type, entry);
+
+    if (ret == extent_protocol::EXIST) {
+        return EXIST;
     }
 
-    // write back
-    if (_add_entry_and_save(parent, name, ino_out) == false) {
+    if (ret != extent_protocol::OK) {
+        LOG(WARN, "   create entry: fail to create %s in directory %llu\n", name, parent);
         return IOERR;
     }
 
+    ino_out = entry.inum;
+    _cache_dentry(parent, name, ino_out);
+    if (a) {
+        *a = entry.a;
+    }
     return OK;
 }
 
-int yfs_client::lookup(inum parent, const char *name, bool& found, inum& ino_out) {
-    if (VERBOSE) {
-        std::cout << "yc: lookup " << name << " under inum " << parent << std::endl;
+int yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum& ino_out, extent_protocol::attr *a) {
+    if (issnapshot(parent)) {
+        return RDONLY;
     }
 
+    LOG(DEBUG, "yc: mkdir under inum %llu, name: %s\n", parent, name);
+
     _acquire(parent);
-    int result = _lookup(parent, name, found, ino_out);
+    int result = _mkdir(parent, name, mode, ino_out, a);
     _release(parent);
     return result;
 }
 
-int yfs_client::_lookup(inum parent, const char *name, bool& found, inum& ino_out) {
-    // read directory entries
-    std::list<dirent> entries;
+int yfs_client::_mkdir(inum parent, const char *name, mode_t mode, inum& ino_out, extent_protocol::attr *a) {
+    return _create_entry(parent, name, extent_protocol::T_DIR, ino_out, a);
+}
 
-    if (_readdir(parent, entries) != OK) {
-        return IOERR;
+int yfs_client::lookup(inum parent, const char *name, bool& found, inum& ino_out, extent_protocol::attr *a) {
+    LOG(DEBUG, "yc: lookup %s under inum %llu\n", name, parent);
+
+    _acquire(parent);
+    int result = _lookup(parent, name, found, ino_out, a);
+    _release(parent);
+    return result;
+}
+
+// a gets the attributes of what is found if they come along, type 0 if not
+int yfs_client::_lookup(inum parent, const char *name, bool& found, inum& ino_out, extent_protocol::attr *a) {
+    if (a) {
+        a->type = 0;
+    }
+
+    // hidden entry to reach old versions
+    if (parent == 1 && strcmp(name, SNAPSHOT_DIR) == 0) {
+        found   = true;
+        ino_out = SNAPSHOT_ROOT;
+        return OK;
     }
 
-    // check if name exists
     found = false;
 
-    for (std::list<dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
-        if (it->name == name) {
+    // one entry per version, named by its number
+    if (parent == SNAPSHOT_ROOT) {
+        int count;
+        char *end;
+        long version = strtol(name, &end, 10);
+
+        if (ec->snapshot_count(count) != extent_protocol::OK) {
+            return IOERR;
+        }
+
+        if (*name != '\0' && *end == '\0' && (name[0] != '0' || name[1] == '\0') &&
+            version >= 0 && version < count) {
             found   = true;
-            ino_out = it->inum;
+            ino_out = _snapshot_inum(version, 1);
         }
+        return OK;
+    }
+
+    // live directories are searched by the server, which hands over the
+    // attributes of what it finds when asked to
+    int version = _snapshot_version(parent);
+
+    if (version < 0) {
+        if (_cached_dentry(parent, name, found, ino_out)) {
+            return OK;
+        }
+
+        extent_protocol::dirent entry;
+        extent_protocol::status ret = a ? ec->dir_lookupplus(parent, name, entry) :
+                ec->dir_lookup(parent, name, entry.inum);
+
+        if (ret != extent_protocol::OK && ret != extent_protocol::NOENT) {
+            return IOERR;
+        }
+        found = ret == extent_protocol::OK;
+        if (found) {
+            ino_out = entry.inum;
+            if (a) {
+                *a = entry.a;
+            }
+        }
+        _cache_dentry(parent, name, found ? ino_out : 0);
+        return OK;
+    }
+
+    // entries of a snapshot stay in the same snapshot
+    std::string content;
+
+    if (_get(parent, content) != OK) {
+        return IOERR;
+    }
+
+    hashdir::memory dir(content);
+    uint32_t ino;
+    int r = hashdir::lookup(dir, name, ino);
+
+    if (r != hashdir::OK && r != hashdir::NOENT) {
+        return IOERR;
+    }
+
+    if (r == hashdir::OK) {
+        found   = true;
+        ino_out = _snapshot_inum(version, ino);
     }
 
     return OK;
@@ -247,48 +668,198 @@ int yfs_client::readdir(inum dir, std::list<dirent>& list) {
 }
 
 int yfs_client::_readdir(inum dir, std::list<dirent>& list) {
-    // get content
+    list.clear();
+    dirent entry;
+    entry.next = 0;
+    memset(&entry.a, 0, sizeof(entry.a));
+
+    // one entry per version
+    if (dir == SNAPSHOT_ROOT) {
+        int count;
+
+        if (ec->snapshot_count(count) != extent_protocol::OK) {
+            return IOERR;
+        }
+
+        for (int version = 0; version < count; version++) {
+            std::ostringstream ost;
+            ost << version;
+            entry.name = ost.str();
+            entry.inum = _snapshot_inum(version, 1);
+            list.push_back(entry);
+        }
+        return OK;
+    }
+
+    // read entries, those of a snapshot stay in the same snapshot
     std::string content;
 
-    if (ec->get(dir, content) != extent_protocol::OK) {
+    if (_get(dir, content) != OK) {
         return IOERR;
     }
 
-    // read entries
-    list.clear();
-    std::istringstream ist(content);
-    dirent entry;
+    hashdir::memory storage(content);
+    std::list<hashdir::entry> entries;
 
-    while (std::getline(ist, entry.name, '\0')) {
-        ist >> entry.inum;
+    if (hashdir::list(storage, entries) != hashdir::OK) {
+        return IOERR;
+    }
+
+    int version = _snapshot_version(dir);
+
+    for (std::list<hashdir::entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        entry.name = it->name;
+        entry.inum = version >= 0 ? _snapshot_inum(version, it->inum) : it->inum;
         list.push_back(entry);
+
+        if (version < 0) {
+            _cache_dentry(dir, it->name.c_str(), it->inum);
+        }
+    }
+
+    // live entries get their attributes, MULTI_MAX to a call, kept as hints
+    std::list<dirent>::iterator it = list.begin();
+    while (version < 0 && it != list.end()) {
+        std::vector<extent_protocol::extentid_t> eids;
+        std::vector<extent_protocol::attr> attrs;
+        std::list<dirent>::iterator first = it;
+
+        for (; it != list.end() && eids.size() < MULTI_MAX; ++it) {
+            eids.push_back(it->inum);
+        }
+
+        if (ec->multi_getattr(eids, attrs) != extent_protocol::OK || attrs.size() != eids.size()) {
+            return IOERR;
+        }
+
+        for (size_t i = 0; i < attrs.size(); i++, ++first) {
+            first->a = attrs[i];
+            if (attrs[i].type != 0) {
+                _hint_attr(first->inum, attrs[i]);
+            }
+        }
     }
 
     return OK;
 }
 
-int yfs_client::_writedir(inum dir, std::list<dirent>& entries) {
-    // prepare content
-    std::ostringstream ost;
+int yfs_client::readdir(inum dir, unsigned long long pos, int max, std::list<dirent>& list) {
+    _acquire(dir);
+    int result = _readdir(dir, pos, max, list, false);
+    _release(dir);
+    return result;
+}
+
+int yfs_client::readdirplus(inum dir, unsigned long long pos, int max, std::list<dirent>& list) {
+    _acquire(dir);
+    int result = _readdir(dir, pos, max, list, true);
+    _release(dir);
+    return result;
+}
+
+// Part of a listing, from pos on. pos is 0 at first and then the next of the
+// last entry seen; an empty list marks the end. plus also brings the
+// attributes of the entries, which are kept as hints.
+int yfs_client::_readdir(inum dir, unsigned long long pos, int max, std::list<dirent>& list, bool plus) {
+    list.clear();
+    dirent entry;
+    memset(&entry.a, 0, sizeof(entry.a));
+
+    // one entry per version, positioned by its number
+    if (dir == SNAPSHOT_ROOT) {
+        int count;
+
+        if (ec->snapshot_count(count) != extent_protocol::OK) {
+            return IOERR;
+        }
 
-    for (std::list<dirent>::iterator it = entries.begin(); it != entries.end();
-         ++it) {
-        ost << it->name;
-        ost.put('\0');
-        ost << it->inum;
+        entry.a.type = extent_protocol::T_DIR;
+        for (unsigned long long version = pos; version < (unsigned)count && (int)list.size() < max; version++) {
+            std::ostringstream ost;
+            ost << version;
+            entry.name = ost.str();
+            entry.inum = _snapshot_inum(version, 1);
+            entry.next = version + 1;
+            list.push_back(entry);
+        }
+        return OK;
     }
 
-    // write to file
-    if (ec->put(dir, ost.str()) != extent_protocol::OK) {
-        printf("   writedir: fail to write directory\n");
+    int version = _snapshot_version(dir);
+
+    // the server reads the blocks holding this part only
+    if (version < 0) {
+        std::vector<extent_protocol::dirent> entries;
+        extent_protocol::status ret = plus ? ec->dir_readplus(dir, pos, max, entries) :
+                ec->dir_read(dir, pos, max, entries);
+
+        if (ret != extent_protocol::OK) {
+            return IOERR;
+        }
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            entry.name = entries[i].name;
+            entry.inum = entries[i].inum;
+            entry.next = entries[i].next;
+            entry.a    = entries[i].a;
+            list.push_back(entry);
+
+            _cache_dentry(dir, entry.name.c_str(), entry.inum);
+            if (plus && entry.a.type != 0) {
+                _hint_attr(entry.inum, entry.a);
+            }
+        }
+        return OK;
+    }
+
+    // a snapshot is read whole, its entries stay in the same snapshot
+    std::string content;
+
+    if (_get(dir, content) != OK) {
         return IOERR;
     }
 
+    hashdir::memory storage(content);
+    std::list<hashdir::entry> entries;
+
+    if (hashdir::scan(storage, pos, max, entries) != hashdir::OK) {
+        return IOERR;
+    }
+
+    for (std::list<hashdir::entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        entry.name = it->name;
+        entry.inum = _snapshot_inum(version, it->inum);
+        entry.next = it->next;
+        list.push_back(entry);
+    }
+
+    // the attributes of all entries are asked for at once
+    if (plus) {
+        std::vector<extent_call *> calls;
+        std::list<dirent>::iterator it;
+
+        for (it = list.begin(); it != list.end(); ++it) {
+            calls.push_back(ec->async_snapshot_getattr(version, it->inum & 0xffffffff, it->a));
+        }
+
+        int result = OK;
+        for (size_t i = 0; i < calls.size(); i++) {
+            if (ec->wait(calls[i]) != extent_protocol::OK) {
+                result = IOERR;
+            }
+        }
+        return result;
+    }
+
     return OK;
 }
 
 // Only support set size of attr
 int yfs_client::setattr(inum ino, filestat st, unsigned long toset) {
+    if (issnapshot(ino)) {
+        return RDONLY;
+    }
+
     _acquire(ino);
     int result = _setattr(ino, st, toset);
     _release(ino);
@@ -296,6 +867,10 @@ int yfs_client::setattr(inum ino, filestat st, unsigned long toset) {
 }
 
 int yfs_client::setattr(inum ino, size_t size) {
+    if (issnapshot(ino)) {
+        return RDONLY;
+    }
+
     _acquire(ino);
     int result = _setattr(ino, size);
     _release(ino);
@@ -305,12 +880,12 @@ int yfs_client::setattr(inum ino, size_t size) {
 int yfs_client::_setattr(inum ino, size_t size) {
     // keep off invalid input
     if (ino <= 0) {
-        printf("   setattr: invalid inode number %llu\n", ino);
+        LOG(WARN, "   setattr: invalid inode number %llu\n", ino);
         return IOERR;
     }
 
     if (size < 0) {
-        printf("   setattr: size cannot be negative %lu\n", size);
+        LOG(WARN, "   setattr: size cannot be negative %lu\n", size);
         return IOERR;
     }
 
@@ -318,7 +893,7 @@ int yfs_client::_setattr(inum ino, size_t size) {
     std::string content;
 
     if (ec->get(ino, content) != extent_protocol::OK) {
-        printf("   setattr: fail to read content\n");
+        LOG(WARN, "   setattr: fail to read content\n");
         return IOERR;
     }
 
@@ -329,9 +904,11 @@ int yfs_client::_setattr(inum ino, size_t size) {
 
     // resize and write back
     content.resize(size);
+    _forget_attr(ino);
+    _forget_data(ino);
 
     if (ec->put(ino, content) != extent_protocol::OK) {
-        printf("   setattr: failt to write content\n");
+        LOG(WARN, "   setattr: failt to write content\n");
         return IOERR;
     }
 
@@ -343,95 +920,99 @@ int yfs_client::_setattr(inum ino, filestat st, unsigned long toset) {
     return OK;
 }
 
-int yfs_client::create(inum parent, const char *name, mode_t mode, inum& ino_out) {
-    if (VERBOSE) {
-        std::cout << "yc: create file " << name << " under inum " << parent << std::endl;
+int yfs_client::create(inum parent, const char *name, mode_t mode, inum& ino_out, extent_protocol::attr *a) {
+    if (issnapshot(parent)) {
+        return RDONLY;
     }
 
+    LOG(DEBUG, "yc: create file %s under inum %llu\n", name, parent);
+
     _acquire(parent);
-    int result = _create(parent, name, mode, ino_out);
+    int result = _create(parent, name, mode, ino_out, a);
     _release(parent);
     return result;
 }
 
-int yfs_client::_create(inum parent, const char *name, mode_t mode, inum& ino_out) {
-    // on exist, return EXIST
-    if (_has_duplicate(parent, name)) {
-        return EXIST;
-    }
-
-    // create file first
-    if (ec->create(extent_protocol::T_FILE, ino_out) != extent_protocol::OK) {
-        printf("   create: fail to create file\n");
-        return IOERR;
-    }
-
-    // write back
-    if (_add_entry_and_save(parent, name, ino_out) == false) {
-        return IOERR;
-    }
-
-    return OK;
+int yfs_client::_create(inum parent, const char *name, mode_t mode, inum& ino_out, extent_protocol::attr *a) {
+    return _create_entry(parent, name, extent_protocol::T_FILE, ino_out, a);
 }
 
-int yfs_client::read(inum ino, size_t size, off_t off, std::string& data) {
-    if (VERBOSE) {
-        std::cout << "yc: read file, inum: " << ino << ", size: " << size << ", offset: " << off << std::endl;
-    }
+int yfs_client::read(inum ino, size_t size, off_t off, std::string& data, readahead *ra) {
+    LOG(DEBUG, "yc: read file, inum: %llu, size: %lu, offset: %ld\n", ino, size, (long) off);
 
     _acquire(ino);
-    int result = _read(ino, size, off, data);
+    int result = _read(ino, size, off, data, ra);
     _release(ino);
     return result;
 }
 
-int yfs_client::_read(inum ino, size_t size, off_t off, std::string& data) {
+int yfs_client::_read(inum ino, size_t size, off_t off, std::string& data, readahead *ra) {
     // keep off invalid input
     if (ino <= 0) {
-        printf("   read: invalid inode number %llu\n", ino);
+        LOG(WARN, "   read: invalid inode number %llu\n", ino);
         return IOERR;
     }
 
     if (size < 0) {
-        printf("   read: size cannot be negative %lu\n", size);
+        LOG(WARN, "   read: size cannot be negative %lu\n", size);
         return IOERR;
     }
 
     if (off < 0) {
-        printf("   read: offset cannot be negative %li\n", off);
+        LOG(WARN, "   read: offset cannot be negative %li\n", off);
         return IOERR;
     }
 
     // return IOERR if offset is beyond file size
     extent_protocol::attr a;
 
-    if (ec->getattr(ino, a) != extent_protocol::OK) {
-        printf("   read: error getting attr\n");
+    if (_getattr(ino, a) != OK) {
+        LOG(WARN, "   read: error getting attr\n");
         return IOERR;
     }
 
     if (off >= a.size) {
-        printf("   read: offset %li beyond file size %u\n", off, a.size);
+        LOG(WARN, "   read: offset %li beyond file size %u\n", off, a.size);
         return IOERR;
     }
 
-    // read the file and get desired data
-    std::string content;
+    // snapshots are read whole
+    if (issnapshot(ino)) {
+        std::string content;
 
-    if (ec->get(ino, content) != extent_protocol::OK) {
-        printf("   read: fail to read file\n");
-        return IOERR;
+        if (_get(ino, content) != OK) {
+            LOG(WARN, "   read: fail to read file\n");
+            return IOERR;
+        }
+
+        data.assign(content, off, size);
+        return OK;
+    }
+
+    // only the range asked for, unless it was read ahead
+    size = std::min(size, (size_t)(a.size - off));
+
+    if (!_cached_data(ino, off, size, data)) {
+        if (ec->get_range(ino, off, size, data) != extent_protocol::OK) {
+            LOG(WARN, "   read: fail to read file\n");
+            return IOERR;
+        }
+        _cache_data(ino, off, data);
     }
 
-    data = content.substr(off, size);
+    if (ra) {
+        _read_ahead(ino, off, off + size, a.size, ra);
+    }
     return OK;
 }
 
 int yfs_client::write(inum ino, size_t size, off_t off, const char *data, size_t& bytes_written) {
-    if (VERBOSE) {
-        std::cout << "yc: write file, inum: " << ino << ", size: " << size << ", offset: " << off << std::endl;
+    if (issnapshot(ino)) {
+        return RDONLY;
     }
 
+    LOG(DEBUG, "yc: write file, inum: %llu, size: %lu, offset: %ld\n", ino, size, (long) off);
+
     _acquire(ino);
     int result = _write(ino, size, off, data, bytes_written);
     _release(ino);
@@ -441,17 +1022,17 @@ int yfs_client::write(inum ino, size_t size, off_t off, const char *data, size_t
 int yfs_client::_write(inum ino, size_t size, off_t off, const char *data, size_t& bytes_written) {
     // keep off invalid input
     if (ino <= 0) {
-        printf("   write: invalid inode number %llu\n", ino);
+        LOG(WARN, "   write: invalid inode number %llu\n", ino);
         return IOERR;
     }
 
     if (size < 0) {
-        printf("   write: size cannot be negative %lu\n", size);
+        LOG(WARN, "   write: size cannot be negative %lu\n", size);
         return IOERR;
     }
 
     if (off < 0) {
-        printf("   write: offset cannot be negative %li\n", off);
+        LOG(WARN, "   write: offset cannot be negative %li\n", off);
         return IOERR;
     }
 
@@ -459,7 +1040,7 @@ int yfs_client::_write(inum ino, size_t size, off_t off, const char *data, size_
     std::string content;
 
     if (ec->get(ino, content) != extent_protocol::OK) {
-        printf("   write: fail to read file\n");
+        LOG(WARN, "   write: fail to read file\n");
         return IOERR;
     }
 
@@ -471,19 +1052,25 @@ int yfs_client::_write(inum ino, size_t size, off_t off, const char *data, size_
         content.replace(off, off + size <= content.size() ? size : content.size() - off, data, size);
     }
 
+    _forget_attr(ino);
+    _forget_data(ino);
+
     if (ec->put(ino, content) != extent_protocol::OK) {
-        printf("   write: fail to write file\n");
+        LOG(WARN, "   write: fail to write file\n");
         return IOERR;
     }
 
+    bytes_written = size;
     return OK;
 }
 
-int yfs_client::unlink(inum parent, const char *name) {
-    if (VERBOSE) {
-        std::cout << "yc: unlink file " << name << "under inum " << parent << std::endl;
+int yfs_client::unlink(inum parent, const char *name, bool open) {
+    if (issnapshot(parent)) {
+        return RDONLY;
     }
 
+    LOG(DEBUG, "yc: unlink file %s under inum %llu\n", name, parent);
+
     _acquire(parent);
     bool found;
     inum ino;
@@ -498,65 +1085,122 @@ int yfs_client::unlink(inum parent, const char *name) {
         return IOERR;
     }
     _acquire(ino);
-    int result = _unlink(parent, name);
+    int result = _unlink(parent, name, open);
     _release(ino);
     _release(parent);
     return result;
 }
 
-int yfs_client::_unlink(inum parent, const char *name) {
-    printf("   unlink: try to unlink %s from parent %llu\n", name, parent);
+int yfs_client::_unlink(inum parent, const char *name, bool open) {
+    LOG(DEBUG, "   unlink: try to unlink %s from parent %llu\n", name, parent);
 
     // invalid inode number
     if (parent <= 0) {
-        printf("   unlink: invalid inode number %llu\n", parent);
+        LOG(WARN, "   unlink: invalid inode number %llu\n", parent);
         return IOERR;
     }
 
-    // read entries
-    std::list<dirent> entries;
+    // locate target inode number
+    inum ino;
 
-    if (_readdir(parent, entries) != OK) {
+    if (ec->dir_lookup(parent, name, ino) != extent_protocol::OK) {
+        LOG(INFO, "   unlink: no such file or directory %s\n", name);
         return IOERR;
     }
 
-    // locate target inode number
-    std::list<dirent>::iterator it;
-
-    for (it = entries.begin(); it != entries.end(); ++it) {
-        if (it->name == name) {
-            break;
-        }
+    if (!_isfile(ino)) {
+        return IOERR;
     }
 
-    if (it == entries.end()) {
-        printf("   unlink: no such file or directory %s\n", name);
+    // remove the entry, the server frees the file with its last link
+    _forget_attr(parent);
+    _forget(ino);
+
+    if (ec->dir_unlink(parent, name, open, ino) != extent_protocol::OK) {
+        LOG(WARN, "   unlink: fail to remove file %s\n", name);
         return IOERR;
     }
 
-    if (!_isfile(it->inum)) {
-        return IOERR;
+    _cache_dentry(parent, name, 0);
+    return OK;
+}
+
+// A file unlinked while open lives on without a name. The last close
+// frees it here, unless it got a new link in the meantime.
+int yfs_client::remove_orphan(inum ino) {
+    LOG(DEBUG, "yc: remove orphan %llu\n", ino);
+
+    _acquire(ino);
+    extent_protocol::attr a;
+    int result = OK;
+
+    _forget(ino);
+    if (ec->getattr(ino, a) != extent_protocol::OK) {
+        result = IOERR;
+    } else if (a.type != 0 && a.nlink == 0 && ec->remove(ino) != extent_protocol::OK) {
+        result = IOERR;
+    }
+    _release(ino);
+    return result;
+}
+
+// The parent is locked before the inode, as for unlink. No links to
+// directories, the tree stays a tree and a parent is never locked after
+// its child.
+int yfs_client::link(inum ino, inum parent, const char *name) {
+    if (issnapshot(parent) || issnapshot(ino)) {
+        return RDONLY;
     }
 
-    // remove file and entry in directory
-    if (ec->remove(it->inum) != extent_protocol::OK) {
-        printf("   unlink: fail to remove file %s\n", name);
-        return IOERR;
+    if (isdir(ino)) {
+        return ISDIR;
     }
 
-    entries.erase(it);
+    LOG(DEBUG, "yc: link inum %llu as %s under inum %llu\n", ino, name, parent);
+
+    _acquire(parent);
+    _acquire(ino);
+    int result = _link(ino, parent, name);
+    _release(ino);
+    _release(parent);
+    return result;
+}
+
+int yfs_client::_link(inum ino, inum parent, const char *name) {
+    bool found;
+    inum old;
 
-    if (_writedir(parent, entries) != OK) {
+    if (_lookup(parent, name, found, old) != OK) {
         return IOERR;
     }
+
+    if (found) {
+        return EXIST;
+    }
+
+    _forget_attr(parent);
+    _forget_attr(ino);
+
+    extent_protocol::status ret = ec->dir_link(parent, name, ino);
+    if (ret == extent_protocol::EXIST) {
+        return EXIST;
+    }
+    if (ret != extent_protocol::OK) {
+        LOG(WARN, "   link: fail to link %llu as %s\n", ino, name);
+        return ret == extent_protocol::NOENT ? NOENT : IOERR;
+    }
+
+    _cache_dentry(parent, name, ino);
     return OK;
 }
 
 int yfs_client::symlink(inum parent, const char *link, const char *name, inum& ino_out) {
-    if (VERBOSE) {
-        std::cout << "yc: slink path " << link << " to " << name << "under inum " << parent << std::endl;
+    if (issnapshot(parent)) {
+        return RDONLY;
     }
 
+    LOG(DEBUG, "yc: slink path %s to %s under inum %llu\n", link, name, parent);
+
     _acquire(parent);
     int result = _symlink(parent, link, name, ino_out);
     _release(parent);
@@ -566,19 +1210,19 @@ int yfs_client::symlink(inum parent, const char *link, const char *name, inum& i
 int yfs_client::_symlink(inum parent, const char *link, const char *name, inum& ino_out) {
     // keep off invalid input
     if (parent <= 0) {
-        printf("   symlink: invalid inode number %llu\n", parent);
+        LOG(WARN, "   symlink: invalid inode number %llu\n", parent);
         return IOERR;
     }
 
     // create file first
     if (ec->create(extent_protocol::T_SLINK, ino_out) != extent_protocol::OK) {
-        printf("   symlink: fail to create directory\n");
+        LOG(WARN, "   symlink: fail to create directory\n");
         return IOERR;
     }
 
     // write path to file
     if (ec->put(ino_out, link) != extent_protocol::OK) {
-        printf("   symlink: fail to write link\n");
+        LOG(WARN, "   symlink: fail to write link\n");
         return IOERR;
     }
 
@@ -591,9 +1235,7 @@ int yfs_client::_symlink(inum parent, const char *link, const char *name, inum&
 }
 
 int yfs_client::readslink(inum ino, std::string& path) {
-    if (VERBOSE) {
-        std::cout << "yc: read slink, inum: " << ino << std::endl;
-    }
+    LOG(DEBUG, "yc: read slink, inum: %llu\n", ino);
 
     _acquire(ino);
     int result = _readslink(ino, path);
@@ -604,13 +1246,13 @@ int yfs_client::readslink(inum ino, std::string& path) {
 int yfs_client::_readslink(inum ino, std::string& path) {
     // keep off invalid input
     if (ino <= 0) {
-        printf("   readslink: invalid inode number %llu\n", ino);
+        LOG(WARN, "   readslink: invalid inode number %llu\n", ino);
         return IOERR;
     }
 
     // read path
-    if (ec->get(ino, path) != extent_protocol::OK) {
-        printf("   readslink: fail to read path\n");
+    if (_get(ino, path) != OK) {
+        LOG(WARN, "   readslink: fail to read path\n");
         return IOERR;
     }
 
@@ -618,10 +1260,12 @@ int yfs_client::_readslink(inum ino, std::string& path) {
 }
 
 int yfs_client::rmdir(inum parent, const char *name) {
-    if (VERBOSE) {
-        std::cout << "yc: rmdir, name: " << name << ", parent: " << parent << std::endl;
+    if (issnapshot(parent)) {
+        return RDONLY;
     }
 
+    LOG(DEBUG, "yc: rmdir, name: %s, parent: %llu\n", name, parent);
+
     _acquire(parent);
     bool found;
     inum ino;
@@ -643,74 +1287,255 @@ int yfs_client::rmdir(inum parent, const char *name) {
 }
 
 int yfs_client::_rmdir(inum parent, const char *name) {
-    printf("   rmdir: try to remove directory %s from parent %llu\n", name, parent);
+    LOG(DEBUG, "   rmdir: try to remove directory %s from parent %llu\n", name, parent);
 
     // invalid inode number
     if (parent <= 0) {
-        printf("   rmdir: invalid inode number %llu\n", parent);
+        LOG(WARN, "   rmdir: invalid inode number %llu\n", parent);
         return IOERR;
     }
 
-    // read entries
-    std::list<dirent> entries;
+    // locate target inode number
+    inum ino;
 
-    if (_readdir(parent, entries) != OK) {
+    if (ec->dir_lookup(parent, name, ino) != extent_protocol::OK) {
+        LOG(INFO, "   rmdir: no such file or directory %s\n", name);
         return IOERR;
     }
 
-    // locate target inode number
-    std::list<dirent>::iterator it;
+    // check if target is an empty directory, the count is kept in its first
+    // block. the type comes along, unless it is cached.
+    extent_protocol::attr a;
+    std::string header;
+    extent_call *attr_call = _cached_attr(ino, a) ? NULL : ec->async_getattr(ino, a);
+    extent_call *header_call = ec->async_get_block(ino, 0, header);
+    extent_protocol::status attr_ret = attr_call ? ec->wait(attr_call) : extent_protocol::OK;
+    extent_protocol::status ret = ec->wait(header_call);
 
-    for (it = entries.begin(); it != entries.end(); ++it) {
-        if (it->name == name) {
-            break;
-        }
+    if (attr_ret != extent_protocol::OK || a.type != extent_protocol::T_DIR) {
+        return IOERR;
     }
 
-    if (it == entries.end()) {
-        printf("   rmdir: no such file or directory %s\n", name);
+    if (ret != extent_protocol::OK && ret != extent_protocol::NOENT) {
         return IOERR;
     }
 
-    if (!_isdir(it->inum)) {
+    hashdir::memory sub(header);
+    int count;
+
+    if (hashdir::count(sub, count) != hashdir::OK) {
+        return IOERR;
+    }
+
+    if (count != 0) {
+        LOG(INFO, "   rmdir: target directory %s is not empty\n", name);
         return IOERR;
     }
 
-    // check if target directory is empty
-    std::list<dirent> sub_entries;
+    // remove the entry, then the directory it named, as unlink does
+    _forget_attr(parent);
+    _forget(ino);
 
-    if (_readdir(it->inum, sub_entries) != OK) {
+    inum removed;
+    if (ec->dir_remove(parent, name, removed) != extent_protocol::OK) {
+        LOG(WARN, "   rmdir: fail to remove entry %s\n", name);
         return IOERR;
     }
 
-    if (sub_entries.size() != 0) {
-        printf("   rmdir: target directory %s is not empty\n", name);
+    if (ec->remove(ino) != extent_protocol::OK) {
+        LOG(WARN, "   rmdir: fail to remove directory %s\n", name);
         return IOERR;
     }
 
-    // remove file and entry in directory
-    if (ec->remove(it->inum) != extent_protocol::OK) {
-        printf("   rmdir: fail to remove directory %s\n", name);
+    _cache_dentry(parent, name, 0);
+
+    return OK;
+}
+
+// Unlink, rmdir and link lock a directory before an inode in it, so the
+// parents are locked the upper one first. Renames between directories take
+// RENAME_LOCK before, one at a time in the whole file system, so what lies
+// under what holds still until both are locked. The inode replaced at the
+// destination is locked after them. open keeps that inode after its last
+// link is gone, as for unlink.
+int yfs_client::rename(inum src, const char *src_name, inum dst, const char *dst_name, bool open) {
+    if (issnapshot(src) || issnapshot(dst)) {
+        return RDONLY;
+    }
+
+    LOG(DEBUG, "yc: rename %s under inum %llu to %s under inum %llu\n", src_name, src, dst_name, dst);
+
+    if (src == dst) {
+        _acquire(src);
+        int result = _rename(src, src_name, dst, dst_name, open);
+        _release(src);
+        return result;
+    }
+
+    lc->acquire(RENAME_LOCK);
+    bool below;
+    if (ec->dir_below(src, dst, below) != extent_protocol::OK) {
+        lc->release(RENAME_LOCK);
+        return IOERR;
+    }
+
+    inum upper = below ? dst : src;
+    inum lower = below ? src : dst;
+    _acquire(upper);
+    _acquire(lower);
+
+    int result = _rename(src, src_name, dst, dst_name, open);
+
+    _release(lower);
+    _release(upper);
+    lc->release(RENAME_LOCK);
+    return result;
+}
+
+int yfs_client::_rename(inum src, const char *src_name, inum dst, const char *dst_name, bool open) {
+    bool found;
+    inum ino, old;
+
+    if (_lookup(src, src_name, found, ino) != OK) {
         return IOERR;
     }
 
-    entries.erase(it);
+    if (!found) {
+        return NOENT;
+    }
+
+    if (_lookup(dst, dst_name, found, old) != OK) {
+        return IOERR;
+    }
+
+    if (found && old == ino) {
+        return OK;
+    }
+
+    // the destination is the directory moved from, it is locked already
+    // and holds the moved inode
+    if (found && old == src) {
+        return _isdir(ino, true) ? NOTEMPTY : ISDIR;
+    }
+
+    // a directory only replaces an empty directory, a file only a file.
+    // types never change, the hints will do for them.
+    if (found) {
+        bool dir = _isdir(ino, true);
+        _acquire(old);
+
+        int result = OK;
+        if (dir && !_isdir(old, true)) {
+            result = NOTDIR;
+        } else if (!dir && _isdir(old, true)) {
+            result = ISDIR;
+        } else if (dir) {
+            std::string header;
+            extent_protocol::status ret = ec->get_block(old, 0, header);
+            hashdir::memory sub(header);
+            int count;
+
+            if (ret != extent_protocol::OK && ret != extent_protocol::NOENT) {
+                result = IOERR;
+            } else if (hashdir::count(sub, count) != hashdir::OK) {
+                result = IOERR;
+            } else if (count != 0) {
+                result = NOTEMPTY;
+            }
+        }
+
+        if (result != OK) {
+            _release(old);
+            return result;
+        }
+    }
+
+    _forget_attr(src);
+    _forget_attr(dst);
+
+    extent_protocol::extentid_t replaced;
+    extent_protocol::status ret = ec->dir_rename(src, src_name, dst, dst_name, open, replaced);
+
+    if (found) {
+        _forget(old);
+        _release(old);
+    }
+
+    // the server keeps a directory from moving under itself
+    if (ret == extent_protocol::INVAL) {
+        LOG(INFO, "   rename: %s would move under itself\n", src_name);
+        return EINVA;
+    }
 
-    if (_writedir(parent, entries) != OK) {
+    if (ret != extent_protocol::OK) {
+        LOG(WARN, "   rename: fail to move %s to %s\n", src_name, dst_name);
         return IOERR;
     }
 
+    _cache_dentry(src, src_name, 0);
+    _cache_dentry(dst, dst_name, ino);
     return OK;
 }
 
+// Writes held back by the caller belong to the current version, they go
+// out before it is committed or left.
+void yfs_client::_flush_all() {
+    inum inum;
+    off_t off;
+    std::string data;
+    size_t written;
+
+    while (wb && wb->take_any(inum, off, data)) {
+        if (write(inum, data.size(), off, data.data(), written) != OK)
+            LOG(ERROR, "   flush: fail to write %lu bytes of %llu\n", data.size(), inum);
+    }
+}
+
+// what was held back while switching versions would land on the new one
+void yfs_client::_drop_all() {
+    inum inum;
+    off_t off;
+    std::string data;
+
+    while (wb && wb->take_any(inum, off, data))
+        LOG(WARN, "   switch: drop %lu bytes of %llu\n", data.size(), inum);
+}
+
 int yfs_client::commit() {
+    _flush_all();
     return ec->commit();
 }
 
+// Moving to another version changes any inode, so every client is made to
+// give back its locks and drop what it cached under them, without writing
+// back anything on the way.
+int yfs_client::_switched(int ret) {
+    _drop_all();
+    _forget_all();
+    lc->revoke_all();
+    return ret;
+}
+
 int yfs_client::rollback() {
-    return ec->rollback();
+    _flush_all();
+    return _switched(ec->rollback());
 }
 
 int yfs_client::forward() {
-    return ec->forward();
+    _flush_all();
+    return _switched(ec->forward());
+}
+
+int yfs_client::checkout(int version) {
+    _flush_all();
+    return _switched(ec->checkout(version));
+}
+
+int yfs_client::tag(const char *name) {
+    return ec->tag(name);
+}
+
+int yfs_client::checkout_tag(const char *name) {
+    _flush_all();
+    return _switched(ec->checkout_tag(name));
 }
@@ -3,12 +3,15 @@
 
 #include <string>
 #include <set>
+#include <map>
 
 #include "lock_protocol.h"
 #include "lock_client.h"
+#include "lock_client_cache.h"
 
 //#include "yfs_protocol.h"
 #include "extent_client.h"
+#include "hashdir.h"
 #include <vector>
 
 
@@ -16,15 +19,71 @@
 #define USERFILE	"./etc/passwd"
 #define GROUPFILE	"./etc/group"
 
+// read-only views of committed versions live under /.snapshots/<n>.
+// a snapshot inum keeps the version plus one in its upper 32 bits.
+#define SNAPSHOT_DIR	".snapshots"
+#define SNAPSHOT_ROOT	0xffffffffULL
 
-class yfs_client {
+// how long attributes returned by readdirplus answer getattr without a lock
+#define ATTR_HINT_TIMEOUT	1.0
+
+// read-ahead. a read that starts where the last one of the same open file
+// ended doubles the window, from READAHEAD_MIN up to READAHEAD_MAX, and
+// that much past it is fetched in the background.
+#define READAHEAD_MIN	(16 * 1024)
+#define READAHEAD_MAX	(128 * 1024)
+
+// lock of renames between directories, no inode has this number
+#define RENAME_LOCK	0x80000000ULL
+
+
+// Writes the caller holds back, handed over when the lock of their file is
+// about to leave the client.
+class write_behind {
+ public:
+    virtual ~write_behind() {}
+    // one pending write to inum, false once there is none
+    virtual bool take(unsigned long long inum, off_t &off, std::string &data) = 0;
+    // one pending write to any file, false once there is none
+    virtual bool take_any(unsigned long long &inum, off_t &off, std::string &data) = 0;
+};
+
+// Attributes and directory entries of live inodes are cached while the
+// client keeps the lock on the inode, the parent's lock for an entry. They
+// are dropped when the lock server revokes the lock. Attributes that come
+// with a listing serve as hints for ATTR_HINT_TIMEOUT, like the kernel's
+// attribute cache.
+class yfs_client : public lock_release_user {
     extent_client *ec;
-    lock_client *lc;
+    lock_client_cache *lc;
+    write_behind *wb;
+
+    typedef std::map<std::string, unsigned long long> dentries;  // name -> inum, 0 if absent
+    std::map<unsigned long long, extent_protocol::attr> attr_cache;
+    std::map<unsigned long long, dentries> dentry_cache;
+    std::map<unsigned long long, std::pair<double, extent_protocol::attr> > attr_hints;  // expiry, attr
+    pthread_mutex_t cache_mutex;
+
+    // file data read or fetched ahead, cached like the attributes
+    struct prefetched {
+        off_t off;          // where data starts
+        std::string data;
+        off_t queued;       // end of what is fetched or asked for
+    };
+    struct prefetch_req {
+        unsigned long long inum;
+        off_t off;
+        size_t size;
+    };
+    std::map<unsigned long long, prefetched> data_cache;
+    std::list<prefetch_req> to_prefetch;
+    pthread_cond_t prefetch_cond;
 
 public:
     typedef unsigned long long inum;
     enum xxstatus {
-        OK, RPCERR, NOENT, IOERR, EXIST, NOPEM, ERRPEM, EINVA, ECTIM, ENUSE};
+        OK, RPCERR, NOENT, IOERR, EXIST, NOPEM, ERRPEM, EINVA, ECTIM, ENUSE, RDONLY,
+        NOTDIR, ISDIR, NOTEMPTY};
 
     typedef int status;
 
@@ -37,6 +96,7 @@ public:
 
     struct fileinfo {
         unsigned long long size;
+        unsigned int nlink;
         unsigned long atime;
         unsigned long mtime;
         unsigned long ctime;
@@ -57,35 +117,69 @@ public:
     struct dirent {
         std::string name;
         yfs_client::inum inum;
+        unsigned long long next;  // where a partial listing resumes after this entry
+        extent_protocol::attr a;  // from readdirplus or a whole listing, type 0 if unknown
+    };
+
+    // how one open file has been read, see READAHEAD_MIN
+    struct readahead {
+        off_t next;     // where a sequential read starts
+        size_t window;  // 0 until the reads look sequential
+        readahead() : next(0), window(0) {}
     };
 
  private:
+
     void _acquire(inum);
     void _release(inum);
 
-    bool _has_duplicate(inum, const char *);
+    bool _cached_attr(inum, extent_protocol::attr &);
+    void _cache_attr(inum, const extent_protocol::attr &);
+    void _forget_attr(inum);
+    bool _cached_dentry(inum, const char *, bool &, inum &);
+    void _cache_dentry(inum, const char *, inum);
+    void _forget(inum);
+    void _forget_all();
+    bool _hinted_attr(inum, extent_protocol::attr &);
+    void _hint_attr(inum, const extent_protocol::attr &);
+    bool _cached_data(inum, off_t, size_t, std::string &);
+    void _cache_data(inum, off_t, const std::string &);
+    void _forget_data(inum);
+    void _read_ahead(inum, off_t, off_t, off_t, readahead *);
+    void _flush_all();
+    void _drop_all();
+    int _switched(int);
+
+    static inum _snapshot_inum(int, inum);
+    static int _snapshot_version(inum);
+    int _getattr(inum, extent_protocol::attr &, bool hint = false);
+    int _get(inum, std::string &);
+
     bool _add_entry_and_save(inum, const char *, inum);
+    int _create_entry(inum, const char *, uint32_t, inum &, extent_protocol::attr *);
 
-    bool _isfile(inum);
-    bool _isdir(inum);
+    bool _isfile(inum, bool hint = false);
+    bool _isdir(inum, bool hint = false);
 
-    int _getfile(inum, fileinfo &);
-    int _getdir(inum, dirinfo &);
-    int _getslink(inum, slinkinfo&);
+    int _getfile(inum, fileinfo &, bool hint = false);
+    int _getdir(inum, dirinfo &, bool hint = false);
+    int _getslink(inum, slinkinfo&, bool hint = false);
 
     int _setattr(inum, size_t);
     int _setattr(inum, filestat, unsigned long);
-    int _lookup(inum, const char *, bool &, inum &);
-    int _create(inum, const char *, mode_t, inum &);
-    int _writedir(inum, std::list<dirent>&);
+    int _lookup(inum, const char *, bool &, inum &, extent_protocol::attr *a = NULL);
+    int _create(inum, const char *, mode_t, inum &, extent_protocol::attr *);
     int _readdir(inum, std::list<dirent> &);
+    int _readdir(inum, unsigned long long, int, std::list<dirent> &, bool);
     int _write(inum, size_t, off_t, const char *, size_t &);
-    int _read(inum, size_t, off_t, std::string &);
-    int _unlink(inum,const char *);
-    int _mkdir(inum , const char *, mode_t , inum &);
+    int _read(inum, size_t, off_t, std::string &, readahead *);
+    int _unlink(inum, const char *, bool);
+    int _mkdir(inum , const char *, mode_t , inum &, extent_protocol::attr *);
     int _symlink(inum, const char *, const char *, inum&);
     int _readslink(inum, std::string&);
     int _rmdir(inum, const char *);
+    int _rename(inum, const char *, inum, const char *, bool);
+    int _link(inum, inum, const char *);
 
  public:
     yfs_client();
@@ -93,6 +187,10 @@ public:
 
     bool isfile(inum);
     bool isdir(inum);
+    bool issnapshot(inum);
+    bool cached(inum);
+    void dorelease(lock_protocol::lockid_t);
+    void set_write_behind(write_behind *);
 
     int getfile(inum, fileinfo &);
     int getdir(inum, dirinfo &);
@@ -100,23 +198,36 @@ public:
 
     int setattr(inum, size_t);
     int setattr(inum, filestat, unsigned long);
-    int lookup(inum, const char *, bool &, inum &);
-    int create(inum, const char *, mode_t, inum &);
+    // with a, the attributes of the inode found or created where they come
+    // for free, type 0 where they do not
+    int lookup(inum, const char *, bool &, inum &, extent_protocol::attr *a = NULL);
+    int create(inum, const char *, mode_t, inum &, extent_protocol::attr *a = NULL);
     int readdir(inum, std::list<dirent> &);
+    int readdir(inum, unsigned long long pos, int max, std::list<dirent> &);
+    int readdirplus(inum, unsigned long long pos, int max, std::list<dirent> &);
     int write(inum, size_t, off_t, const char *, size_t &);
-    int read(inum, size_t, off_t, std::string &);
-    int unlink(inum,const char *);
-    int mkdir(inum , const char *, mode_t , inum &);
+    int read(inum, size_t, off_t, std::string &, readahead *ra = NULL);
+    // open keeps the file once its last link is gone, until remove_orphan
+    int unlink(inum, const char *, bool open = false);
+    int mkdir(inum , const char *, mode_t , inum &, extent_protocol::attr *a = NULL);
 
     int verify(const char* cert_file, unsigned short*);
     int symlink(inum, const char *, const char *, inum&);
     int readslink(inum, std::string&);
     int rmdir(inum, const char *);
+    int rename(inum, const char *, inum, const char *, bool open = false);
+    int link(inum, inum, const char *);
+    int remove_orphan(inum);
 
     // version control
     int commit();
     int rollback();
     int forward();
+    int checkout(int version);
+    int tag(const char *name);
+    int checkout_tag(const char *name);
+
+    void prefetcher();
 };
 
 #endif
@@ -0,0 +1,46 @@
+//
+// Version control tool, talks to extent_server directly.
+//
+
+#include "extent_protocol.h"
+#include "extent_client.h"
+#include "rpc.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [host:]port checkout <version>\n", prog);
+  fprintf(stderr, "       %s [host:]port tag <name>\n", prog);
+  fprintf(stderr, "       %s [host:]port checkout-tag <name>\n", prog);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  extent_protocol::status r;
+
+  if(argc != 4)
+    usage(argv[0]);
+
+  extent_client ec(argv[1]);
+
+  if(strcmp(argv[2], "checkout") == 0){
+    r = ec.checkout(atoi(argv[3]));
+  } else if(strcmp(argv[2], "tag") == 0){
+    r = ec.tag(argv[3]);
+  } else if(strcmp(argv[2], "checkout-tag") == 0){
+    r = ec.checkout_tag(argv[3]);
+  } else {
+    usage(argv[0]);
+  }
+
+  if(r != extent_protocol::OK){
+    fprintf(stderr, "%s %s failed: %d\n", argv[2], argv[3], r);
+    return 1;
+  }
+  return 0;
+}